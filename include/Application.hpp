@@ -15,10 +15,12 @@
 #include "Utils/Shader.hpp"
 #include "Utils/Surface.hpp"
 #include "Utils/EnvironmentMap.hpp"
+#include "Utils/GPUTimer.hpp"
 
 #include "FEM/FEMContext.hpp"
 #include "FEM/CPUSolver.hpp"
 #include "FEM/GPUSolver.hpp"
+#include "FEM/SimulationThread.hpp"
 
 #include <memory>
 #include <filesystem>
@@ -40,6 +42,8 @@ struct Settings {
 
     bool paused = false;
     bool use_gpu = false;
+    bool simulation_thread = true; // Run the CPU solver on a worker thread instead of on the main thread between frames
+    int steps_per_frame = 1; // The number of time steps taken every frame when the solver runs on the main thread
     int bvh_depth = 10;
     float brush_strength = 1.0f;
     float vertex_extrusion = 0.5f;
@@ -114,6 +118,9 @@ public:
     std::shared_ptr<Solver> solver;
     std::shared_ptr<CPUSolver> cpu_solver;
     std::shared_ptr<GPUSolver> gpu_solver;
+    std::shared_ptr<SimulationThread> simulation;
+    std::vector<float> display_values; // The values last taken from the simulation thread for rendering
+    GPUTimer render_timer;
 
     std::string fem_mesh_directory = "assets/fem_meshes";
     std::vector<std::filesystem::path> fem_mesh_obj_paths;
@@ -141,6 +148,7 @@ public:
     void switch_color_map(const char* new_color_map);
     void switch_mode(InteractMode mode);
     void export_to_ply();
+    void export_trace();
     void load_stencil_image();
 
     int brush(glm::vec3 world_ray, glm::vec3 origin, float value);
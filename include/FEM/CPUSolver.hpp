@@ -2,12 +2,131 @@
 
 #include "FEM/Solver.hpp"
 #include "FEM/FEMContext.hpp"
+#include "FEM/Preconditioner.hpp"
+#include "FEM/ModalBasis.hpp"
+
+#include <array>
+#include <functional>
+#include <vector>
+
+/**
+ * The method used by the CPUSolver to solve each linear system.
+ * Iterative uses the conjugate gradient method on symmetric systems and BiCGSTAB on nonsymmetric ones.
+ * Direct factorizes each system matrix once and then only performs triangular solves every time step.
+ * In matrix-free mode there is no matrix to factorize, so the iterative methods are always used.
+ */
+enum class LinearSolver {
+    Iterative = 0,
+    Direct,
+};
+
+/**
+ * The time integration scheme used by the CPUSolver.
+ * Implicit solves a linear system every time step, which is stable for any time step.
+ * The explicit schemes replace the mass matrix with the lumped mass, so every stage is a matrix-vector product and
+ * a division by the lumped mass, with no linear solve. Each time step is split into as many substeps as are needed for stability.
+ * The Wave Equation always uses leapfrog integration in the explicit modes.
+ * Spectral advances the Heat and Wave Equations exactly in the basis of the lowest frequency eigenmodes of the mesh,
+ * so any time step is stable and costs the same. The other equations, and matrix-free mode, use Implicit instead.
+ * Crank_Nicolson and BDF2 are second order implicit schemes, so they reach the accuracy of Implicit (backward Euler) with
+ * much longer time steps. Crank-Nicolson does not damp the highest frequencies, so sharp features can ring, while BDF2 damps
+ * them like Implicit. BDF2 takes an Implicit step whenever there is no previous state to start from. The reaction terms of the
+ * Reaction-Diffusion equation are treated explicitly, by Adams-Bashforth (CNAB) or by extrapolation (SBDF2).
+ */
+enum class TimeIntegrator {
+    Implicit = 0,
+    Forward_Euler,
+    Runge_Kutta_4,
+    Spectral,
+    Crank_Nicolson,
+    BDF2,
+};
+
+/**
+ * Identifies one of the linear systems solved by the CPUSolver.
+ * The Reaction-Diffusion equation solves two systems every time step.
+ */
+enum class SystemMatrix {
+    Heat = 0,
+    Advection_Diffusion,
+    Wave,
+    Reaction_Diffusion_U,
+    Reaction_Diffusion_V,
+};
+
+/**
+ * The inputs that a system matrix depends on.
+ * If any of these change, the system matrix and its solver state must be rebuilt.
+ */
+struct OperatorKey {
+    Equation equation;
+    BoundaryCondition boundary_condition;
+    LinearSolver linear_solver;
+    PreconditionerType preconditioner;
+    bool matrix_free;
+    unsigned int assembly_id;
+    OperatorCoefficients coefficients;
+
+    bool operator==(const OperatorKey& other) const = default;
+};
+
+/**
+ * A state from before the current time step, used by the multistep schemes and the time step error estimate
+ */
+struct PastState {
+    Eigen::VectorXf u;
+    Eigen::VectorXf v;
+    float time_step; // The length of the time step that followed this state
+};
+
+/**
+ * The inputs that the previous states depend on. If any of these change, the previous states are discarded.
+ */
+struct HistoryKey {
+    Equation equation;
+    TimeIntegrator time_integrator;
+    unsigned int assembly_id;
+
+    bool operator==(const HistoryKey& other) const = default;
+};
+
+/**
+ * A system matrix along with the solver state that has been set up for it
+ */
+struct CachedOperator {
+    OperatorKey key;
+    bool valid = false;
+
+    Eigen::SparseMatrix<float> A;
+    Eigen::ConjugateGradient<Eigen::SparseMatrix<float>, Eigen::Lower|Eigen::Upper, Preconditioner> cg;
+    Eigen::BiCGSTAB<Eigen::SparseMatrix<float>, Eigen::IncompleteLUT<float>> bicgstab; // Used by the iterative solver for nonsymmetric systems
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<float>> ldlt; // Used by the direct solver for symmetric systems
+    Eigen::SparseLU<Eigen::SparseMatrix<float>> lu; // Used by the direct solver for nonsymmetric systems
+    LinearSolver linear_solver = LinearSolver::Iterative; // The solver actually set up, which is Iterative if the direct factorization failed
+    Eigen::VectorXf inverse_diagonal; // Used as the Jacobi preconditioner in matrix-free mode, where A is not formed
+    bool symmetric = true;
+};
 
 /**
  * A solver for finite element systems that uses Eigen, on the CPU
  */
 class CPUSolver : public Solver {
 public:
+    LinearSolver linear_solver = LinearSolver::Iterative;
+    PreconditionerType preconditioner = PreconditionerType::Jacobi; // Used by the conjugate gradient method on assembled matrices
+    TimeIntegrator time_integrator = TimeIntegrator::Implicit;
+    int max_substeps = 200; // The most explicit substeps taken per time step. Past this, the simulation slows down to stay stable
+    int substeps = 0; // The number of explicit substeps taken during the last time step
+    bool direct_solver_failed = false; // Whether a system in the last time step could not be factorized by the direct solver, so it was solved iteratively
+    int num_modes = 64; // The number of eigenmodes in the basis used by spectral time integration
+    bool modal_basis_converged = true; // Whether every eigenpair of the last modal basis computed converged, see ModalBasis::converged
+    float modal_basis_residual = 0.0f; // The largest relative residual of the eigenpairs of the last modal basis computed
+    bool adaptive_time_step = false; // Adjusts the equation's time step so the estimated error of each implicit step stays near tolerance
+    float tolerance = 1e-3f; // The largest estimated local error accepted per time step, relative to the size of the solution
+    int max_rejections = 8; // The most times a time step is retried with a shorter time step before it is accepted anyway
+    int rejected_steps = 0; // The number of attempts at the last time step that were rejected by the error estimate
+    float simulated_time_step = 0.0f; // The simulated time covered by the last time step, which adaptive time stepping and the substep limit can shorten
+
     CPUSolver(std::shared_ptr<FEMContext> fem_ctx);
 
     bool has_numerical_instability() override;
@@ -17,6 +136,27 @@ private:
     Eigen::VectorXf u;
     Eigen::VectorXf v;
 
+    std::array<CachedOperator, 5> operators;
+
+    ModalBasis modal_basis;
+    std::pair<unsigned int, int> modal_basis_key; // The stiffness and mass assembly and number of modes that the modal basis was computed for
+    bool modal_basis_valid = false;
+
+    std::vector<PastState> history; // The states before the current one, most recent first
+    HistoryKey history_key;
+
+    CachedOperator& get_operator(SystemMatrix system, OperatorCoefficients coefficients);
+    Eigen::VectorXf multiply(OperatorCoefficients coefficients, const Eigen::VectorXf& x);
+    Eigen::VectorXf solve(CachedOperator& op, const Eigen::VectorXf& b, const Eigen::VectorXf& guess);
+    Eigen::VectorXf matrix_free_cg(CachedOperator& op, const Eigen::VectorXf& b, const Eigen::VectorXf& guess);
+    Eigen::VectorXf matrix_free_bicgstab(CachedOperator& op, const Eigen::VectorXf& b, const Eigen::VectorXf& guess);
+    int plan_substeps(float time_step, float stable_time_step, float& substep_length);
+    void explicit_step(float time_step, float spectral_bound, bool coupled, std::function<void(const Eigen::VectorXf& u, const Eigen::VectorXf& v, Eigen::VectorXf& du, Eigen::VectorXf& dv)> rate);
+    ModalBasis& get_modal_basis();
+    int implicit_order();
+    void validate_history(const Eigen::VectorXf& last_values, const Eigen::VectorXf& surface_values);
+    void implicit_step(EquationParameters& params, std::function<void(float time_step)> step);
+    float estimate_error(float time_step, const Eigen::VectorXf& u_start, const Eigen::VectorXf& v_start);
     Eigen::VectorXf get_surface_value_vector();
     void map_vector_to_surface(const Eigen::VectorXf& vector);
 };
\ No newline at end of file
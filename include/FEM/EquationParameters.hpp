@@ -3,6 +3,8 @@
 
 struct EquationParameters {
     float time_step;
+    float min_time_step; // The range of time steps offered in the UI, which adaptive time stepping also stays within
+    float max_time_step;
 };
 
 struct HeatParameters : public EquationParameters {
@@ -10,6 +12,8 @@ struct HeatParameters : public EquationParameters {
 
     HeatParameters() {
         time_step = 0.01f;
+        min_time_step = 0.005f;
+        max_time_step = 0.25f;
         conductivity = 0.05f;
     }
 };
@@ -20,6 +24,8 @@ struct AdvectionDiffusionParameters : public EquationParameters {
 
     AdvectionDiffusionParameters() {
         time_step = 0.001f;
+        min_time_step = 0.001f;
+        max_time_step = 0.05f;
         c = 0.25f;
         velocity = {1.0f, 0.0f, 0.0f};
     }
@@ -30,6 +36,8 @@ struct WaveParameters : public EquationParameters {
     
     WaveParameters() {
         time_step = 0.05f;
+        min_time_step = 0.005f;
+        max_time_step = 0.25f;
         c = 0.05f;
     }
 };
@@ -42,6 +50,8 @@ struct ReactionDiffusionParameters : public EquationParameters {
 
     ReactionDiffusionParameters() {
         time_step = 0.001f;
+        min_time_step = 0.0001f;
+        max_time_step = 0.01f;
         Du = 0.08f;
         Dv = 0.04f;
         feed_rate = 0.035f;
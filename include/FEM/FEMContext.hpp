@@ -4,6 +4,7 @@
 #include "Utils/Surface.hpp"
 #include "FEM/EquationParameters.hpp"
 
+#include <array>
 #include <memory>
 
 enum class Equation {
@@ -18,6 +19,37 @@ enum class BoundaryCondition {
     Neumann, 
 };
 
+enum class NodeOrdering {
+    Vertex = 0,
+    Reverse_Cuthill_McKee,
+};
+
+/**
+ * The geometry of every element, stored as a structure of arrays so that each quantity is contiguous over the elements.
+ * Index k of each array belongs to element k.
+ */
+struct ElementGeometryCache {
+    std::vector<float> areas;
+    std::array<std::vector<float>, 3> normals; // normals[d] is component d of the unit normals
+    std::array<std::array<std::vector<float>, 3>, 3> gradients; // gradients[i][d] is component d of the gradients of basis function i
+    std::array<std::vector<float>, 3> velocities; // velocities[d] is component d of the advection velocity projected onto each element and normalized
+    std::array<std::vector<float>, 3> interior; // interior[i] is 1 if node i is not on the boundary and 0 otherwise
+
+    void resize(int num_elements);
+};
+
+/**
+ * The coefficients of a linear combination of the FEM matrices,
+ * mass * M + stiffness * K - advection * (advection matrix)
+ */
+struct OperatorCoefficients {
+    float mass;
+    float stiffness;
+    float advection;
+
+    bool operator==(const OperatorCoefficients& other) const = default;
+};
+
 /**
  * A class that keeps track of data needed for the finite element method
  * such as matrices, nodal value maps, equation parameters, and boundary conditions.
@@ -27,30 +59,75 @@ public:
     std::shared_ptr<Surface> surface;
     std::unordered_map<Equation, std::shared_ptr<EquationParameters>> parameters;
     std::vector<int> idx_map;
+    std::vector<int> node_map; // The vertex of each unknown, the inverse of idx_map
 
     Equation equation = Equation::Wave;
     BoundaryCondition boundary_condition = BoundaryCondition::Dirichlet;
+    NodeOrdering node_ordering = NodeOrdering::Vertex;
+    bool matrix_free = false; // Apply the FEM operators element by element instead of assembling matrices
+    bool lump_mass = false; // Use the row-sum lumped (diagonal) mass matrix in place of the consistent one
+
+    // Interpolation from the unknowns of each coarse level of the surface onto the next finer level, finest first.
+    // prolongations[0] maps the first coarse level onto this context's unknowns. Used by geometric multigrid
+    std::vector<Eigen::SparseMatrix<float>> prolongations;
+
+    // The row sums of the consistent mass matrix, one per unknown. Explicit time integration divides by these instead of solving with M
+    Eigen::VectorXf lumped_mass;
 
     FEMContext();
 
     void init_from_surface(std::shared_ptr<Surface> surface);
     void update_boundary_conditions();
     void assemble_matrices();
+    void assemble_advection_matrix();
+
+    Eigen::VectorXf apply_operator(const OperatorCoefficients& coefficients, const Eigen::VectorXf& x);
+    Eigen::VectorXf operator_diagonal(const OperatorCoefficients& coefficients);
+    float explicit_spectral_bound(const OperatorCoefficients& coefficients, float reaction_rate = 0.0f);
 
     unsigned int num_nodes();
     unsigned int num_unknowns();
     unsigned int num_max_nonzeros_per_row();
+    unsigned int matrix_bandwidth();
 private:
     int num_elements;
     int max_row_nonzeros;
+    unsigned int bandwidth;
+    unsigned int assembly_id = 0; // Incremented every time the matrices are reassembled
+    unsigned int stiffness_mass_id = 0; // Incremented every time the stiffness and mass matrices are reassembled, but not when only the advection matrix is
+    ElementGeometryCache geometry;
 
     Eigen::SparseMatrix<float> stiffness_matrix;
     Eigen::SparseMatrix<float> mass_matrix;
     Eigen::SparseMatrix<float> advection_matrix;
 
-    void assemble_stiffness_matrix();
-    void assemble_mass_matrix();
-    void assemble_advection_matrix(Eigen::Vector3f velocity);
+    // The sparsity pattern shared by all of the matrices. For each nonzero, nonzero_slots[nonzero_slot_offsets[nz]:nonzero_slot_offsets[nz + 1]]
+    // lists the element slots ((3 * i + j) * num_elements + element) whose local matrix entries are summed into it
+    std::vector<int> nonzero_slot_offsets;
+    std::vector<int> nonzero_slots;
+    std::vector<float> advection_slots;
+
+    // The sums of the absolute values of the element entries of K and of the advection matrix in each row, for explicit_spectral_bound()
+    Eigen::VectorXf stiffness_row_sums;
+    Eigen::VectorXf advection_row_sums;
+
+    // Used instead of the sparsity pattern in matrix-free mode, and for the row sums in both modes. For each unknown, node_elements[node_element_offsets[row]:node_element_offsets[row + 1]]
+    // lists the element corners (3 * element + i) at its node, and element_unknowns[i][element] is the unknown at corner i of an element (or -1)
+    std::vector<int> node_element_offsets;
+    std::vector<int> node_elements;
+    std::array<std::vector<int>, 3> element_unknowns;
+
+    void update_geometry_cache();
+    void update_advection_velocities();
+    void compute_advection_slots(int begin, int end);
+    void compute_corner_row_sums(int begin, int end, float* stiffness_sums, float* advection_sums);
+    void gather_row_sums(const float* corner_stiffness_sums, const float* corner_advection_sums);
+    void build_sparsity_pattern();
+    void build_node_adjacency();
+    void reorder_unknowns();
+    void build_prolongations();
+    float element_entry(const OperatorCoefficients& coefficients, int k, int i, int j);
+    void gather_slots(Eigen::SparseMatrix<float>& matrix, const std::vector<float>& slot_values);
     int compute_max_row_nonzeros();
 
 
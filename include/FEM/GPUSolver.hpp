@@ -1,7 +1,9 @@
 #pragma once
+#include <glad/glad.h>
 
 #include "FEM/Solver.hpp"
 #include "FEM/FEMContext.hpp"
+#include "Utils/GPUTimer.hpp"
 
 enum class BindingPoint {
     State = 0,
@@ -17,18 +19,54 @@ enum class BindingPoint {
     MatrixIndices,
     VectorU,
     VectorV,
+
+    ShadowResiduals,
+    SearchDirectionProducts,
+    IntermediateResiduals,
+    IntermediateResidualProducts,
+    BiCGSTABState,
+
+    ElementData,
+    ElementUnknowns,
+    NodeElementOffsets,
+    NodeElements,
+
+    SystemMatrix,
+    MatrixLayout,
+};
+
+/**
+ * How the GPU solver stores the FEM matrices, numbered as matrix_format in the compute shaders
+ */
+enum class MatrixFormat {
+    ELL = 0, // Every row padded to the length of the longest row
+    SELL, // SELL-C-sigma: slices of SELL_SLICE_HEIGHT rows, each padded to its longest row, after sorting the rows by length
+    CSR, // No padding, but the rows handled by neighboring invocations are not stored together
+    Automatic, // Chosen from the row lengths of the matrices
 };
 
 /**
  * A solver for finite element systems that uses the conjugate gradient method
- * implemented for the GPU on compute shaders
+ * implemented for the GPU on compute shaders. The nonsymmetric Advection-Diffusion
+ * system is solved with BiCGSTAB instead. In matrix-free mode the compute shaders
+ * apply the FEM operators from per-element data instead of assembled matrices.
  */
 class GPUSolver : public Solver {
 public:
     std::shared_ptr<ComputeShader> cgm_compute_shader;
     std::shared_ptr<ComputeShader> cgm_helper_compute_shader;
+    std::shared_ptr<ComputeShader> bicgstab_compute_shader;
 
     int max_iterations = 10;
+    bool sync_free = true; // Dispatch all max_iterations iterations without waiting for the GPU, and read the residual back once per time step
+    MatrixFormat matrix_format = MatrixFormat::Automatic; // Takes effect on the next init()
+
+    MatrixFormat active_matrix_format = MatrixFormat::ELL; // The format that the matrices are stored in, never Automatic
+    float matrix_padding = 0.0f; // The fraction of the stored matrix entries that are padding
+
+    static const int SELL_SLICE_HEIGHT = 32; // C in SELL-C-sigma, the number of rows in a slice (one warp)
+    static const int SELL_SORT_WINDOW = 256; // sigma in SELL-C-sigma, the number of consecutive rows sorted by length together
+
 
     GPUSolver(std::shared_ptr<FEMContext> fem_ctx);
     ~GPUSolver();
@@ -50,20 +88,65 @@ private:
     unsigned int stiffness_matrix;
     unsigned int mass_matrix;
     unsigned int advection_matrix;
+    unsigned int matrix_layout;
 
     unsigned int u;
     unsigned int v;
 
+    unsigned int shadow_residuals;
+    unsigned int search_direction_products;
+    unsigned int intermediate_residuals;
+    unsigned int intermediate_residual_products;
+    unsigned int bicgstab_state;
+
+    unsigned int element_data;
+    unsigned int element_unknowns;
+    unsigned int node_element_offsets;
+    unsigned int node_elements;
+
+    // mass_coefficient * M + stiffness_coefficient * K - advection_coefficient * A, combined on the GPU by use_system_matrix().
+    // There are two because the Reaction-Diffusion equation alternates between two systems every time step.
+    unsigned int system_matrices[2];
+    std::array<float, 3> system_matrix_coefficients[2];
+    bool system_matrix_valid[2] = {false, false};
+    int current_system_matrix = 0;
+
     float* residual_norm_map;
 
+    // The residual norm and iteration count of recent time steps, copied out of the state SSBO by the GPU for sync-free mode
+    struct Readback {
+        float residual_norm;
+        int iteration_count;
+    };
+    static const int NUM_READBACKS = 3; // The number of time steps that can be in flight before advance_time() waits
+    unsigned int readback = 0;
+    Readback* readback_map;
+    GLsync readback_fences[NUM_READBACKS] = {};
+    int next_readback = 0;
+    float last_residual_norm = 0.0f;
+
+    GPUTimer gpu_timer;
+
     void init_buffers();
     void bind_buffers();
 
     void load_state();
     void load_matrices();
+    void load_element_data();
+    void set_operator_uniforms();
+    void use_system_matrix(int slot, float mass_coefficient, float stiffness_coefficient, float advection_coefficient);
 
-    void dot_product(int stage);
+    void timed_dispatch(std::shared_ptr<ComputeShader> shader, const char* name, int num_groups, int barriers);
+    void dot_product(std::shared_ptr<ComputeShader> shader, int stage);
     void cgm_setup();
     void cgm();
+    void cgm_iteration();
+    void bicgstab();
+    void bicgstab_iteration();
     void cgm_cleanup();
+
+    void queue_readback();
+    void poll_readbacks();
+    void finish_readback(int slot);
+    void discard_readbacks();
 };
\ No newline at end of file
@@ -0,0 +1,22 @@
+#pragma once
+#include <Eigen/Sparse>
+#include <Eigen/Dense>
+
+/**
+ * The lowest frequency eigenpairs of the generalized eigenproblem K phi = lambda M phi, where K is the stiffness matrix
+ * and M is the mass matrix. The eigenvectors are the discrete Laplace-Beltrami eigenfunctions of the mesh, and are
+ * orthonormal with respect to M, so the coefficients of a vector u in the basis are eigenvectors^T * M * u.
+ */
+class ModalBasis {
+public:
+    static constexpr double TOLERANCE = 1e-9; // The largest relative residual of an eigenpair that counts as converged
+    static constexpr int MAX_RESTARTS = 32; // The most Lanczos runs before giving up on convergence
+
+    Eigen::VectorXf eigenvalues; // In increasing order
+    Eigen::MatrixXf eigenvectors; // One eigenvector per column
+    bool converged = false; // Whether every eigenpair met TOLERANCE, and no smaller eigenvalue was missed
+    float max_residual = 0.0f; // The largest relative residual of the eigenpairs
+
+    void compute(const Eigen::SparseMatrix<float>& K, const Eigen::SparseMatrix<float>& M, int num_modes);
+    int size() const;
+};
\ No newline at end of file
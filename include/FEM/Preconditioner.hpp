@@ -0,0 +1,102 @@
+#pragma once
+#include <Eigen/Sparse>
+
+#include <vector>
+
+/**
+ * The preconditioner used by the CPUSolver when solving symmetric systems with the conjugate gradient method.
+ * Jacobi scales by the inverse diagonal, which is cheap to build but needs more iterations as the mesh is refined.
+ * Incomplete_Cholesky uses an IC(0) factorization, which needs fewer iterations but is sequential to apply.
+ * Algebraic_Multigrid uses a smoothed aggregation V-cycle, whose iteration count stays nearly flat as the mesh is refined.
+ * Geometric_Multigrid uses a V-cycle over the coarser triangulations that the surface was refined from. It falls back to
+ * algebraic multigrid on surfaces without coarse levels, such as those loaded from .obj files.
+ */
+enum class PreconditionerType {
+    Jacobi = 0,
+    Incomplete_Cholesky,
+    Algebraic_Multigrid,
+    Geometric_Multigrid,
+};
+
+/**
+ * One level of a multigrid hierarchy
+ */
+struct MultigridLevel {
+    Eigen::SparseMatrix<float> A;
+    Eigen::SparseMatrix<float> P; // Prolongation from the next coarser level to this level
+    Eigen::SparseMatrix<float> R; // Restriction from this level to the next coarser level, the transpose of P
+    Eigen::VectorXf inverse_diagonal;
+    float smoother_weight; // The damping factor of the Jacobi smoother
+};
+
+/**
+ * A multigrid preconditioner for symmetric positive definite matrices. The coarse level matrices are Galerkin products
+ * R * A * P, so any combination of the FEM matrices is handled without reassembling on the coarse levels.
+ * One V-cycle with symmetric Jacobi smoothing is applied per preconditioner solve, so the preconditioner is symmetric
+ * and can be used by the conjugate gradient method.
+ * 
+ * build_algebraic() uses smoothed aggregation: each coarse level groups strongly connected unknowns into aggregates,
+ * whose piecewise constant prolongation is smoothed with one step of damped Jacobi.
+ * build_geometric() uses prolongations given by interpolation between nested meshes.
+ */
+class Multigrid {
+public:
+    int max_levels = 10;
+    int coarsest_size = 256; // Levels are added until the coarsest level has at most this many unknowns, which are then solved directly
+    int smoothing_steps = 2; // The number of Jacobi sweeps before and after each coarse correction
+    float strength_threshold = 0.08f; // Off-diagonal entries smaller than this relative to the diagonal are ignored when aggregating
+
+    void build_algebraic(const Eigen::SparseMatrix<float>& A);
+    void build_geometric(const Eigen::SparseMatrix<float>& A, const std::vector<Eigen::SparseMatrix<float>>& prolongations);
+    Eigen::VectorXf apply(const Eigen::VectorXf& b) const;
+    int num_levels() const;
+private:
+    std::vector<MultigridLevel> levels;
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<float>> coarsest_solver;
+
+    void v_cycle(int level, const Eigen::VectorXf& b, Eigen::VectorXf& x) const;
+    void set_smoother(MultigridLevel& level);
+    void add_coarse_level(const Eigen::SparseMatrix<float>& P);
+    static std::vector<int> aggregate(const Eigen::SparseMatrix<float>& A, float strength_threshold, int& num_aggregates);
+};
+
+/**
+ * A preconditioner whose type is chosen at runtime, with the interface that Eigen's iterative solvers expect.
+ * Set type before the solver's compute() is called. Building happens in compute(), so it runs once per matrix change.
+ */
+class Preconditioner {
+public:
+    typedef float Scalar;
+    typedef Eigen::SparseMatrix<float>::StorageIndex StorageIndex;
+    enum {
+        ColsAtCompileTime = Eigen::Dynamic,
+        MaxColsAtCompileTime = Eigen::Dynamic
+    };
+
+    PreconditionerType type = PreconditionerType::Jacobi;
+    const std::vector<Eigen::SparseMatrix<float>>* prolongations = nullptr; // The mesh hierarchy used by Geometric_Multigrid, finest first
+
+    Preconditioner() = default;
+
+    template <typename MatrixType>
+    Preconditioner& analyzePattern(const MatrixType& matrix) { return *this; }
+
+    template <typename MatrixType>
+    Preconditioner& factorize(const MatrixType& matrix) { return compute(matrix); }
+
+    template <typename MatrixType>
+    Preconditioner& compute(const MatrixType& matrix) {
+        build(Eigen::SparseMatrix<float>(matrix));
+        return *this;
+    }
+
+    Eigen::VectorXf solve(const Eigen::VectorXf& b) const;
+    Eigen::ComputationInfo info() const;
+private:
+    Eigen::ComputationInfo status = Eigen::Success;
+    Eigen::VectorXf inverse_diagonal;
+    Eigen::IncompleteCholesky<float, Eigen::Lower, Eigen::NaturalOrdering<int>> incomplete_cholesky;
+    Multigrid multigrid;
+
+    void build(const Eigen::SparseMatrix<float>& A);
+};
\ No newline at end of file
@@ -0,0 +1,56 @@
+#pragma once
+#include "FEM/Solver.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Runs a Solver on a worker thread, so that the simulation rate is independent of the frame rate and a slow
+ * time step does not hold up rendering.
+ *
+ * The solver and everything that it reads, which is its FEMContext, the values on the surface and the solver's settings,
+ * are guarded by a single mutex. The worker holds it while taking each time step, and the main thread must hold it
+ * while reading or changing any of them, through lock(). Callers of lock() are served before the next time step starts,
+ * so they wait for at most one time step.
+ *
+ * After every time step the values on the surface are copied into a shared buffer, which take_values() swaps out for
+ * rendering without waiting for the time step in progress. Together with the surface's own values, which the worker
+ * writes into, and the copy that the main thread renders from, the values are triple buffered.
+ */
+class SimulationThread {
+public:
+    float steps_per_second = 60.0f; // The target simulation rate, or 0 to take time steps as fast as possible. Guarded by lock()
+
+    SimulationThread(std::shared_ptr<Solver> solver);
+    ~SimulationThread();
+
+    std::unique_lock<std::mutex> lock();
+    void set_running(bool running);
+    bool is_running();
+    bool take_values(std::vector<float>& values);
+    bool take_instability();
+    float measured_steps_per_second();
+private:
+    std::shared_ptr<Solver> solver;
+    std::thread worker;
+
+    std::mutex state_mutex; // Guards the solver and everything it reads
+    std::condition_variable wake; // Signaled when running or stopping change
+    std::atomic<int> waiting = 0; // The number of threads waiting in lock()
+    bool running = false;
+    bool stopping = false;
+    bool unstable = false; // Set when the worker stops because of numerical instability
+
+    std::mutex values_mutex; // Guards shared_values and fresh_values
+    std::vector<float> shared_values;
+    bool fresh_values = false;
+
+    std::atomic<float> measured_rate = 0.0f;
+
+    void run();
+};
\ No newline at end of file
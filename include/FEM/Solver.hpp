@@ -8,6 +8,7 @@
 class Solver {
 public:
     std::shared_ptr<FEMContext> fem_ctx;
+    int iterations = 0; // The number of iterations the iterative solver took during the last time step
 
     virtual void advance_time() = 0;
     virtual void clear_values() = 0;
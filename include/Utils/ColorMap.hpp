@@ -1,5 +1,5 @@
 #pragma once
-#include "Utils/Shader.hpp"
+#include <glm/glm.hpp>
 
 #include <array>
 #include <string>
@@ -7,6 +7,7 @@
 /**
  * A color map encoded by an order 6 polynomial.
  * All coefficients are taken from https://www.shadertoy.com/view/Nd3fR2.
+ * Shaders evaluate the same polynomial, with the coefficients in the uniforms c0 to c6.
  */
 class ColorMap {
 public:
@@ -16,5 +17,4 @@ public:
     ColorMap(std::string name, std::array<glm::vec3, 7> coeffs);
 
     glm::vec3 get_color(float t);
-    void set_uniforms(Shader& shader);
 };
\ No newline at end of file
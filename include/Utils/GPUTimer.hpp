@@ -0,0 +1,29 @@
+#pragma once
+#include <deque>
+#include <string>
+#include <vector>
+
+/**
+ * Times GPU work with GL_TIME_ELAPSED queries and records the results in the Profiler.
+ * Results are read back by collect() once the GPU has finished the work, without waiting for it.
+ * Only one interval can be timed at a time, so intervals cannot be nested. Nothing is timed while the profiler is not recording.
+ */
+class GPUTimer {
+public:
+    ~GPUTimer();
+
+    void begin(const char* name);
+    void end();
+    void collect();
+private:
+    struct PendingQuery {
+        unsigned int query;
+        std::string name;
+        double submitted; // When the work was submitted, in the profiler's time
+    };
+
+    std::vector<unsigned int> free_queries;
+    std::deque<PendingQuery> pending; // In submission order
+    bool timing = false;
+    double gpu_time = 0.0; // The end of the last interval on the GPU track, in the profiler's time
+};
\ No newline at end of file
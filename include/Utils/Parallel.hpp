@@ -0,0 +1,30 @@
+#pragma once
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+/**
+ * Calls body on contiguous ranges [begin, end) that together cover [0, count), with one range per available hardware thread.
+ * Everything runs as a single range on the calling thread when there are fewer than min_per_thread indices per thread.
+ * 
+ * @param count The number of indices
+ * @param min_per_thread The minimum number of indices worth starting another thread for
+ * @param body Called with each range, must not write to memory shared with other ranges
+ */
+template <typename F>
+void parallel_for(int count, int min_per_thread, F body) {
+    int num_threads = std::clamp(count / min_per_thread, 1, std::max(1, static_cast<int>(std::thread::hardware_concurrency())));
+    if (num_threads == 1) {
+        body(0, count);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        int begin = static_cast<long long>(count) * t / num_threads;
+        int end = static_cast<long long>(count) * (t + 1) / num_threads;
+        threads.emplace_back(body, begin, end);
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+}
\ No newline at end of file
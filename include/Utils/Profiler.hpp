@@ -0,0 +1,90 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * One timed interval, on the thread (or the GPU) that it ran on
+ */
+struct ProfileEvent {
+    std::string name;
+    int track;
+    double start; // Microseconds since the profiler was created
+    double duration; // Microseconds
+};
+
+/**
+ * Statistics over the most recent intervals with the same name
+ */
+struct ProfileSummary {
+    std::string name;
+    int track;
+    float last; // Milliseconds
+    float mean; // Milliseconds
+    float max; // Milliseconds
+    float calls_per_second;
+};
+
+/**
+ * Collects timed intervals from ScopedTimer and GPUTimer, for rolling statistics in the GUI and for export as a
+ * Chrome trace (chrome://tracing or https://ui.perfetto.dev). Every thread gets its own track in the trace, and the GPU
+ * gets one more. Recording is off by default, in which case ScopedTimer only checks a flag.
+ * Safe to use from any thread.
+ */
+class Profiler {
+public:
+    static constexpr int GPU_TRACK = 1000;
+    static constexpr int SAMPLES_PER_SUMMARY = 128; // The number of most recent intervals that each summary covers
+    static constexpr int MAX_EVENTS = 200000; // The oldest events are dropped from the trace past this
+
+    static Profiler& get();
+
+    void set_enabled(bool enabled);
+    bool is_enabled() const;
+    double now() const;
+    int current_track();
+    void name_current_thread(const std::string& name);
+
+    void record(const std::string& name, int track, double start, double duration);
+    std::vector<ProfileSummary> summaries();
+    void write_chrome_trace(const char* file_path);
+    void clear();
+private:
+    struct RollingSamples {
+        int track;
+        std::array<float, SAMPLES_PER_SUMMARY> durations;
+        std::array<double, SAMPLES_PER_SUMMARY> starts;
+        int count = 0; // The number of intervals recorded, of which the last SAMPLES_PER_SUMMARY are kept
+    };
+
+    std::atomic<bool> enabled = false;
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+    std::mutex mutex; // Guards everything below
+    std::deque<ProfileEvent> events;
+    std::map<std::string, RollingSamples> samples;
+    std::map<int, std::string> track_names;
+    int next_track = 0;
+
+    Profiler() = default;
+};
+
+/**
+ * Times the scope that it is declared in, if the profiler is recording. The name must outlive the timer.
+ */
+class ScopedTimer {
+public:
+    ScopedTimer(const char* name);
+    ~ScopedTimer();
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+private:
+    const char* name;
+    double start = -1.0; // Negative when not recording
+};
\ No newline at end of file
@@ -8,6 +8,8 @@
 #include <vector>
 #include <memory>
 
+struct triangulateio;
+
 struct Triangle {
     unsigned int idx_a;
     unsigned int idx_b;
@@ -22,6 +24,15 @@ struct Triangle {
     }
 };
 
+/**
+ * A coarser triangulation of the same domain as a surface, used to build geometric multigrid hierarchies
+ */
+struct SurfaceLevel {
+    std::vector<glm::vec3> vertices;
+    std::vector<Triangle> triangles;
+    std::vector<bool> on_boundary;
+};
+
 enum class MeshType {
     Open = 0,
     Closed,
@@ -38,6 +49,7 @@ public:
     std::vector<float> values;
     std::vector<Triangle> triangles;
     std::vector<bool> on_boundary;
+    std::vector<SurfaceLevel> coarse_levels; // Coarser triangulations that this surface was refined from, coarsest first. Empty for .obj meshes
 
     std::shared_ptr<Shader> wireframe_shader;
     std::shared_ptr<Shader> fem_mesh_shader;
@@ -48,15 +60,21 @@ public:
     MeshType mesh_type = MeshType::Open;
 
     int num_boundary_points = 0;
+    int max_coarse_levels = 6;
+    bool build_hierarchy = false; // Whether PSLGs are triangulated through coarse_levels, which only geometric multigrid uses
     bool closed;
     bool initialized = false;
     const glm::vec3 EDGE_COLOR = glm::vec3(0.9f, 0.9f, 0.9f);
 
     void init_from_PSLG(PSLG& pslg);
+    void init_from_segments(const std::vector<glm::vec3>& points, const std::vector<unsigned int>& indices, const std::vector<glm::vec3>& holes, float triangle_area);
+    void init_from_poly(const char* file_path, float triangle_area);
     void init_from_obj(const char* file_path);
     void export_to_ply(const char* file_path, float vertex_extrusion = 0.25f, float threshold = 0.0f, MeshType mesh_type = MeshType::Open);
 
+    void load_buffers();
     void load_value_buffer();
+    void load_value_buffer(const std::vector<float>& values);
     void read_value_buffer();
     void calculate_normals(float vertex_extrusion);
     void draw(bool wireframe, float pixel_discard_threshold, glm::vec3 camera_position);
@@ -66,7 +84,9 @@ public:
     unsigned int get_value_buffer() {return value_buffer;}
 private:
     unsigned int vertex_buffer, value_buffer, normal_buffer, element_buffer, vertex_array, calculated_normals_buffer;
+    std::vector<int> segments; // The boundary segments of the last triangulation, which constrain its refinement
 
-    void load_buffers();
     void perform_triangulation(double* vertices, int num_vertices, int* segments, int num_segments, double* holes, int num_holes, float triangle_area);
+    void refine_triangulation(double* holes, int num_holes, float triangle_area);
+    void load_triangulation(triangulateio& tri_out);
 };
\ No newline at end of file
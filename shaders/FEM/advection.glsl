@@ -0,0 +1,14 @@
+/*
+    advection.glsl
+
+    Helpers for the advection term of the matrix-free FEM operators,
+    included by element.glsl.
+*/
+
+// Returns the advection velocity projected onto the plane of an element and normalized, or zero where the velocity
+// is normal to the element, matching FEMContext::update_advection_velocities()
+vec3 project_velocity(vec3 velocity, vec3 normal) {
+    vec3 projected = velocity - dot(velocity, normal) * normal;
+    float squared_length = dot(projected, projected);
+    return squared_length > 1e-12 ? projected * inversesqrt(squared_length) : vec3(0.0);
+}
\ No newline at end of file
@@ -0,0 +1,197 @@
+/*
+    bicgstab.glsl
+
+    This compute shader performs steps of the Biconjugate Gradient Stabilized Method (BiCGSTAB)
+    to solve nonsymmetric linear systems, such as the one for the Advection-Diffusion Equation.
+    The vectors are initialized by stage 1 of cgm_helper.glsl, which sets r = b - Ax.
+*/
+
+#version 460
+#extension GL_KHR_shader_subgroup_basic : enable
+#extension GL_KHR_shader_subgroup_arithmetic : enable
+layout (local_size_x = 1024) in;
+
+layout (std430, binding = 0) coherent buffer State {
+    float r_0_norm;
+    float r_i_norm;
+    float r_i1_norm;
+    float d_iA_norm;
+
+    int N;
+    int M;
+    int total_nodes;
+
+    float alpha; // r_i_norm / d_iA_norm
+    float beta; // r_i1_norm / r_i_norm
+    int converged; // Set once the residual is small enough, after which the remaining iterations do nothing
+    int iteration_count; // The number of iterations taken during the current time step
+    uint reduction_count; // The number of work groups that have finished the current reduction
+    float result[];
+};
+
+layout (std430, binding = 2) buffer Residuals {float r[];}; // Size of N
+layout (std430, binding = 3) buffer SearchDirections {float p[];}; // Size of N
+
+layout (std430, binding = 6) buffer StiffnessMatrix {float stiffness[];};
+layout (std430, binding = 7) buffer MassMatrix {float mass[];};
+layout (std430, binding = 8) buffer AdvectionMatrix {float advection[];};
+layout (std430, binding = 9) buffer MatrixIndices {int matrix_indices[];}; // The column index of every stored entry, in the order given by matrix_format
+layout (std430, binding = 10) buffer VectorU {float u[];}; // Size of N
+
+layout (std430, binding = 12) buffer ShadowResiduals {float r_hat[];}; // Size of N
+layout (std430, binding = 13) buffer SearchDirectionProducts {float v[];}; // Size of N; Stores A * p
+layout (std430, binding = 14) buffer IntermediateResiduals {float s[];}; // Size of N
+layout (std430, binding = 15) buffer IntermediateResidualProducts {float t[];}; // Size of N; Stores A * s
+layout (std430, binding = 16) buffer BiCGSTABState {
+    float rho;
+    float rho_prev;
+    float r_hat_v; // dot(r_hat, v), from which alpha = rho / r_hat_v
+    float omega;
+    float t_s;
+    float t_t;
+};
+
+layout (std430, binding = 17) buffer ElementData {float element_data[];}; // Size of 16 * num_elements; Areas, basis function gradients, normals, and interior flags
+layout (std430, binding = 18) buffer ElementUnknowns {int element_unknowns[];}; // Size of 3 * num_elements; The unknown at each corner of each element, or -1
+layout (std430, binding = 19) buffer NodeElementOffsets {int node_element_offsets[];}; // Size of N + 1
+layout (std430, binding = 20) buffer NodeElements {int node_elements[];}; // The element corners (3 * element + i) at the node of each unknown
+layout (std430, binding = 21) buffer SystemMatrix {float system_matrix[];}; // The combined matrix of the system being solved, from cgm_helper stage 5
+layout (std430, binding = 22) buffer MatrixLayout {int matrix_layout[];}; // CSR: the row offsets; SELL-C-sigma: the slice offsets, then the row at each position
+
+uniform int stage;
+uniform float epsilon;
+
+uniform float time_step;
+uniform float c;
+
+uniform bool matrix_free;
+uniform int matrix_format; // 0 = ELL, 1 = SELL-C-sigma, 2 = CSR
+uniform int slice_height; // C in SELL-C-sigma
+uniform int num_elements;
+uniform vec3 velocity;
+uniform bool lumped_mass;
+
+#include "reduction.glsl"
+
+// The vector that the matrix-free operators multiply, p (which = 0) or s (which = 1), see element.glsl
+float matrix_free_operand(int which, int idx) {
+    return which == 0 ? p[idx] : s[idx];
+}
+
+#include "element.glsl"
+
+#include "matrix_layout.glsl"
+
+// Computes row i of A * p (which = 0) or A * s (which = 1), where A = M / dt + c * K - advection
+float A_times(int which) {
+    if (matrix_free) {
+        return matrix_free_row(which, 1.0 / time_step, c, 1.0);
+    }
+
+    int begin, end, stride;
+    row_entries(int(gl_GlobalInvocationID.x), begin, end, stride);
+
+    float Ax_i = 0.0;
+    for (int mat_idx = begin; mat_idx < end; mat_idx += stride) {
+        int col_idx = matrix_indices[mat_idx];
+
+        if (col_idx != -1) {
+            float x_j = which == 0 ? p[col_idx] : s[col_idx];
+            Ax_i += x_j * system_matrix[mat_idx];
+        }
+    }
+    return Ax_i;
+}
+
+void main() {
+    int globalID = int(gl_GlobalInvocationID.x);
+
+    // Every iteration is skipped once the method has converged, so that a fixed number of iterations can be
+    // dispatched without reading the residual back. converged is the same for every invocation of a dispatch.
+    if (stage != 0 && converged != 0)
+        return;
+
+    switch (stage) {
+        case 0: { // Initialize vectors, and calculate dot(r_0, r_0), Store in r_i_norm (Only occurs before the first iteration)
+            if (globalID < N) {
+                r_hat[globalID] = r[globalID];
+                p[globalID] = 0.0;
+                v[globalID] = 0.0;
+
+                if (globalID == 0) {
+                    rho = 1.0;
+                    rho_prev = 1.0;
+                    r_hat_v = 1.0;
+                    omega = 1.0;
+                }
+            }
+            if (parallel_reduction(globalID < N ? r[globalID] * r[globalID] : 0.0)) {
+                r_i_norm = result[0];
+                r_0_norm = r_i_norm;
+                converged = r_i_norm <= epsilon ? 1 : 0;
+            }
+        } break;
+        case 1: { // Calculate dot(r_hat, r), Store in rho after moving the previous value to rho_prev
+            float partial = globalID < N ? r_hat[globalID] * r[globalID] : 0.0;
+            if (parallel_reduction(partial)) {
+                rho_prev = rho;
+                rho = result[0];
+            }
+        } break;
+        case 2: { // Update the search direction p = r + beta * (p - omega * v)
+            if (globalID < N) {
+                // r_hat_v is still from the previous iteration here, so this is the previous alpha
+                bool breakdown = omega == 0.0 || rho_prev == 0.0 || r_hat_v == 0.0;
+                float beta = !breakdown ? (rho / rho_prev) * ((rho_prev / r_hat_v) / omega) : 0.0;
+                p[globalID] = r[globalID] + beta * (p[globalID] - omega * v[globalID]);
+            }
+        } break;
+        case 3: { // v = A * p
+            if (globalID < N) {
+                v[matrix_row(globalID)] = A_times(0);
+            }
+        } break;
+        case 4: { // Calculate dot(r_hat, v), Store in r_hat_v
+            float partial = globalID < N ? r_hat[globalID] * v[globalID] : 0.0;
+            if (parallel_reduction(partial)) r_hat_v = result[0];
+        } break;
+        case 5: { // s = r - alpha * v
+            if (globalID < N) {
+                float alpha = r_hat_v != 0.0 ? rho / r_hat_v : 0.0;
+                s[globalID] = r[globalID] - alpha * v[globalID];
+            }
+        } break;
+        case 6: { // t = A * s
+            if (globalID < N) {
+                t[matrix_row(globalID)] = A_times(1);
+            }
+        } break;
+        case 7: { // Calculate dot(t, s), Store in t_s
+            float partial = globalID < N ? t[globalID] * s[globalID] : 0.0;
+            if (parallel_reduction(partial)) t_s = result[0];
+        } break;
+        case 8: { // Calculate dot(t, t), Store in t_t
+            float partial = globalID < N ? t[globalID] * t[globalID] : 0.0;
+            if (parallel_reduction(partial)) t_t = result[0];
+        } break;
+        case 9: { // Update u and r using omega = dot(t, s) / dot(t, t)
+            if (globalID < N) {
+                float alpha = r_hat_v != 0.0 ? rho / r_hat_v : 0.0;
+                float omega_i = t_t != 0.0 ? t_s / t_t : 0.0;
+
+                u[globalID] = u[globalID] + alpha * p[globalID] + omega_i * s[globalID];
+                r[globalID] = s[globalID] - omega_i * t[globalID];
+
+                if (globalID == 0) omega = omega_i;
+            }
+        } break;
+        case 10: { // Calculate dot(r, r), Store in r_i_norm and check for convergence
+            float partial = globalID < N ? r[globalID] * r[globalID] : 0.0;
+            if (parallel_reduction(partial)) {
+                r_i_norm = result[0];
+                iteration_count++;
+                converged = r_i_norm <= epsilon || r_i_norm <= epsilon * r_0_norm ? 1 : 0;
+            }
+        } break;
+    }
+}
@@ -6,9 +6,11 @@
 */
 
 #version 460
+#extension GL_KHR_shader_subgroup_basic : enable
+#extension GL_KHR_shader_subgroup_arithmetic : enable
 layout (local_size_x = 1024) in;
 
-layout (std430, binding = 0) buffer State {
+layout (std430, binding = 0) coherent buffer State {
     float r_0_norm;
     float r_i_norm;
     float r_i1_norm;
@@ -17,6 +19,12 @@ layout (std430, binding = 0) buffer State {
     int N;
     int M;
     int total_nodes;
+
+    float alpha; // r_i_norm / d_iA_norm
+    float beta; // r_i1_norm / r_i_norm
+    int converged; // Set once the residual is small enough, after which the remaining iterations do nothing
+    int iteration_count; // The number of iterations taken during the current time step
+    uint reduction_count; // The number of work groups that have finished the current reduction
     float result[];
 };
 
@@ -29,12 +37,20 @@ layout (std430, binding = 5) buffer SurfaceValues {float values[];}; // Size of
 layout (std430, binding = 6) buffer StiffnessMatrix {float stiffness[];};
 layout (std430, binding = 7) buffer MassMatrix {float mass[];};
 layout (std430, binding = 8) buffer AdvectionMatrix {float advection[];};
-layout (std430, binding = 9) buffer MatrixIndices {int matrix_indices[];}; // Size of N*M; The indices in ELL format
+layout (std430, binding = 9) buffer MatrixIndices {int matrix_indices[];}; // The column index of every stored entry, in the order given by matrix_format
 layout (std430, binding = 10) buffer VectorU {float u[];}; // Size of N
 layout (std430, binding = 11) buffer VectorV {float v[];}; // Size of N
+layout (std430, binding = 13) buffer SearchDirectionProducts {float Ad[];}; // Size of N; Stores A * d for the update of r
+
+layout (std430, binding = 17) buffer ElementData {float element_data[];}; // Size of 16 * num_elements; Areas, basis function gradients, normals, and interior flags
+layout (std430, binding = 18) buffer ElementUnknowns {int element_unknowns[];}; // Size of 3 * num_elements; The unknown at each corner of each element, or -1
+layout (std430, binding = 19) buffer NodeElementOffsets {int node_element_offsets[];}; // Size of N + 1
+layout (std430, binding = 20) buffer NodeElements {int node_elements[];}; // The element corners (3 * element + i) at the node of each unknown
+layout (std430, binding = 21) buffer SystemMatrix {float system_matrix[];}; // The combined matrix of the system being solved, from cgm_helper stage 5
+layout (std430, binding = 22) buffer MatrixLayout {int matrix_layout[];}; // CSR: the row offsets; SELL-C-sigma: the slice offsets, then the row at each position
 
-uniform bool first_pass;
 uniform int stage;
+uniform float epsilon;
 
 uniform int equation;
 uniform float time_step;
@@ -44,58 +60,44 @@ uniform float Dv;
 uniform float kill_rate;
 uniform float feed_rate;
 
-shared float shared_data[1024];
+uniform bool matrix_free;
+uniform int matrix_format; // 0 = ELL, 1 = SELL-C-sigma, 2 = CSR
+uniform int slice_height; // C in SELL-C-sigma
+uniform int num_elements;
+uniform vec3 velocity;
+uniform bool lumped_mass;
 
-void parallel_reduction(float res) {
-    int globalID = int(gl_GlobalInvocationID.x);
-    int localID = int(gl_LocalInvocationID.x);
+#include "reduction.glsl"
 
-    if (globalID < N) {
-        if (!first_pass) {
-            res = result[globalID];
-        }
-    } else {
-        res = 0.0;
-    }
-    shared_data[localID] = res;
-    barrier();
+// The vector that the matrix-free operators multiply, see element.glsl
+float matrix_free_operand(int which, int idx) {
+    return d[idx];
+}
 
-    for (int i = int(gl_WorkGroupSize.x) / 2; i > 0; i >>= 1) {
-        if (gl_LocalInvocationID.x < i) {
-            shared_data[localID] += shared_data[localID + i];
+#include "element.glsl"
+
+#include "matrix_layout.glsl"
+
+float Ad_i() {
+    if (matrix_free) {
+        switch (equation) {
+            case 0: return matrix_free_row(0, 1.0 / time_step, c, 0.0); // Heat Equation
+            case 1: return matrix_free_row(0, 1.0 / time_step, c, 1.0); // Advection-Diffusion Equation
+            case 2: return matrix_free_row(0, 1.0 / time_step, c * c * time_step, 0.0); // Wave Equation
+            case 3: return matrix_free_row(0, 1.0 / time_step, Du, 0.0); // Gray-Scott Reaction-Diffusion Equation (Step 1)
+            case 4: return matrix_free_row(0, 1.0 / time_step, Dv, 0.0); // Gray-Scott Reaction-Diffusion Equation (Step 2)
         }
-        barrier();
     }
 
-    if (localID == 0) {
-        result[gl_WorkGroupID.x] = shared_data[localID];
-    }
-}
+    int begin, end, stride;
+    row_entries(int(gl_GlobalInvocationID.x), begin, end, stride);
 
-float Ad_i() {
     float Ad_i = 0.0;
-    for (int i = 0; i < M; i++) {
-        int mat_idx = int(gl_GlobalInvocationID.x) * M + i;
+    for (int mat_idx = begin; mat_idx < end; mat_idx += stride) {
         int col_idx = matrix_indices[mat_idx];
 
         if (col_idx != -1) {
-            switch (equation) {
-                case 0: // Heat Equation
-                    Ad_i += d[col_idx] * ((mass[mat_idx] / time_step) + c * stiffness[mat_idx]);
-                    break;
-                case 1: // Advection-Diffusion Equation
-                    Ad_i += d[col_idx] * ((mass[mat_idx] / time_step) + (c * stiffness[mat_idx]) - advection[mat_idx]);
-                    break;
-                case 2: // Wave Equation
-                    Ad_i += d[col_idx] * ((mass[mat_idx] / time_step) + (c * c * stiffness[mat_idx] * time_step));
-                    break;
-                case 3: // Gray-Scott Reaction-Diffusion Equation (Step 1)
-                    Ad_i += d[col_idx] * ((mass[mat_idx] / time_step) + (Du * stiffness[mat_idx]));
-                    break;
-                case 4: // Gray-Scott Reaction-Diffusion Equation (Step 2)
-                    Ad_i += d[col_idx] * ((mass[mat_idx] / time_step) + (Dv * stiffness[mat_idx]));
-                    break;
-            }
+            Ad_i += d[col_idx] * system_matrix[mat_idx];
         }
     }
     return Ad_i;
@@ -105,20 +107,37 @@ void main() {
     int globalID = int(gl_GlobalInvocationID.x);
     int localID = int(gl_LocalInvocationID.x);
 
+    // Every iteration is skipped once the method has converged, so that a fixed number of iterations can be
+    // dispatched without reading the residual back. converged is the same for every invocation of a dispatch.
+    if (stage != 0 && converged != 0)
+        return;
+
     switch (stage) {
         case 0: { // Calculate dot(r_i, r_i), Store in r_i_norm (Only occurs on the first iteration of CGM)
-            parallel_reduction(r[globalID] * r[globalID]);
-            r_i_norm = result[0];
-            r_0_norm = r_i_norm;
+            if (parallel_reduction(globalID < N ? r[globalID] * r[globalID] : 0.0)) {
+                r_i_norm = result[0];
+                r_0_norm = r_i_norm;
+                converged = r_i_norm <= epsilon ? 1 : 0;
+            }
         } break;
-        case 1: { // Calculate dot(d_i, A * d_i), Store in d_iA_norm
-            parallel_reduction(d[globalID] * Ad_i());
-            d_iA_norm = result[0];
+        case 1: { // Store A * d_i, and calculate dot(d_i, A * d_i), Store in d_iA_norm and alpha
+            float d_Ad = 0.0;
+            if (globalID < N) {
+                int row = matrix_row(globalID);
+                float product = Ad_i();
+                Ad[row] = product;
+                d_Ad = d[row] * product;
+            }
+            if (parallel_reduction(d_Ad)) {
+                d_iA_norm = result[0];
+                alpha = r_i_norm / d_iA_norm;
+            }
         } break;
-        case 2: { // Update u and r
+        case 2: { // Update u and r, and calculate dot(r_(i+1), r_(i+1)), Store the Gram-Schmidt constant in beta and check for convergence
+            float r_i = 0.0;
             if (globalID < N) {
-                float alpha = r_i_norm / d_iA_norm;
-                r[globalID] = r[globalID] - alpha * Ad_i();
+                r_i = r[globalID] - alpha * Ad[globalID];
+                r[globalID] = r_i;
 
                 switch (equation) {
                     case 0: 
@@ -132,18 +151,17 @@ void main() {
                         break;
                 }
             }
+            if (parallel_reduction(r_i * r_i)) {
+                r_i1_norm = result[0];
+                beta = r_i1_norm / r_i_norm;
+                r_i_norm = r_i1_norm;
+                iteration_count++;
+                converged = r_i_norm <= epsilon || r_i_norm <= epsilon * r_0_norm ? 1 : 0;
+            }
         } break;
-        case 3: { // Calculate dot(r_(i+1), r_(i+1))
-            parallel_reduction(r[globalID] * r[globalID]);
-            r_i1_norm = result[0];
-        } break;
-        case 4: { // Use the Gram-Schmidt constant to find the next search direction
+        case 3: { // Use the Gram-Schmidt constant to find the next search direction
             if (globalID < N) {
-                float gram_schimdt_constant = r_i1_norm / r_i_norm;
-
-                d[globalID] = r[globalID] + gram_schimdt_constant * d[globalID];
-
-                r_i_norm = r_i1_norm;
+                d[globalID] = r[globalID] + beta * d[globalID];
             }
         } break;
     }
@@ -18,6 +18,12 @@ layout (std430, binding = 0) buffer State {
     int N;
     int M;
     int total_nodes;
+
+    float alpha; // r_i_norm / d_iA_norm
+    float beta; // r_i1_norm / r_i_norm
+    int converged; // Set once the residual is small enough, after which the remaining iterations do nothing
+    int iteration_count; // The number of iterations taken during the current time step
+    uint reduction_count; // The number of work groups that have finished the current reduction
     float result[];
 };
 
@@ -30,10 +36,17 @@ layout (std430, binding = 5) buffer SurfaceValues {float values[];}; // Size of
 layout (std430, binding = 6) buffer StiffnessMatrix {float stiffness[];};
 layout (std430, binding = 7) buffer MassMatrix {float mass[];};
 layout (std430, binding = 8) buffer AdvectionMatrix {float advection[];};
-layout (std430, binding = 9) buffer MatrixIndices {int matrix_indices[];}; // Size of N*M; The indices in ELL format
+layout (std430, binding = 9) buffer MatrixIndices {int matrix_indices[];}; // The column index of every stored entry, in the order given by matrix_format
 layout (std430, binding = 10) buffer VectorU {float u[];}; // Size of N
 layout (std430, binding = 11) buffer VectorV {float v[];}; // Size of N
 
+layout (std430, binding = 17) buffer ElementData {float element_data[];}; // Size of 16 * num_elements; Areas, basis function gradients, normals, and interior flags
+layout (std430, binding = 18) buffer ElementUnknowns {int element_unknowns[];}; // Size of 3 * num_elements; The unknown at each corner of each element, or -1
+layout (std430, binding = 19) buffer NodeElementOffsets {int node_element_offsets[];}; // Size of N + 1
+layout (std430, binding = 20) buffer NodeElements {int node_elements[];}; // The element corners (3 * element + i) at the node of each unknown
+layout (std430, binding = 21) buffer SystemMatrix {float system_matrix[];}; // The combined matrix of the system being solved, from cgm_helper stage 5
+layout (std430, binding = 22) buffer MatrixLayout {int matrix_layout[];}; // CSR: the row offsets; SELL-C-sigma: the slice offsets, then the row at each position
+
 uniform int stage;
 
 uniform int equation;
@@ -44,9 +57,29 @@ uniform float Dv;
 uniform float kill_rate;
 uniform float feed_rate;
 
+uniform bool matrix_free;
+uniform int matrix_format; // 0 = ELL, 1 = SELL-C-sigma, 2 = CSR
+uniform int slice_height; // C in SELL-C-sigma
+uniform int num_elements;
+uniform vec3 velocity;
+uniform bool lumped_mass;
+
 uniform int brush_idx;
 uniform float brush_strength;
 
+uniform float mass_coefficient;
+uniform float stiffness_coefficient;
+uniform float advection_coefficient;
+
+#include "matrix_layout.glsl"
+
+// The vector that the matrix-free operators multiply, u (which = 0) or v (which = 1), see element.glsl
+float matrix_free_operand(int which, int idx) {
+    return which == 0 ? u[idx] : v[idx];
+}
+
+#include "element.glsl"
+
 void main() {
     int globalID = int(gl_GlobalInvocationID.x);
     int localID = int(gl_LocalInvocationID.x);
@@ -73,46 +106,74 @@ void main() {
         } break;
         case 1: { // Initialize vectors (# invocations = N)
             if (globalID < N) {
+                int row = matrix_row(globalID);
                 float b_i = 0.0;
                 float Ax_i = 0.0;
-                for (int i = 0; i < M; i++) {
-                    int mat_idx = globalID * M + i;
+                if (matrix_free) {
+                    switch (equation) {
+                        case 0: { // Heat Equation
+                            b_i = matrix_free_row(0, 1.0 / time_step, 0.0, 0.0);
+                            Ax_i = matrix_free_row(0, 1.0 / time_step, c, 0.0);
+                        } break;
+                        case 1: { // Advection-Diffusion Equation
+                            b_i = matrix_free_row(0, 1.0 / time_step, 0.0, 0.0);
+                            Ax_i = matrix_free_row(0, 1.0 / time_step, c, 1.0);
+                        } break;
+                        case 2: { // Wave Equation
+                            b_i = matrix_free_row(1, 1.0 / time_step, 0.0, 0.0) - matrix_free_row(0, 0.0, c * c, 0.0);
+                            Ax_i = matrix_free_row(1, 1.0 / time_step, c * c * time_step, 0.0);
+                        } break;
+                        case 3: { // Gray-Scott Reaction-Diffusion Equation (Step 1)
+                            b_i = matrix_free_row(0, 1.0 / time_step, 0.0, 0.0) - u[row] * v[row] * v[row] + feed_rate * (1.0 - u[row]);
+                            Ax_i = matrix_free_row(0, 1.0 / time_step, Du, 0.0);
+                        } break;
+                        case 4: { // Gray-Scott Reaction-Diffusion Equation (Step 2)
+                            b_i = matrix_free_row(1, 1.0 / time_step, 0.0, 0.0) + u[row] * v[row] * v[row] - v[row] * (feed_rate + kill_rate);
+                            Ax_i = matrix_free_row(1, 1.0 / time_step, Dv, 0.0);
+                        } break;
+                    }
+                }
+
+                // M is 0 in matrix-free mode, where matrix_format is ELL, so this loop only runs with assembled matrices
+                int begin, end, stride;
+                row_entries(globalID, begin, end, stride);
+                for (int mat_idx = begin; mat_idx < end; mat_idx += stride) {
                     int col_idx = matrix_indices[mat_idx];
 
                     if (col_idx != -1) {
                         switch (equation) {
-                            case 0: { // Heat Equation
-                                b_i += u[col_idx] * (mass[mat_idx] / time_step);
-                                Ax_i += u[col_idx] * (mass[mat_idx] / time_step + c * stiffness[mat_idx]);
-                            } break;
+                            case 0: // Heat Equation
                             case 1: { // Advection-Diffusion Equation
                                 b_i += u[col_idx] * (mass[mat_idx] / time_step);
-                                Ax_i += u[col_idx] * (mass[mat_idx] / time_step + c * stiffness[mat_idx] - advection[mat_idx]);
+                                Ax_i += u[col_idx] * system_matrix[mat_idx];
                             } break;
                             case 2: { // Wave Equation
                                 b_i += v[col_idx] * (mass[mat_idx] / time_step) - c * c * u[col_idx] * stiffness[mat_idx]; 
-                                Ax_i += v[col_idx] * (mass[mat_idx] / time_step + c * c * stiffness[mat_idx] * time_step);
+                                Ax_i += v[col_idx] * system_matrix[mat_idx];
                             } break;
                             case 3: { // Gray-Scott Reaction-Diffusion Equation (Step 1)
                                 b_i += u[col_idx] * (mass[mat_idx] / time_step) - u[col_idx] * v[col_idx] * v[col_idx] + feed_rate * (1.0 - u[col_idx]);
-                                Ax_i += u[col_idx] * (mass[mat_idx] / time_step + Du * stiffness[mat_idx]);
+                                Ax_i += u[col_idx] * system_matrix[mat_idx];
                             } break;
                             case 4: { // Gray-Scott Reaction-Diffusion Equation (Step 2)
                                 b_i += v[col_idx] * (mass[mat_idx] / time_step) + u[col_idx] * v[col_idx] * v[col_idx] - v[col_idx] * (feed_rate + kill_rate);
-                                Ax_i += v[col_idx] * (mass[mat_idx] / time_step + Dv * stiffness[mat_idx]);
+                                Ax_i += v[col_idx] * system_matrix[mat_idx];
                             } break;
                         }
                     }
                 }
 
-                b[globalID] = b_i;
-                d[globalID] = b_i - Ax_i;
-                r[globalID] = b_i - Ax_i;
+                b[row] = b_i;
+                d[row] = b_i - Ax_i;
+                r[row] = b_i - Ax_i;
                 result[globalID] = 0.0;
                 r_0_norm = 0.0;
                 r_i_norm = 0.0;
                 r_i1_norm = 0.0;
                 d_iA_norm = 0.0;
+                alpha = 0.0;
+                beta = 0.0;
+                converged = 0;
             }
         } break;
         case 2: { // Wave Equation update (# invocations = N)
@@ -150,5 +211,17 @@ void main() {
                 v[globalID] = 0.0;
             }
         } break;
+        case 5: { // Combine the matrices into the system matrix (# invocations = N)
+            if (globalID < N) {
+                int begin, end, stride;
+                row_entries(globalID, begin, end, stride);
+                for (int mat_idx = begin; mat_idx < end; mat_idx += stride) {
+                    float entry = mass_coefficient * mass[mat_idx] + stiffness_coefficient * stiffness[mat_idx];
+                    if (advection_coefficient != 0.0)
+                        entry -= advection_coefficient * advection[mat_idx];
+                    system_matrix[mat_idx] = entry;
+                }
+            }
+        } break;
     }
 }
\ No newline at end of file
@@ -0,0 +1,48 @@
+/*
+    element.glsl
+
+    The matrix-free FEM operators, which apply the FEM matrices element by element from the per-element data,
+    included by the cgm, cgm_helper, and bicgstab compute shaders. The including shader declares the element
+    buffers and uniforms, and defines float matrix_free_operand(int which, int idx), which returns entry idx
+    of the vector that matrix_free_row() multiplies.
+*/
+
+#include "advection.glsl"
+
+// Returns entry (i, j) of an element's local matrix of mass_coefficient * M + stiffness_coefficient * K - advection_coefficient * (advection matrix)
+float element_entry(int element, int i, int j, float mass_coefficient, float stiffness_coefficient, float advection_coefficient) {
+    float area = element_data[element];
+    vec3 gradient_i = vec3(element_data[(1 + 3 * i) * num_elements + element], element_data[(2 + 3 * i) * num_elements + element], element_data[(3 + 3 * i) * num_elements + element]);
+    vec3 gradient_j = vec3(element_data[(1 + 3 * j) * num_elements + element], element_data[(2 + 3 * j) * num_elements + element], element_data[(3 + 3 * j) * num_elements + element]);
+    float mass_factor = lumped_mass ? (i == j ? 1.0 / 3.0 : 0.0) : (i == j ? 1.0 / 6.0 : 1.0 / 12.0);
+    float entry = mass_coefficient * area * mass_factor + stiffness_coefficient * area * dot(gradient_i, gradient_j);
+
+    if (advection_coefficient != 0.0) {
+        vec3 normal = vec3(element_data[10 * num_elements + element], element_data[11 * num_elements + element], element_data[12 * num_elements + element]);
+        vec3 projected_velocity = project_velocity(velocity, normal);
+        float interior = element_data[(13 + i) * num_elements + element] * element_data[(13 + j) * num_elements + element];
+        entry -= advection_coefficient * interior * (area / 3.0) * dot(projected_velocity, gradient_j);
+    }
+    return entry;
+}
+
+// Computes row i of a linear combination of the FEM matrices times the vector selected by which, without a matrix,
+// by gathering the local matrices of the elements that touch node i
+float matrix_free_row(int which, float mass_coefficient, float stiffness_coefficient, float advection_coefficient) {
+    int row = int(gl_GlobalInvocationID.x);
+    if (row >= N) return 0.0;
+
+    float product = 0.0;
+    for (int idx = node_element_offsets[row]; idx < node_element_offsets[row + 1]; idx++) {
+        int element = node_elements[idx] / 3;
+        int i = node_elements[idx] % 3;
+
+        for (int j = 0; j < 3; j++) {
+            int col_idx = element_unknowns[j * num_elements + element];
+            if (col_idx != -1) {
+                product += matrix_free_operand(which, col_idx) * element_entry(element, i, j, mass_coefficient, stiffness_coefficient, advection_coefficient);
+            }
+        }
+    }
+    return product;
+}
\ No newline at end of file
@@ -0,0 +1,33 @@
+/*
+    matrix_layout.glsl
+
+    Addressing of the assembled matrices in the ELL, SELL-C-sigma, and CSR formats that GPUSolver uploads,
+    included by the cgm, cgm_helper, and bicgstab compute shaders. The including shader declares N, M,
+    matrix_format, slice_height, and the MatrixLayout buffer.
+*/
+
+// Returns the row that an invocation computes in the matrix-vector products (invocation < N). SELL-C-sigma stores
+// the rows sorted by length, so that the rows sharing a slice are padded as little as possible.
+int matrix_row(int invocation) {
+    if (matrix_format != 1) return invocation;
+    return matrix_layout[(N + slice_height - 1) / slice_height + 1 + invocation];
+}
+
+// Finds the entries of the row that an invocation computes, which are stored from begin up to end, stride apart.
+// Padding entries have a column index of -1.
+void row_entries(int invocation, out int begin, out int end, out int stride) {
+    if (matrix_format == 1) { // SELL-C-sigma: each slice of slice_height rows is stored column by column, padded to its longest row
+        int slice = invocation / slice_height;
+        begin = matrix_layout[slice] + invocation % slice_height;
+        end = matrix_layout[slice + 1];
+        stride = slice_height;
+    } else if (matrix_format == 2) { // CSR
+        begin = matrix_layout[invocation];
+        end = matrix_layout[invocation + 1];
+        stride = 1;
+    } else { // ELL: every row is padded to M entries
+        begin = invocation * M;
+        end = begin + M;
+        stride = 1;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,76 @@
+/*
+    reduction.glsl
+
+    Sums over a whole dispatch in a single pass, used for the dot products of the cgm and bicgstab compute shaders.
+    The including shader enables the GL_KHR_shader_subgroup extensions when they are available, uses a work group
+    size of at most 1024, and declares N, reduction_count, and result[] in its State block.
+*/
+
+shared float shared_data[1024];
+shared bool last_work_group;
+
+// Returns the sum of value over the work group to every invocation in it
+float work_group_sum(float value) {
+#ifdef GL_KHR_shader_subgroup_arithmetic
+    // Sum within each subgroup, then have the first subgroup sum the subgroup totals
+    float subgroup_sum = subgroupAdd(value);
+    if (subgroupElect())
+        shared_data[gl_SubgroupID] = subgroup_sum;
+    barrier();
+
+    if (gl_SubgroupID == 0) {
+        float sum = 0.0;
+        for (uint i = gl_SubgroupInvocationID; i < gl_NumSubgroups; i += gl_SubgroupSize)
+            sum += shared_data[i];
+        sum = subgroupAdd(sum); // Every invocation of the subgroup has read shared_data after this
+        if (subgroupElect())
+            shared_data[0] = sum;
+    }
+#else
+    int localID = int(gl_LocalInvocationID.x);
+    shared_data[localID] = value;
+    barrier();
+
+    for (int i = int(gl_WorkGroupSize.x) / 2; i > 0; i >>= 1) {
+        if (localID < i) {
+            shared_data[localID] += shared_data[localID + i];
+        }
+        barrier();
+    }
+#endif
+    barrier();
+    float sum = shared_data[0];
+    barrier();
+    return sum;
+}
+
+// Sums value over every invocation of the dispatch, so a dot product takes a single dispatch. Each work group stores
+// its sum in result[], and the last work group to finish adds those up into result[0].
+// Returns true in the one invocation that stored the total.
+bool parallel_reduction(float value) {
+    if (int(gl_GlobalInvocationID.x) >= N) value = 0.0;
+    float sum = work_group_sum(value);
+
+    if (gl_LocalInvocationIndex == 0) {
+        result[gl_WorkGroupID.x] = sum;
+        memoryBarrierBuffer();
+        last_work_group = atomicAdd(reduction_count, 1u) == gl_NumWorkGroups.x - 1;
+    }
+    barrier();
+    if (!last_work_group)
+        return false;
+
+    // Every other work group has stored its sum by now
+    memoryBarrierBuffer();
+    float total = 0.0;
+    for (uint i = gl_LocalInvocationIndex; i < gl_NumWorkGroups.x; i += gl_WorkGroupSize.x)
+        total += result[i];
+    total = work_group_sum(total);
+
+    if (gl_LocalInvocationIndex == 0) {
+        result[0] = total;
+        reduction_count = 0;
+        return true;
+    }
+    return false;
+}
\ No newline at end of file
@@ -7,11 +7,13 @@
 #include "Application.hpp"
 #include "GLFW/glfw3.h"
 #include "Utils/PSLG.hpp"
+#include "Utils/Profiler.hpp"
 
 #include <iostream>
 #include <filesystem>
 
 Application::Application() {
+    Profiler::get().name_current_thread("Main");
     init_opengl_window(window_width, window_height);
     init_imgui("assets/NotoSans.ttf", 20);
 
@@ -61,9 +63,11 @@ void Application::load() {
     fem_ctx = std::make_shared<FEMContext>();
 
     cpu_solver = std::make_shared<CPUSolver>(fem_ctx);
+    simulation = std::make_shared<SimulationThread>(cpu_solver);
     gpu_solver = std::make_shared<GPUSolver>(fem_ctx);
     gpu_solver->cgm_compute_shader = as.get_compute_shader("cgm");
     gpu_solver->cgm_helper_compute_shader = as.get_compute_shader("cgm_helper");
+    gpu_solver->bicgstab_compute_shader = as.get_compute_shader("bicgstab");
     switch_solver(settings.use_gpu);
 
     switch_color_map("Viridis");
@@ -78,6 +82,7 @@ void Application::load() {
  * Renders to the window everything that needs to be drawn.
  */
 void Application::render() {
+    ScopedTimer timer("Application::render");
     glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glEnable(GL_DEPTH_TEST);
@@ -110,6 +115,7 @@ void Application::render() {
  * Renders the GUI elements with ImGUI.
  */
 void Application::render_gui() {
+    ScopedTimer timer("Application::render_gui");
     const ImGuiViewport *main_viewport = ImGui::GetMainViewport();
 
     ImGuiStyle& style = ImGui::GetStyle();
@@ -363,19 +369,134 @@ void Application::render_gui() {
         if (ImGui::Checkbox("Use GPU (Experimental)", &settings.use_gpu)) switch_solver(settings.use_gpu);
         if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
             ImGui::SetTooltip("Use the GPU for computation. (Experimental Feature)\nNOTE: The GPU solver sometimes needs different parameter values compared to the CPU solver for some equations");
+        if (!settings.use_gpu) {
+            ImGui::Checkbox("Background Thread", &settings.simulation_thread);
+            if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+                ImGui::SetTooltip("Run the solver on its own thread, so that the simulation speed does not depend on the frame rate\nand slow timesteps do not hold up the interface.");
+        }
+        if (!settings.use_gpu && settings.simulation_thread) {
+            ImGui::Text("Steps per Second");
+            ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
+            ImGui::SliderFloat("##Steps per Second", &simulation->steps_per_second, 0.0f, 1000.0f, simulation->steps_per_second == 0.0f ? "Unlimited" : "%.0f");
+            if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+                ImGui::SetTooltip("The number of timesteps to take every second. Set to 0 to take them as fast as possible.");
+            ImGui::Text(std::format("{:.0f} steps per second", simulation->measured_steps_per_second()).c_str());
+        } else {
+            ImGui::Text("Steps per Frame");
+            ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
+            ImGui::SliderInt("##Steps per Frame", &settings.steps_per_frame, 1, 20);
+            if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+                ImGui::SetTooltip("The number of timesteps to take every frame.");
+        }
+        if (ImGui::Checkbox("Matrix-Free", &fem_ctx->matrix_free)) {
+            clear_solver();
+            fem_ctx->update_boundary_conditions();
+            gpu_solver->init();
+        }
+        if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+            ImGui::SetTooltip("Apply the FEM operators element by element instead of assembling matrices.\nUses much less memory on large meshes, but each iteration does more arithmetic.\nThe linear systems are always solved iteratively in this mode.");
+        bool reorder_nodes = fem_ctx->node_ordering == NodeOrdering::Reverse_Cuthill_McKee;
+        if (ImGui::Checkbox("Reorder Nodes", &reorder_nodes)) {
+            fem_ctx->node_ordering = reorder_nodes ? NodeOrdering::Reverse_Cuthill_McKee : NodeOrdering::Vertex;
+            clear_solver();
+            fem_ctx->update_boundary_conditions();
+            gpu_solver->init();
+        }
+        if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+            ImGui::SetTooltip("Number the unknowns with the Reverse Cuthill-McKee algorithm so that neighboring nodes are close together in memory.\nThis narrows the bandwidth of the matrices, which makes each iteration more cache friendly.");
+        ImGui::Text(std::format("Matrix bandwidth: {}", fem_ctx->matrix_bandwidth()).c_str());
+        if (ImGui::Checkbox("Lumped Mass", &fem_ctx->lump_mass)) {
+            fem_ctx->assemble_matrices();
+            gpu_solver->init();
+        }
+        if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+            ImGui::SetTooltip("Sum each row of the mass matrix onto its diagonal.\nThis makes the system matrices better conditioned at the cost of some accuracy.");
         if (settings.use_gpu) {
             ImGui::Text("Max GPU Iterations");
             ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
             ImGui::SliderInt("##Max GPU Iterations", &gpu_solver->max_iterations, 1, 15);
             if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
                 ImGui::SetTooltip("The maximum number of iterations to run the conjugate gradient method on the GPU every timestep.");
+            ImGui::Checkbox("Sync-Free Iterations", &gpu_solver->sync_free);
+            if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+                ImGui::SetTooltip("Queue every iteration without waiting for the GPU, which skips the ones after convergence on its own.\nThe residual is read back once per timestep, so the iteration count and instability detection lag a few timesteps behind.");
+            if (!fem_ctx->matrix_free) {
+                ImGui::Text("Matrix Format");
+                ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
+                if (ImGui::Combo("##Matrix Format", (int*)&gpu_solver->matrix_format, "ELL\0SELL-C-sigma\0CSR\0Automatic\0", ImGuiComboFlags_WidthFitPreview))
+                    gpu_solver->init();
+                if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+                    ImGui::SetTooltip("How the matrices are stored on the GPU.\nELL pads every row to the longest row, SELL-C-sigma pads groups of 32 rows of similar length to their longest row,\nand CSR stores no padding but reads the rows of neighboring invocations from scattered memory.");
+                const char* format_names[] = {"ELL", "SELL-C-sigma", "CSR"};
+                ImGui::Text(std::format("{}: {:.0f}% padding", format_names[static_cast<int>(gpu_solver->active_matrix_format)], 100.0f * gpu_solver->matrix_padding).c_str());
+            }
+        } else {
+            ImGui::Text("Time Integration");
+            ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
+            ImGui::Combo("##Time Integration", (int*)&cpu_solver->time_integrator, "Implicit\0Forward Euler\0Runge-Kutta 4\0Spectral\0Crank-Nicolson\0BDF2\0", ImGuiComboFlags_WidthFitPreview);
+            if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+                ImGui::SetTooltip("Implicit: Backward Euler, which solves a linear system every timestep and is stable for any timestep\nForward Euler, Runge-Kutta 4: Explicit schemes with the lumped mass matrix, so there is no linear solve.\nEach timestep is split into as many substeps as are needed for stability. The Wave Equation uses leapfrog integration.\nSpectral: Evolves the Heat and Wave Equations exactly in a basis of the lowest frequency eigenmodes of the mesh.\nOther equations and the matrix-free mode use the implicit scheme.\nCrank-Nicolson, BDF2: Second order implicit schemes, which are as accurate as Implicit with much longer timesteps.\nCrank-Nicolson can ring around sharp features, which BDF2 damps out.");
+            if (cpu_solver->time_integrator == TimeIntegrator::Spectral) {
+                ImGui::Text("Modes");
+                ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
+                ImGui::SliderInt("##Modes", &cpu_solver->num_modes, 8, 256);
+                if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+                    ImGui::SetTooltip("The number of eigenmodes in the basis. More modes keep finer detail, but take longer to compute\nwhenever the mesh or boundary conditions change.");
+                if (!cpu_solver->modal_basis_converged)
+                    ImGui::TextColored(ImVec4(1.0f, 0.6f, 0.0f, 1.0f), std::format("The modal basis did not converge (residual {:.1e})", cpu_solver->modal_basis_residual).c_str());
+            }
+            if (cpu_solver->time_integrator == TimeIntegrator::Implicit || cpu_solver->time_integrator == TimeIntegrator::Crank_Nicolson || cpu_solver->time_integrator == TimeIntegrator::BDF2) {
+                ImGui::Checkbox("Adaptive Time Step", &cpu_solver->adaptive_time_step);
+                if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+                    ImGui::SetTooltip("Estimates the error of every timestep, and adjusts the timestep to keep it near the tolerance.\nTimesteps with too much error are retried with a shorter timestep.");
+                if (cpu_solver->adaptive_time_step) {
+                    ImGui::Text("Tolerance");
+                    ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
+                    ImGui::SliderFloat("##Tolerance", &cpu_solver->tolerance, 1e-5f, 1e-1f, "%.0e", ImGuiSliderFlags_Logarithmic);
+                    ImGui::Text(std::format("{} rejected attempts last step", cpu_solver->rejected_steps).c_str());
+                }
+            }
+        }
+        bool uses_spectral = !settings.use_gpu && !fem_ctx->matrix_free && cpu_solver->time_integrator == TimeIntegrator::Spectral &&
+            (fem_ctx->equation == Equation::Heat || fem_ctx->equation == Equation::Wave);
+        bool uses_explicit = !settings.use_gpu && (cpu_solver->time_integrator == TimeIntegrator::Forward_Euler || cpu_solver->time_integrator == TimeIntegrator::Runge_Kutta_4);
+        if (!settings.use_gpu && !fem_ctx->matrix_free && !uses_spectral && !uses_explicit) {
+            ImGui::Text("Linear Solver");
+            ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
+            ImGui::Combo("##Linear Solver", (int*)&cpu_solver->linear_solver, "Iterative\0Direct\0", ImGuiComboFlags_WidthFitPreview);
+            if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+                ImGui::SetTooltip("The method used to solve the linear system every timestep.\nIterative: Conjugate gradient method, or BiCGSTAB with an incomplete LU preconditioner for Advection-Diffusion\nDirect: Factorizes the system once (LDLT, or LU for Advection-Diffusion), then each timestep is a pair of triangular solves");
+            if (cpu_solver->linear_solver == LinearSolver::Iterative) {
+                ImGui::Text("Preconditioner");
+                ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
+                ImGui::Combo("##Preconditioner", (int*)&cpu_solver->preconditioner, "Jacobi\0Incomplete Cholesky\0Algebraic Multigrid\0Geometric Multigrid\0", ImGuiComboFlags_WidthFitPreview);
+                if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+                    ImGui::SetTooltip("The preconditioner used by the conjugate gradient method. It is rebuilt only when the system matrix changes.\nJacobi: Cheapest to build and apply, but needs more iterations as the mesh gets finer\nIncomplete Cholesky: Fewer iterations, but each one is slower\nAlgebraic Multigrid: The number of iterations stays nearly the same as the mesh gets finer\nGeometric Multigrid: Like Algebraic Multigrid, but uses the coarser meshes that the PSLG was triangulated through");
+                if (cpu_solver->preconditioner == PreconditionerType::Geometric_Multigrid && surface->coarse_levels.empty())
+                    ImGui::TextWrapped("No coarser meshes, so Algebraic Multigrid is used. Triangulate a PSLG with Geometric Multigrid selected to build them.");
+            }
+        }
+        if (uses_spectral) {
+            ImGui::Text(std::format("Spectral step with {} modes", cpu_solver->num_modes).c_str());
+        } else if (uses_explicit) {
+            ImGui::Text(std::format("{} substeps last step", cpu_solver->substeps).c_str());
+            if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+                ImGui::SetTooltip("The number of explicit substeps needed to stay stable during the last timestep.\nThis grows as the elements get smaller.");
+        } else if (!settings.use_gpu && !fem_ctx->matrix_free && cpu_solver->linear_solver == LinearSolver::Direct && !cpu_solver->direct_solver_failed) {
+            ImGui::Text("Direct solve, no iterations");
+        } else {
+            ImGui::Text(std::format("{} iterations last step", solver->iterations).c_str());
+            if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+                ImGui::SetTooltip("The number of iterations the solver needed to converge during the last timestep.\nThe previous timestep's solution is used as the starting guess.");
+            if (!settings.use_gpu && !fem_ctx->matrix_free && cpu_solver->linear_solver == LinearSolver::Direct)
+                ImGui::TextColored(ImVec4(1.0f, 0.6f, 0.0f, 1.0f), "The system could not be factorized, so it is solved iteratively");
         }
         switch (fem_ctx->equation) {
             case Equation::Heat: {
                 auto params = std::static_pointer_cast<HeatParameters>(fem_ctx->parameters[Equation::Heat]);
                 ImGui::Text("Time Step");
                 ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
-                ImGui::SliderFloat("##Heat Time Step", &params->time_step, 0.005f, 0.25f); 
+                ImGui::SliderFloat("##Heat Time Step", &params->time_step, params->min_time_step, params->max_time_step); 
                 ImGui::Text("Diffusivity Constant (c)");
                 ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
                 ImGui::SliderFloat("##Heat Diffusivity Constant (c)", &params->conductivity, 0.005f, 0.25f);
@@ -384,20 +505,20 @@ void Application::render_gui() {
                 auto params = std::static_pointer_cast<AdvectionDiffusionParameters>(fem_ctx->parameters[Equation::Advection_Diffusion]);
                 ImGui::Text("Time Step");
                 ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
-                ImGui::SliderFloat("##Advection-Diffusion Time Step", &params->time_step, 0.001f, 0.05f); 
+                ImGui::SliderFloat("##Advection-Diffusion Time Step", &params->time_step, params->min_time_step, params->max_time_step); 
                 ImGui::Text("Diffusivity Constant(c)");
                 ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
                 ImGui::SliderFloat("##Advection-Diffusion Diffusivity Constant (c)", &params->c, 0.001f, 0.25f);
                 ImGui::Text("Velocity (v)");
                 ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
                 if (ImGui::SliderFloat3("##Advection-Diffusion Velocity (v)", params->velocity.data(), -5.0f, 5.0f))
-                    fem_ctx->assemble_matrices();
+                    fem_ctx->assemble_advection_matrix();
             } break;
             case Equation::Wave: {
                 auto params = std::static_pointer_cast<WaveParameters>(fem_ctx->parameters[Equation::Wave]);
                 ImGui::Text("Time Step");
                 ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
-                ImGui::SliderFloat("##Wave Time Step", &params->time_step, 0.005f, 0.25f); 
+                ImGui::SliderFloat("##Wave Time Step", &params->time_step, params->min_time_step, params->max_time_step); 
                 ImGui::Text("Propagation Speed (c)");
                 ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
                 ImGui::SliderFloat("##Wave Propagation Speed (c)", &params->c, 0.005f, 0.25f);
@@ -406,7 +527,7 @@ void Application::render_gui() {
                 auto params = std::static_pointer_cast<ReactionDiffusionParameters>(fem_ctx->parameters[Equation::Reaction_Diffusion]);
                 ImGui::Text("Time Step");
                 ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
-                ImGui::SliderFloat("##Reaction-Diffusion Time Step", &params->time_step, 0.0001f, 0.010f, "%.4f"); 
+                ImGui::SliderFloat("##Reaction-Diffusion Time Step", &params->time_step, params->min_time_step, params->max_time_step, "%.4f"); 
                 ImGui::Text("Feed Rate (f)");
                 ImGui::SetNextItemWidth(ImGui::GetContentRegionAvail().x);
                 ImGui::SliderFloat("##Reaction-Diffusion Feed Rate (f)", &params->feed_rate, 0.0f, 0.1f); 
@@ -423,6 +544,46 @@ void Application::render_gui() {
         }
     }
 
+    ImGui::SeparatorText("Profiler");
+    bool record_timings = Profiler::get().is_enabled();
+    if (ImGui::Checkbox("Record Timings", &record_timings))
+        Profiler::get().set_enabled(record_timings);
+    if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+        ImGui::SetTooltip("Time the solver, picking and rendering on the CPU, and every compute dispatch and frame on the GPU.\nTimes are in milliseconds, over the last %d calls.", Profiler::SAMPLES_PER_SUMMARY);
+    if (record_timings) {
+        if (ImGui::Button("Export Trace", ImVec2(ImGui::GetContentRegionAvail().x / 2, 0.0))) export_trace();
+        if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+            ImGui::SetTooltip("Save the recorded timings as a Chrome trace, which can be opened in chrome://tracing or ui.perfetto.dev");
+        ImGui::SameLine();
+        if (ImGui::Button("Clear Timings", ImVec2(ImGui::GetContentRegionAvail().x, 0.0))) Profiler::get().clear();
+
+        std::vector<ProfileSummary> summaries = Profiler::get().summaries();
+        float table_height = ImGui::GetTextLineHeightWithSpacing() * (std::min<int>(summaries.size(), 12) + 2);
+        ImGuiTableFlags table_flags = ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_ScrollX | ImGuiTableFlags_ScrollY | ImGuiTableFlags_SizingFixedFit;
+        if (!summaries.empty() && ImGui::BeginTable("##Timings", 5, table_flags, ImVec2(0.0f, table_height))) {
+            ImGui::TableSetupScrollFreeze(0, 1);
+            ImGui::TableSetupColumn("Zone");
+            ImGui::TableSetupColumn("Last");
+            ImGui::TableSetupColumn("Mean");
+            ImGui::TableSetupColumn("Max");
+            ImGui::TableSetupColumn("Calls/s");
+            ImGui::TableHeadersRow();
+            for (const ProfileSummary& summary : summaries) {
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn();
+                if (summary.track == Profiler::GPU_TRACK)
+                    ImGui::TextColored(ImVec4(0.8f, 0.8f, 1.0f, 1.0f), "GPU: %s", summary.name.c_str());
+                else
+                    ImGui::TextUnformatted(summary.name.c_str());
+                ImGui::TableNextColumn(); ImGui::Text("%.3f", summary.last);
+                ImGui::TableNextColumn(); ImGui::Text("%.3f", summary.mean);
+                ImGui::TableNextColumn(); ImGui::Text("%.3f", summary.max);
+                ImGui::TableNextColumn(); ImGui::Text("%.1f", summary.calls_per_second);
+            }
+            ImGui::EndTable();
+        }
+    }
+
     ImGui::SetNextWindowSize(ImVec2(0, 0), ImGuiCond_Always);
     ImGui::SetNextWindowContentSize(ImVec2(0, 0));
     ImGui::SetNextWindowPos(ImVec2(main_viewport->WorkPos.x + gui_width + 5, main_viewport->WorkPos.y + 5));
@@ -505,6 +666,7 @@ void Application::render_gui() {
  */
 void Application::run() {
     while (!glfwWindowShouldClose(window)) {
+        ScopedTimer frame_timer("Frame");
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
@@ -516,6 +678,10 @@ void Application::run() {
         if (gui_visible)
             ImGui::Begin("Finite Element Visualizer", 0, ImGuiWindowFlags_NoCollapse | ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize | (!gui_visible ? ImGuiWindowFlags_NoScrollWithMouse : 0));
 
+        // Everything before rendering may read or change the simulation state, so the simulation thread waits until then
+        std::unique_lock<std::mutex> simulation_lock = simulation->lock();
+        bool use_simulation_thread = settings.simulation_thread && !settings.use_gpu;
+
         int brush_idx = -1;
 
         if (settings.interact_mode == InteractMode::DrawPSLG)
@@ -527,17 +693,21 @@ void Application::run() {
 
         if (fem_ctx->surface && settings.use_gpu)
             gpu_solver->brush(brush_idx, settings.brush_strength);
-        if (fem_ctx->surface && !settings.paused)
+        bool unstable = simulation->take_instability();
+        if (fem_ctx->surface && !settings.paused && !use_simulation_thread)
         {
-            solver->advance_time();
-            if (solver->has_numerical_instability())
-            {
-                clear_solver();
-                settings.paused = true;
-                settings.error_message = "Numerical instability detected!\nTry changing the solver's parameters or brush strength.\nClearing solver values and pausing...";
-                ImGui::OpenPopup("Error");
+            for (int step = 0; step < settings.steps_per_frame && !unstable; step++) {
+                solver->advance_time();
+                unstable = solver->has_numerical_instability();
             }
         }
+        if (unstable)
+        {
+            clear_solver();
+            settings.paused = true;
+            settings.error_message = "Numerical instability detected!\nTry changing the solver's parameters or brush strength.\nClearing solver values and pausing...";
+            ImGui::OpenPopup("Error");
+        }
 
         if (ImGui::BeginPopupModal("Error", nullptr, ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoMove))
         {
@@ -549,11 +719,23 @@ void Application::run() {
 
         if (gui_visible)
             render_gui();
+
+        use_simulation_thread = settings.simulation_thread && !settings.use_gpu;
+        simulation->set_running(use_simulation_thread && fem_ctx->surface && !settings.paused);
         if (surface->initialized && !settings.use_gpu)
         {
-            surface->load_value_buffer();
+            if (!simulation->is_running())
+                surface->load_value_buffer();
+            else if (simulation->take_values(display_values) && display_values.size() == surface->values.size())
+                surface->load_value_buffer(display_values);
         }
+        simulation_lock.unlock();
+
+        // Compute dispatches inside render() are covered by this query, since GPU timer queries cannot be nested
+        render_timer.begin("Render");
         render();
+        render_timer.end();
+        render_timer.collect();
         if (gui_visible)
             ImGui::End();
 
@@ -590,7 +772,9 @@ void Application::init_surface_from_pslg() {
     bvh = nullptr;
 
     try {
+        surface->build_hierarchy = !settings.use_gpu && cpu_solver->preconditioner == PreconditionerType::Geometric_Multigrid;
         surface->init_from_PSLG(*pslg);
+        surface->load_buffers();
         fem_ctx->init_from_surface(surface);
         cpu_solver->clear_values();
         gpu_solver->init();
@@ -618,6 +802,7 @@ void Application::init_surface_from_obj(const char* obj_path) {
 
     try {
         surface->init_from_obj(obj_path);
+        surface->load_buffers();
         fem_ctx->init_from_surface(surface);
         cpu_solver->clear_values();
         gpu_solver->init();
@@ -688,6 +873,17 @@ void Application::export_to_ply() {
         ImGui::OpenPopup("Error");
     }
 }
+void Application::export_trace() {
+    nfdchar_t *out_path = nullptr;
+    nfdresult_t result = NFD_SaveDialog("json", "trace.json", &out_path);
+    if (result == NFD_CANCEL || result == NFD_ERROR) return;
+    try {
+        Profiler::get().write_chrome_trace(out_path);
+    } catch (std::runtime_error& e) {
+        settings.error_message = e.what();
+        ImGui::OpenPopup("Error");
+    }
+}
 void Application::load_stencil_image() {
     nfdchar_t *out_path = nullptr;
     nfdresult_t result = NFD_OpenDialog(nullptr, nullptr, &out_path);
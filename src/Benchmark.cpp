@@ -0,0 +1,564 @@
+#include "FEM/CPUSolver.hpp"
+#include "Utils/BVH.hpp"
+#include "Utils/Surface.hpp"
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Benchmarks the FEM pipeline on procedurally generated meshes, and writes the results as JSON so that they can be
+ * compared across versions. Every benchmark runs once untimed to warm up, then is timed over a fixed number of repetitions.
+ * Meshes, initial values and rays are generated deterministically, so runs on the same machine are comparable.
+ *
+ * Example:
+ *   fea_bench --sizes 1000,10000,100000 --filter advance_time --output results.json
+ */
+
+const char* USAGE =
+    "Usage: fea_bench [options]\n"
+    "\n"
+    "  --sizes <n,n,...>     The approximate numbers of nodes of the generated meshes (default 1000,10000,100000,1000000,5000000)\n"
+    "  --filter <text>       Only run benchmarks whose name contains text. May be repeated\n"
+    "  --repetitions <count> The number of timed repetitions of each benchmark (default 5)\n"
+    "  --bvh-depth <depth>   The depth of the BVHs that are built (default 10, as in the application)\n"
+    "  --output <path>       Write the JSON results to a file instead of standard output\n";
+
+// The direct solver's factorizations take too much memory past this size
+const int MAX_DIRECT_SOLVER_NODES = 1000000;
+
+/**
+ * The timings of one benchmark on one mesh
+ */
+struct BenchmarkResult {
+    std::string name;
+    std::string mesh;
+    std::string variant; // The solver configuration, for benchmarks that have more than one
+    int nodes;
+    int triangles;
+    std::vector<double> milliseconds; // One per repetition
+    double iterations = -1.0; // The average number of linear solver iterations per repetition, or -1 if there is no linear solve
+    double min_angle = -1.0; // The smallest angle of any triangle in degrees, for benchmarks that triangulate, or -1 otherwise
+    int bandwidth = -1; // The bandwidth of the FEM matrices, for benchmarks that compare node orderings, or -1 otherwise
+};
+
+/**
+ * Options that apply to every benchmark
+ */
+struct BenchmarkOptions {
+    std::vector<int> sizes = {1000, 10000, 100000, 1000000, 5000000};
+    std::vector<std::string> filters;
+    int repetitions = 5;
+    int bvh_depth = 10;
+    std::string output_path;
+};
+
+/**
+ * Sets the values of a surface to a smooth pattern in [0, 1], so that solvers and exports have nonzero work to do
+ */
+void set_test_values(Surface& surface) {
+    for (int i = 0; i < surface.vertices.size(); i++) {
+        glm::vec3 p = surface.vertices[i];
+        surface.values[i] = 0.5f + 0.5f * std::sin(3.0f * p.x) * std::cos(2.0f * p.z + p.y);
+    }
+}
+
+/**
+ * Builds a surface from a grid of rows by columns vertices, placed by a function of the grid coordinates.
+ * A periodic grid wraps around in both directions, and has no boundary.
+ */
+std::shared_ptr<Surface> make_grid_surface(int rows, int columns, bool periodic, std::function<void(float, float, glm::vec3&, glm::vec3&)> place) {
+    auto surface = std::make_shared<Surface>();
+    int cell_rows = periodic ? rows : rows - 1;
+    int cell_columns = periodic ? columns : columns - 1;
+
+    surface->vertices.resize(rows * columns);
+    surface->normals.resize(rows * columns);
+    surface->on_boundary = std::vector<bool>(rows * columns, false);
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < columns; j++) {
+            int idx = i * columns + j;
+            place(static_cast<float>(i) / cell_rows, static_cast<float>(j) / cell_columns, surface->vertices[idx], surface->normals[idx]);
+            surface->on_boundary[idx] = !periodic && (i == 0 || j == 0 || i == rows - 1 || j == columns - 1);
+        }
+    }
+
+    for (int i = 0; i < cell_rows; i++) {
+        for (int j = 0; j < cell_columns; j++) {
+            unsigned int a = i * columns + j;
+            unsigned int b = i * columns + (j + 1) % columns;
+            unsigned int c = ((i + 1) % rows) * columns + j;
+            unsigned int d = ((i + 1) % rows) * columns + (j + 1) % columns;
+            surface->triangles.push_back({a, c, b});
+            surface->triangles.push_back({b, c, d});
+        }
+    }
+
+    surface->num_boundary_points = std::count(surface->on_boundary.begin(), surface->on_boundary.end(), true);
+    surface->values = std::vector<float>(surface->vertices.size(), 0.0f);
+    surface->closed = periodic;
+    surface->initialized = true;
+    return surface;
+}
+
+/**
+ * A flat square on the XZ plane with about num_nodes nodes, which is open and has a boundary
+ */
+std::shared_ptr<Surface> make_plane(int num_nodes) {
+    int n = std::max(2, static_cast<int>(std::round(std::sqrt(num_nodes))));
+    return make_grid_surface(n, n, false, [](float s, float t, glm::vec3& position, glm::vec3& normal) {
+        position = glm::vec3(2.0f * s - 1.0f, 0.0f, 2.0f * t - 1.0f);
+        normal = glm::vec3(0.0f, 1.0f, 0.0f);
+    });
+}
+
+/**
+ * A torus with about num_nodes nodes, which is closed
+ */
+std::shared_ptr<Surface> make_torus(int num_nodes) {
+    int n = std::max(3, static_cast<int>(std::round(std::sqrt(num_nodes / 2.0))));
+    const float major_radius = 1.0f, minor_radius = 0.4f;
+    return make_grid_surface(2 * n, n, true, [&](float s, float t, glm::vec3& position, glm::vec3& normal) {
+        float u = 2.0f * glm::pi<float>() * s, v = 2.0f * glm::pi<float>() * t;
+        normal = glm::vec3(std::cos(u) * std::cos(v), std::sin(v), std::sin(u) * std::cos(v));
+        position = major_radius * glm::vec3(std::cos(u), 0.0f, std::sin(u)) + minor_radius * normal;
+    });
+}
+
+/**
+ * Randomly permutes the vertices of a surface, keeping its triangles the same, like a mesh file whose vertices are
+ * stored in no particular order
+ */
+void shuffle_vertices(Surface& surface, unsigned int seed) {
+    std::vector<unsigned int> permutation(surface.vertices.size());
+    std::iota(permutation.begin(), permutation.end(), 0);
+    std::shuffle(permutation.begin(), permutation.end(), std::mt19937(seed));
+
+    std::vector<glm::vec3> vertices(surface.vertices.size()), normals(surface.normals.size());
+    std::vector<bool> on_boundary(surface.on_boundary.size());
+    for (int i = 0; i < permutation.size(); i++) {
+        vertices[permutation[i]] = surface.vertices[i];
+        normals[permutation[i]] = surface.normals[i];
+        on_boundary[permutation[i]] = surface.on_boundary[i];
+    }
+    surface.vertices = std::move(vertices);
+    surface.normals = std::move(normals);
+    surface.on_boundary = std::move(on_boundary);
+    for (Triangle& triangle : surface.triangles)
+        for (int i = 0; i < 3; i++)
+            triangle[i] = permutation[triangle[i]];
+}
+
+/**
+ * Returns the smallest interior angle of any triangle of a surface, in degrees
+ */
+double min_triangle_angle(const Surface& surface) {
+    double min_angle = 180.0;
+    for (Triangle triangle : surface.triangles) {
+        for (int j = 0; j < 3; j++) {
+            glm::vec3 corner = surface.vertices[triangle[j]];
+            glm::vec3 u = surface.vertices[triangle[(j + 1) % 3]] - corner;
+            glm::vec3 v = surface.vertices[triangle[(j + 2) % 3]] - corner;
+            double cosine = glm::dot(u, v) / (glm::length(u) * glm::length(v));
+            min_angle = std::min(min_angle, std::acos(std::clamp(cosine, -1.0, 1.0)) * 180.0 / glm::pi<double>());
+        }
+    }
+    return min_angle;
+}
+
+/**
+ * Writes a surface to a .obj file with per vertex normals, in the form that Surface::init_from_obj reads
+ */
+void write_obj(const Surface& surface, const std::string& file_path) {
+    std::ofstream file(file_path);
+    for (const glm::vec3& vertex : surface.vertices)
+        file << std::format("v {} {} {}\n", vertex.x, vertex.y, vertex.z);
+    for (const glm::vec3& normal : surface.normals)
+        file << std::format("vn {} {} {}\n", normal.x, normal.y, normal.z);
+    for (Triangle triangle : surface.triangles)
+        file << std::format("f {0}//{0} {1}//{1} {2}//{2}\n", triangle.idx_a + 1, triangle.idx_b + 1, triangle.idx_c + 1);
+}
+
+/**
+ * Runs a benchmark once to warm up and then times it over a number of repetitions.
+ * setup runs untimed before every repetition, and run is timed.
+ */
+std::vector<double> time_repetitions(int repetitions, std::function<void()> setup, std::function<void()> run) {
+    std::vector<double> milliseconds;
+    for (int i = 0; i <= repetitions; i++) {
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        run();
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (i > 0)
+            milliseconds.push_back(elapsed);
+    }
+    return milliseconds;
+}
+
+/**
+ * Returns whether a benchmark was selected with --filter
+ */
+bool selected(const BenchmarkOptions& options, const std::string& name) {
+    if (options.filters.empty())
+        return true;
+    for (const std::string& filter : options.filters)
+        if (name.find(filter) != std::string::npos)
+            return true;
+    return false;
+}
+
+/**
+ * Runs every selected benchmark on one mesh
+ */
+void run_benchmarks(const BenchmarkOptions& options, const std::string& mesh_name, std::shared_ptr<Surface> surface, std::vector<BenchmarkResult>& results) {
+    auto record = [&](const std::string& name, const std::string& variant, std::vector<double> milliseconds, double iterations = -1.0) {
+        results.push_back({name, mesh_name, variant, static_cast<int>(surface->vertices.size()), static_cast<int>(surface->triangles.size()), milliseconds, iterations});
+        std::sort(milliseconds.begin(), milliseconds.end());
+        std::cerr << std::format("{:<28} {:<6} {:>8} nodes {:<12} median {:.3f} ms\n", name, mesh_name, surface->vertices.size(), variant, milliseconds[milliseconds.size() / 2]);
+    };
+    auto nothing = []() {};
+
+    auto fem_ctx = std::make_shared<FEMContext>();
+    fem_ctx->init_from_surface(surface);
+
+    if (selected(options, "assemble_matrices"))
+        record("assemble_matrices", "", time_repetitions(options.repetitions, nothing, [&]() { fem_ctx->assemble_matrices(); }));
+
+    // Each repetition is one time step, continuing from the last, with the operators already set up by the warm up step
+    struct SolverVariant {
+        std::string name;
+        LinearSolver linear_solver;
+        bool matrix_free;
+    };
+    std::vector<SolverVariant> variants = {
+        {"iterative", LinearSolver::Iterative, false},
+        {"matrix-free", LinearSolver::Iterative, true},
+        {"direct", LinearSolver::Direct, false},
+    };
+    std::vector<std::pair<std::string, Equation>> equations = {
+        {"heat", Equation::Heat},
+        {"wave", Equation::Wave},
+        {"advection_diffusion", Equation::Advection_Diffusion},
+        {"reaction_diffusion", Equation::Reaction_Diffusion},
+    };
+    for (auto& [equation_name, equation] : equations) {
+        std::string name = "advance_time/" + equation_name;
+        if (!selected(options, name))
+            continue;
+
+        for (const SolverVariant& variant : variants) {
+            if (variant.linear_solver == LinearSolver::Direct && surface->vertices.size() > MAX_DIRECT_SOLVER_NODES)
+                continue;
+
+            fem_ctx->equation = equation;
+            if (fem_ctx->matrix_free != variant.matrix_free) {
+                fem_ctx->matrix_free = variant.matrix_free;
+                fem_ctx->update_boundary_conditions();
+            }
+            set_test_values(*surface);
+            CPUSolver solver(fem_ctx);
+            solver.linear_solver = variant.linear_solver;
+            solver.clear_values();
+
+            std::vector<int> iterations;
+            std::vector<double> milliseconds = time_repetitions(options.repetitions, nothing, [&]() {
+                solver.advance_time();
+                iterations.push_back(solver.iterations);
+            });
+            if (solver.has_numerical_instability())
+                std::cerr << std::format("{} became numerically unstable, so its timings may not be representative\n", name);
+
+            // Leave out the warm up step
+            double mean_iterations = 0.0;
+            for (int i = 1; i < iterations.size(); i++)
+                mean_iterations += static_cast<double>(iterations[i]) / (iterations.size() - 1);
+            record(name, variant.name, milliseconds, mean_iterations);
+        }
+    }
+    if (fem_ctx->matrix_free) {
+        fem_ctx->matrix_free = false;
+        fem_ctx->update_boundary_conditions();
+    }
+
+    set_test_values(*surface);
+
+    std::unique_ptr<BVH> bvh;
+    if (selected(options, "bvh_build"))
+        record("bvh_build", "", time_repetitions(options.repetitions, nothing, [&]() { bvh = std::make_unique<BVH>(surface, options.bvh_depth); }));
+
+    if (selected(options, "bvh_ray_intersection")) {
+        if (!bvh)
+            bvh = std::make_unique<BVH>(surface, options.bvh_depth);
+
+        // Rays from random points outside of the mesh towards random vertices, like brush strokes from the camera
+        const int num_rays = 1000;
+        std::mt19937 rng(0);
+        std::uniform_int_distribution<int> vertex_distribution(0, surface->vertices.size() - 1);
+        std::uniform_real_distribution<float> direction_distribution(-1.0f, 1.0f);
+        std::vector<std::pair<glm::vec3, glm::vec3>> rays;
+        for (int i = 0; i < num_rays; i++) {
+            glm::vec3 target = surface->vertices[vertex_distribution(rng)];
+            glm::vec3 offset = glm::vec3(direction_distribution(rng), std::abs(direction_distribution(rng)) + 0.5f, direction_distribution(rng));
+            glm::vec3 origin = target + 3.0f * glm::normalize(offset);
+            rays.push_back({origin, glm::normalize(target - origin)});
+        }
+
+        int hits = 0; // Counted so that the intersections are not optimized away
+        record("bvh_ray_intersection", std::format("{}_rays", num_rays), time_repetitions(options.repetitions, nothing, [&]() {
+            for (auto& [origin, direction] : rays)
+                hits += bvh->ray_triangle_intersection(origin, direction).tri_idx != -1;
+        }));
+    }
+    bvh = nullptr;
+
+    std::string obj_path = (std::filesystem::temp_directory_path() / std::format("fea_bench_{}_{}.obj", mesh_name, surface->vertices.size())).string();
+    std::string ply_path = (std::filesystem::temp_directory_path() / std::format("fea_bench_{}_{}.ply", mesh_name, surface->vertices.size())).string();
+
+    if (selected(options, "init_from_obj")) {
+        write_obj(*surface, obj_path);
+        Surface loaded;
+        record("init_from_obj", "", time_repetitions(options.repetitions, nothing, [&]() { loaded.init_from_obj(obj_path.c_str()); }));
+        std::filesystem::remove(obj_path);
+    }
+
+    if (selected(options, "export_to_ply")) {
+        surface->color_map = std::make_shared<ColorMap>(
+            "Viridis",
+            std::array<glm::vec3, 7>({
+                glm::vec3(0.274344,0.004462,0.331359),
+                glm::vec3(0.108915,1.397291,1.388110),
+                glm::vec3(-0.319631,0.243490,0.156419),
+                glm::vec3(-4.629188,-5.882803,-19.646115),
+                glm::vec3(6.181719,14.388598,57.442181),
+                glm::vec3(4.876952,-13.955112,-66.125783),
+                glm::vec3(-5.513165,4.709245,26.582180),
+            })
+        );
+        record("export_to_ply", "", time_repetitions(options.repetitions, nothing, [&]() { surface->export_to_ply(ply_path.c_str(), 0.25f, 0.0f, MeshType::Open); }));
+        std::filesystem::remove(ply_path);
+    }
+}
+
+/**
+ * Solves the heat equation on a plane whose vertices have been shuffled, numbering the unknowns in the order of the
+ * vertices and with Reverse Cuthill-McKee, and reports the bandwidth of the matrices and the time per step of each
+ */
+void run_ordering_benchmarks(const BenchmarkOptions& options, int num_nodes, std::vector<BenchmarkResult>& results) {
+    std::shared_ptr<Surface> surface = make_plane(num_nodes);
+    shuffle_vertices(*surface, 0);
+
+    std::vector<std::pair<std::string, NodeOrdering>> orderings = {
+        {"natural", NodeOrdering::Vertex},
+        {"rcm", NodeOrdering::Reverse_Cuthill_McKee},
+    };
+    for (auto& [ordering_name, ordering] : orderings) {
+        auto fem_ctx = std::make_shared<FEMContext>();
+        fem_ctx->node_ordering = ordering;
+        fem_ctx->init_from_surface(surface);
+        set_test_values(*surface);
+        CPUSolver solver(fem_ctx);
+        solver.clear_values();
+
+        std::vector<int> iterations;
+        std::vector<double> milliseconds = time_repetitions(options.repetitions, []() {}, [&]() {
+            solver.advance_time();
+            iterations.push_back(solver.iterations);
+        });
+        double mean_iterations = 0.0;
+        for (int i = 1; i < iterations.size(); i++)
+            mean_iterations += static_cast<double>(iterations[i]) / (iterations.size() - 1);
+
+        BenchmarkResult result = {"node_ordering/heat", "shuffled_plane", ordering_name, static_cast<int>(surface->vertices.size()), static_cast<int>(surface->triangles.size()), milliseconds, mean_iterations};
+        result.bandwidth = fem_ctx->matrix_bandwidth();
+        results.push_back(result);
+        std::sort(milliseconds.begin(), milliseconds.end());
+        std::cerr << std::format("{:<28} {:<6} {:>8} nodes {:<12} median {:.3f} ms, bandwidth {}\n", result.name, result.mesh, result.nodes, result.variant,
+            milliseconds[milliseconds.size() / 2], result.bandwidth);
+    }
+}
+
+/**
+ * Triangulates a PSLG, a disk with a square hole, both in a single pass and through the coarser levels that geometric multigrid uses.
+ * The triangle area is chosen to give about num_nodes nodes, so the node counts and triangle quality of the two can be compared.
+ */
+void run_triangulation_benchmarks(const BenchmarkOptions& options, int num_nodes, std::vector<BenchmarkResult>& results) {
+    const int num_boundary_points = 256;
+    const float hole_size = 0.3f;
+    std::vector<glm::vec3> points;
+    std::vector<unsigned int> indices;
+    for (int i = 0; i < num_boundary_points; i++) {
+        float angle = 2.0f * glm::pi<float>() * i / num_boundary_points;
+        points.push_back(glm::vec3(std::cos(angle), 0.0f, std::sin(angle)));
+        indices.insert(indices.end(), {static_cast<unsigned int>(i), static_cast<unsigned int>((i + 1) % num_boundary_points)});
+    }
+    glm::vec3 hole_corners[4] = {{-hole_size, 0.0f, -hole_size}, {hole_size, 0.0f, -hole_size}, {hole_size, 0.0f, hole_size}, {-hole_size, 0.0f, hole_size}};
+    for (int i = 0; i < 4; i++) {
+        points.push_back(hole_corners[i]);
+        indices.insert(indices.end(), {static_cast<unsigned int>(num_boundary_points + i), static_cast<unsigned int>(num_boundary_points + (i + 1) % 4)});
+    }
+    std::vector<glm::vec3> holes = {glm::vec3(0.0f)};
+    float domain_area = glm::pi<float>() - 4.0f * hole_size * hole_size;
+    float triangle_area = domain_area / num_nodes;
+
+    for (bool build_hierarchy : {false, true}) {
+        Surface surface;
+        surface.build_hierarchy = build_hierarchy;
+        std::vector<double> milliseconds = time_repetitions(options.repetitions, []() {}, [&]() { surface.init_from_segments(points, indices, holes, triangle_area); });
+
+        BenchmarkResult result = {"init_from_segments", "disk", build_hierarchy ? "hierarchy" : "single_pass", static_cast<int>(surface.vertices.size()), static_cast<int>(surface.triangles.size()), milliseconds};
+        result.min_angle = min_triangle_angle(surface);
+        results.push_back(result);
+        std::sort(milliseconds.begin(), milliseconds.end());
+        std::cerr << std::format("{:<28} {:<6} {:>8} nodes {:<12} median {:.3f} ms, {} levels, min angle {:.2f}\n", result.name, result.mesh, result.nodes, result.variant,
+            milliseconds[milliseconds.size() / 2], surface.coarse_levels.size(), result.min_angle);
+    }
+}
+
+/**
+ * Escapes a string for use in JSON
+ */
+std::string json_string(const std::string& text) {
+    std::string escaped = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped + "\"";
+}
+
+/**
+ * Writes the results as JSON, along with the configuration that they were measured under
+ */
+void write_json(std::ostream& out, const BenchmarkOptions& options, const std::vector<BenchmarkResult>& results) {
+#if defined(__clang__)
+    std::string compiler = std::format("clang {}.{}.{}", __clang_major__, __clang_minor__, __clang_patchlevel__);
+#elif defined(__GNUC__)
+    std::string compiler = std::format("gcc {}.{}.{}", __GNUC__, __GNUC_MINOR__, __GNUC_PATCHLEVEL__);
+#elif defined(_MSC_VER)
+    std::string compiler = std::format("msvc {}", _MSC_VER);
+#else
+    std::string compiler = "unknown";
+#endif
+#ifdef NDEBUG
+    std::string build_type = "release";
+#else
+    std::string build_type = "debug";
+#endif
+
+    out << "{\n";
+    out << "  \"context\": {\n";
+    out << std::format("    \"compiler\": {},\n", json_string(compiler));
+    out << std::format("    \"build_type\": {},\n", json_string(build_type));
+    out << std::format("    \"hardware_threads\": {},\n", std::thread::hardware_concurrency());
+    out << std::format("    \"repetitions\": {},\n", options.repetitions);
+    out << std::format("    \"bvh_depth\": {}\n", options.bvh_depth);
+    out << "  },\n";
+    out << "  \"benchmarks\": [";
+    for (int i = 0; i < results.size(); i++) {
+        const BenchmarkResult& result = results[i];
+        std::vector<double> sorted = result.milliseconds;
+        std::sort(sorted.begin(), sorted.end());
+        double mean = 0.0;
+        for (double value : sorted)
+            mean += value / sorted.size();
+        double variance = 0.0;
+        for (double value : sorted)
+            variance += (value - mean) * (value - mean) / std::max<int>(sorted.size() - 1, 1);
+
+        out << (i == 0 ? "\n" : ",\n");
+        out << "    {";
+        out << std::format("\"name\": {}, \"mesh\": {}, \"variant\": {}, ", json_string(result.name), json_string(result.mesh), json_string(result.variant));
+        out << std::format("\"nodes\": {}, \"triangles\": {}, ", result.nodes, result.triangles);
+        out << std::format("\"min_ms\": {:.6f}, \"median_ms\": {:.6f}, \"mean_ms\": {:.6f}, \"max_ms\": {:.6f}, \"stddev_ms\": {:.6f}",
+            sorted.front(), sorted[sorted.size() / 2], mean, sorted.back(), std::sqrt(variance));
+        if (result.iterations >= 0.0)
+            out << std::format(", \"iterations\": {:.2f}", result.iterations);
+        if (result.min_angle >= 0.0)
+            out << std::format(", \"min_angle_degrees\": {:.4f}", result.min_angle);
+        if (result.bandwidth >= 0)
+            out << std::format(", \"bandwidth\": {}", result.bandwidth);
+        out << "}";
+    }
+    out << "\n  ]\n";
+    out << "}\n";
+}
+
+int run(int argc, char** argv) {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--help" || option == "-h") {
+            std::cout << USAGE;
+            return 0;
+        }
+
+        if (i + 1 >= argc)
+            throw std::runtime_error(std::format("Expected a value after {}. Use --help for the list of options.", option));
+        std::string value = argv[++i];
+
+        try {
+            if (option == "--sizes") {
+                options.sizes.clear();
+                std::istringstream fields(value);
+                std::string field;
+                while (std::getline(fields, field, ','))
+                    options.sizes.push_back(std::stoi(field));
+            } else if (option == "--filter") {
+                options.filters.push_back(value);
+            } else if (option == "--repetitions") {
+                options.repetitions = std::max(1, std::stoi(value));
+            } else if (option == "--bvh-depth") {
+                options.bvh_depth = std::stoi(value);
+            } else if (option == "--output") {
+                options.output_path = value;
+            } else {
+                throw std::runtime_error(std::format("Unknown option {}. Use --help for the list of options.", option));
+            }
+        } catch (std::logic_error&) {
+            throw std::runtime_error(std::format("Invalid value '{}' for {}.", value, option));
+        }
+    }
+
+    std::vector<BenchmarkResult> results;
+    for (int size : options.sizes) {
+        run_benchmarks(options, "plane", make_plane(size), results);
+        run_benchmarks(options, "torus", make_torus(size), results);
+        if (selected(options, "node_ordering"))
+            run_ordering_benchmarks(options, size, results);
+        if (selected(options, "init_from_segments"))
+            run_triangulation_benchmarks(options, size, results);
+    }
+
+    if (options.output_path.empty()) {
+        write_json(std::cout, options, results);
+    } else {
+        std::ofstream file(options.output_path);
+        if (!file)
+            throw std::runtime_error(std::format("Could not open {} for writing.", options.output_path));
+        write_json(file, options, results);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    try {
+        return run(argc, argv);
+    } catch (std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}
\ No newline at end of file
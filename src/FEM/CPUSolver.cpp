@@ -1,4 +1,8 @@
 #include "FEM/CPUSolver.hpp"
+#include "Utils/Profiler.hpp"
+
+#include <algorithm>
+#include <cmath>
 
 /**
  * Creates a CPUSolver that points to a FEMContext
@@ -13,9 +17,8 @@ CPUSolver::CPUSolver(std::shared_ptr<FEMContext> fem_ctx) {
 Eigen::VectorXf CPUSolver::get_surface_value_vector() {
     Eigen::VectorXf vector;
     vector.resize(fem_ctx->num_unknowns());
-    for (int i = 0; i < fem_ctx->idx_map.size(); i++)
-        if (fem_ctx->idx_map[i] != -1)
-            vector.coeffRef(fem_ctx->idx_map[i], 0) = fem_ctx->surface->values[i];
+    for (int i = 0; i < fem_ctx->node_map.size(); i++)
+        vector.coeffRef(i, 0) = fem_ctx->surface->values[fem_ctx->node_map[i]];
 
     return vector;
 }
@@ -35,6 +38,419 @@ void CPUSolver::map_vector_to_surface(const Eigen::VectorXf& vector) {
     }
 }
 
+/**
+ * Returns the cached operator for a linear system. The system matrix and its solver state
+ * are only rebuilt if the equation, its coefficients, the boundary conditions, or the
+ * FEM matrices have changed since the operator was last built.
+ * In matrix-free mode only the diagonal of the system matrix is computed, for use as a preconditioner.
+ * 
+ * @param system The linear system whose operator should be returned
+ * @param coefficients The coefficients on each of the FEM matrices that make up the system matrix
+ */
+CachedOperator& CPUSolver::get_operator(SystemMatrix system, OperatorCoefficients coefficients) {
+    OperatorKey key = {fem_ctx->equation, fem_ctx->boundary_condition, linear_solver, preconditioner, fem_ctx->matrix_free, fem_ctx->assembly_id, coefficients};
+    CachedOperator& op = operators[static_cast<int>(system)];
+
+    if (!op.valid || !(op.key == key)) {
+        ScopedTimer timer("CPUSolver::get_operator (rebuild)");
+        op.symmetric = system != SystemMatrix::Advection_Diffusion;
+
+        if (fem_ctx->matrix_free) {
+            op.A = Eigen::SparseMatrix<float>();
+            op.inverse_diagonal = fem_ctx->operator_diagonal(coefficients).cwiseInverse();
+        } else {
+            op.A = coefficients.mass * fem_ctx->mass_matrix + coefficients.stiffness * fem_ctx->stiffness_matrix;
+            if (coefficients.advection != 0.0f)
+                op.A -= coefficients.advection * fem_ctx->advection_matrix;
+
+            // A system that is singular or too badly conditioned to factorize in single precision is solved iteratively instead
+            op.linear_solver = linear_solver;
+            if (linear_solver == LinearSolver::Direct) {
+                bool factorized;
+                if (op.symmetric) {
+                    op.ldlt.compute(op.A);
+                    factorized = op.ldlt.info() == Eigen::Success;
+                } else {
+                    op.lu.analyzePattern(op.A);
+                    op.lu.factorize(op.A);
+                    factorized = op.lu.info() == Eigen::Success;
+                }
+                if (!factorized)
+                    op.linear_solver = LinearSolver::Iterative;
+            }
+            if (op.linear_solver == LinearSolver::Iterative) {
+                if (op.symmetric) {
+                    op.cg.preconditioner().type = preconditioner;
+                    op.cg.preconditioner().prolongations = &fem_ctx->prolongations;
+                    op.cg.compute(op.A);
+                } else {
+                    op.bicgstab.compute(op.A);
+                }
+            }
+        }
+
+        op.key = key;
+        op.valid = true;
+    }
+
+    return op;
+}
+
+/**
+ * Multiplies a vector of unknowns by a linear combination of the FEM matrices,
+ * using either the assembled matrices or the matrix-free operator.
+ * 
+ * @param coefficients The coefficients on each of the FEM matrices
+ * @param x The vector to multiply
+ */
+Eigen::VectorXf CPUSolver::multiply(OperatorCoefficients coefficients, const Eigen::VectorXf& x) {
+    if (fem_ctx->matrix_free)
+        return fem_ctx->apply_operator(coefficients, x);
+
+    Eigen::VectorXf y = Eigen::VectorXf::Zero(x.size());
+    if (coefficients.mass != 0.0f)
+        y += coefficients.mass * (fem_ctx->mass_matrix * x);
+    if (coefficients.stiffness != 0.0f)
+        y += coefficients.stiffness * (fem_ctx->stiffness_matrix * x);
+    if (coefficients.advection != 0.0f)
+        y -= coefficients.advection * (fem_ctx->advection_matrix * x);
+    return y;
+}
+
+/**
+ * Solve the linear system Ax = b for x using the solver state of a cached operator.
+ * Iterative solvers start from an initial guess, which should be the solution from the previous time step
+ * since the solution changes very little between time steps.
+ * 
+ * @param op The operator holding the system matrix A
+ * @param b The right hand side of the linear system
+ * @param guess The initial guess for x
+ */
+Eigen::VectorXf CPUSolver::solve(CachedOperator& op, const Eigen::VectorXf& b, const Eigen::VectorXf& guess) {
+    ScopedTimer timer("CPUSolver::solve");
+    if (op.key.matrix_free)
+        return op.symmetric ? matrix_free_cg(op, b, guess) : matrix_free_bicgstab(op, b, guess);
+
+    if (op.key.linear_solver == LinearSolver::Direct && op.linear_solver != LinearSolver::Direct)
+        direct_solver_failed = true;
+    switch (op.linear_solver) {
+        case LinearSolver::Direct:
+            return op.symmetric ? Eigen::VectorXf(op.ldlt.solve(b)) : Eigen::VectorXf(op.lu.solve(b));
+        case LinearSolver::Iterative:
+        default: {
+            if (op.symmetric) {
+                Eigen::VectorXf x = op.cg.solveWithGuess(b, guess);
+                iterations += op.cg.iterations();
+                return x;
+            } else {
+                Eigen::VectorXf x = op.bicgstab.solveWithGuess(b, guess);
+                iterations += op.bicgstab.iterations();
+                return x;
+            }
+        }
+    }
+}
+
+/**
+ * Solve a symmetric system with the Jacobi preconditioned conjugate gradient method, applying the
+ * system matrix element by element. Uses the same stopping criterion as Eigen::ConjugateGradient.
+ */
+Eigen::VectorXf CPUSolver::matrix_free_cg(CachedOperator& op, const Eigen::VectorXf& b, const Eigen::VectorXf& guess) {
+    const OperatorCoefficients& A = op.key.coefficients;
+    int max_iterations = 2 * b.size();
+    float threshold = std::max(Eigen::NumTraits<float>::epsilon() * Eigen::NumTraits<float>::epsilon() * b.squaredNorm(), std::numeric_limits<float>::min());
+
+    Eigen::VectorXf x = guess;
+    Eigen::VectorXf r = b - multiply(A, x);
+    if (b.squaredNorm() == 0.0f)
+        return Eigen::VectorXf::Zero(b.size());
+    if (r.squaredNorm() < threshold)
+        return x;
+
+    Eigen::VectorXf p = op.inverse_diagonal.cwiseProduct(r);
+    float r_z = r.dot(p);
+
+    int i = 0;
+    while (i < max_iterations) {
+        Eigen::VectorXf Ap = multiply(A, p);
+        float alpha = r_z / p.dot(Ap);
+        x += alpha * p;
+        r -= alpha * Ap;
+
+        if (r.squaredNorm() < threshold)
+            break;
+
+        Eigen::VectorXf z = op.inverse_diagonal.cwiseProduct(r);
+        float r_z_old = r_z;
+        r_z = r.dot(z);
+        p = z + (r_z / r_z_old) * p;
+        i++;
+    }
+
+    iterations += i;
+    return x;
+}
+
+/**
+ * Solve a nonsymmetric system with Jacobi preconditioned BiCGSTAB, applying the system matrix
+ * element by element. Follows Eigen::BiCGSTAB, including its restart when r_hat becomes orthogonal to r.
+ */
+Eigen::VectorXf CPUSolver::matrix_free_bicgstab(CachedOperator& op, const Eigen::VectorXf& b, const Eigen::VectorXf& guess) {
+    const OperatorCoefficients& A = op.key.coefficients;
+    const float epsilon = Eigen::NumTraits<float>::epsilon();
+    int max_iterations = 2 * b.size();
+
+    if (b.squaredNorm() == 0.0f)
+        return Eigen::VectorXf::Zero(b.size());
+
+    Eigen::VectorXf x = guess;
+    Eigen::VectorXf r = b - multiply(A, x);
+    Eigen::VectorXf r_hat = r;
+    float r_hat_norm = r_hat.squaredNorm();
+    float threshold = epsilon * epsilon * b.squaredNorm();
+
+    float rho = 1.0f, alpha = 1.0f, omega = 1.0f;
+    Eigen::VectorXf v = Eigen::VectorXf::Zero(b.size());
+    Eigen::VectorXf p = Eigen::VectorXf::Zero(b.size());
+
+    int i = 0, restarts = 0;
+    while (r.squaredNorm() > threshold && i < max_iterations) {
+        float rho_old = rho;
+        rho = r_hat.dot(r);
+        if (std::abs(rho) < epsilon * epsilon * r_hat_norm) {
+            // r_hat is too close to orthogonal to r, so restart from the current solution
+            r = b - multiply(A, x);
+            r_hat = r;
+            rho = r_hat_norm = r.squaredNorm();
+            if (restarts++ == 0)
+                i = 0;
+        }
+
+        float beta = (rho / rho_old) * (alpha / omega);
+        p = r + beta * (p - omega * v);
+
+        Eigen::VectorXf y = op.inverse_diagonal.cwiseProduct(p);
+        v = multiply(A, y);
+        alpha = rho / r_hat.dot(v);
+        Eigen::VectorXf s = r - alpha * v;
+
+        Eigen::VectorXf z = op.inverse_diagonal.cwiseProduct(s);
+        Eigen::VectorXf t = multiply(A, z);
+        float t_t = t.squaredNorm();
+        omega = t_t > 0.0f ? t.dot(s) / t_t : 0.0f;
+
+        x += alpha * y + omega * z;
+        r = s - omega * t;
+        i++;
+    }
+
+    iterations += i;
+    return x;
+}
+
+/**
+ * Splits a time step into equal substeps that are no longer than the stable time step of an explicit scheme.
+ * At most max_substeps are taken, in which case each substep is the stable time step and together they cover less than the whole time step.
+ * 
+ * @param time_step The time step to split
+ * @param stable_time_step The longest stable substep
+ * @param substep_length Set to the length of each substep
+ * @return The number of substeps
+ */
+int CPUSolver::plan_substeps(float time_step, float stable_time_step, float& substep_length) {
+    int count = static_cast<int>(std::ceil(time_step / stable_time_step));
+    if (count > max_substeps) {
+        substep_length = stable_time_step;
+        simulated_time_step = max_substeps * stable_time_step;
+        return max_substeps;
+    }
+
+    count = std::max(count, 1);
+    substep_length = time_step / count;
+    return count;
+}
+
+/**
+ * Advance u (and v, if coupled) by one time step with the selected explicit scheme, in as many substeps as stability requires.
+ * The stable substep length of forward Euler is 2 / (spectral radius), and about 2.78 / (spectral radius) for the classical
+ * Runge-Kutta method. A safety factor of 0.9 is applied to both, since advection moves eigenvalues off the real axis.
+ * 
+ * @param time_step The length of the time step
+ * @param spectral_bound An upper bound on the spectral radius of the Jacobian of rate, from FEMContext::explicit_spectral_bound()
+ * @param coupled Whether v is also integrated. If not, rate may leave dv empty
+ * @param rate Computes the time derivatives du and dv at the state (u, v)
+ */
+void CPUSolver::explicit_step(float time_step, float spectral_bound, bool coupled, std::function<void(const Eigen::VectorXf& u, const Eigen::VectorXf& v, Eigen::VectorXf& du, Eigen::VectorXf& dv)> rate) {
+    float stability_limit = time_integrator == TimeIntegrator::Runge_Kutta_4 ? 2.78f : 2.0f;
+    float substep_length;
+    substeps = plan_substeps(time_step, 0.9f * stability_limit / spectral_bound, substep_length);
+
+    Eigen::VectorXf du, dv;
+    for (int step = 0; step < substeps; step++) {
+        float h = substep_length;
+
+        switch (time_integrator) {
+            case TimeIntegrator::Runge_Kutta_4: {
+                Eigen::VectorXf k1_u, k1_v, k2_u, k2_v, k3_u, k3_v, k4_u, k4_v;
+                rate(u, v, k1_u, k1_v);
+                rate(u + (h / 2.0f) * k1_u, coupled ? Eigen::VectorXf(v + (h / 2.0f) * k1_v) : v, k2_u, k2_v);
+                rate(u + (h / 2.0f) * k2_u, coupled ? Eigen::VectorXf(v + (h / 2.0f) * k2_v) : v, k3_u, k3_v);
+                rate(u + h * k3_u, coupled ? Eigen::VectorXf(v + h * k3_v) : v, k4_u, k4_v);
+
+                u += (h / 6.0f) * (k1_u + 2.0f * k2_u + 2.0f * k3_u + k4_u);
+                if (coupled)
+                    v += (h / 6.0f) * (k1_v + 2.0f * k2_v + 2.0f * k3_v + k4_v);
+            } break;
+            case TimeIntegrator::Forward_Euler:
+            default: {
+                rate(u, v, du, dv);
+                u += h * du;
+                if (coupled)
+                    v += h * dv;
+            } break;
+        }
+    }
+}
+
+/**
+ * Returns the modal basis of the current FEM matrices, which is only recomputed when the stiffness or mass matrix
+ * is reassembled or the number of modes changes. Reassembling only the advection matrix keeps the basis.
+ */
+ModalBasis& CPUSolver::get_modal_basis() {
+    std::pair<unsigned int, int> key = {fem_ctx->stiffness_mass_id, num_modes};
+    if (!modal_basis_valid || modal_basis_key != key) {
+        modal_basis.compute(fem_ctx->stiffness_matrix, fem_ctx->mass_matrix, num_modes);
+        modal_basis_key = key;
+        modal_basis_valid = true;
+        modal_basis_converged = modal_basis.converged;
+        modal_basis_residual = modal_basis.max_residual;
+    }
+    return modal_basis;
+}
+
+/**
+ * Returns the coefficients of the variable step BDF2 formula
+ * alpha_0 * y_{n+1} + alpha_1 * y_n + alpha_2 * y_{n-1} = h_n * f(y_{n+1})
+ *
+ * @param ratio The ratio h_n / h_{n-1} of the current time step to the previous one
+ */
+static std::array<float, 3> bdf2_coefficients(float ratio) {
+    return {(1.0f + 2.0f * ratio) / (1.0f + ratio), -(1.0f + ratio), ratio * ratio / (1.0f + ratio)};
+}
+
+/**
+ * Returns the order of accuracy of the selected implicit scheme
+ */
+int CPUSolver::implicit_order() {
+    return time_integrator == TimeIntegrator::Crank_Nicolson || time_integrator == TimeIntegrator::BDF2 ? 2 : 1;
+}
+
+/**
+ * Discards the previous states if they no longer lead up to the current one. This happens when the equation,
+ * time integrator or FEM matrices change, or when the values on the surface are edited between time steps.
+ *
+ * @param last_values The values that the last time step mapped onto the surface
+ * @param surface_values The values currently on the surface
+ */
+void CPUSolver::validate_history(const Eigen::VectorXf& last_values, const Eigen::VectorXf& surface_values) {
+    HistoryKey key = {fem_ctx->equation, time_integrator, fem_ctx->assembly_id};
+    if (!(history_key == key) || last_values.size() != surface_values.size() || last_values != surface_values)
+        history.clear();
+    history_key = key;
+}
+
+/**
+ * Take one step of the selected implicit scheme and record the state it started from.
+ * With adaptive_time_step, the step is retried with a shorter time step while its estimated error exceeds the tolerance,
+ * and the equation's time step is then adjusted towards the longest one that would meet the tolerance.
+ * The time step is only lengthened by factors above 1.2, since each new time step rebuilds the system matrices.
+ *
+ * @param params The parameters of the equation being solved, whose time step is adjusted
+ * @param step Advances u (and v) by a given time step, reading the previous states from history
+ */
+void CPUSolver::implicit_step(EquationParameters& params, std::function<void(float time_step)> step) {
+    int order = implicit_order();
+    bool can_estimate = adaptive_time_step && history.size() >= order;
+    Eigen::VectorXf u_start = u;
+    Eigen::VectorXf v_start = v;
+    float time_step = params.time_step;
+    rejected_steps = 0;
+
+    while (true) {
+        step(time_step);
+        if (!can_estimate)
+            break;
+
+        float error = estimate_error(time_step, u_start, v_start);
+        float factor = std::clamp(0.9f * std::pow(error, -1.0f / (order + 1)), 0.2f, 2.0f);
+        if (error > 1.0f && rejected_steps < max_rejections && time_step > params.min_time_step) {
+            rejected_steps++;
+            u = u_start;
+            v = v_start;
+            time_step = std::max(time_step * factor, params.min_time_step);
+            continue;
+        }
+
+        params.time_step = time_step;
+        if (factor < 1.0f || factor > 1.2f)
+            params.time_step = std::clamp(time_step * factor, params.min_time_step, params.max_time_step);
+        break;
+    }
+
+    simulated_time_step = time_step;
+    history.insert(history.begin(), {u_start, v_start, time_step});
+    if (history.size() > 2)
+        history.pop_back();
+}
+
+/**
+ * Estimates the local error of the step just taken, relative to the tolerance, with Milne's device. The new state is compared
+ * against the polynomial through the current and previous states extrapolated to the end of the step, whose error is
+ * of the same order as the scheme's. The error of the scheme is the part of their difference in proportion to its error constant.
+ *
+ * @param time_step The length of the step
+ * @param u_start The value of u at the start of the step
+ * @param v_start The value of v at the start of the step
+ * @return The largest estimated error of u or v, divided by the tolerance. The step is accepted if this is at most 1
+ */
+float CPUSolver::estimate_error(float time_step, const Eigen::VectorXf& u_start, const Eigen::VectorXf& v_start) {
+    int order = implicit_order();
+
+    // The times of the current and previous states, relative to the start of the step
+    std::vector<float> times = {0.0f};
+    for (int i = 0; i < order; i++)
+        times.push_back(times.back() - history[i].time_step);
+
+    // Lagrange weights of the extrapolation to the end of the step, and its error constant relative to time_step^(order + 1)
+    std::vector<float> weights(order + 1, 1.0f);
+    float extrapolation_constant = 1.0f;
+    for (int i = 0; i <= order; i++) {
+        for (int j = 0; j <= order; j++)
+            if (j != i)
+                weights[i] *= (time_step - times[j]) / (times[i] - times[j]);
+        extrapolation_constant *= (time_step - times[i]) / (time_step * (i + 1));
+    }
+
+    float scheme_constant = 0.5f;
+    if (time_integrator == TimeIntegrator::Crank_Nicolson)
+        scheme_constant = 1.0f / 12.0f;
+    else if (time_integrator == TimeIntegrator::BDF2)
+        scheme_constant = 2.0f / 9.0f;
+    float scale = scheme_constant / (scheme_constant + extrapolation_constant);
+
+    auto relative_error = [&](const Eigen::VectorXf& value, const Eigen::VectorXf& start, bool is_v) {
+        if (value.size() != start.size() || value.size() == 0)
+            return 0.0f;
+        Eigen::VectorXf extrapolated = weights[0] * start;
+        for (int i = 1; i <= order; i++)
+            extrapolated += weights[i] * (is_v ? history[i - 1].v : history[i - 1].u);
+        float size = std::max(1.0f, value.lpNorm<Eigen::Infinity>());
+        return scale * (value - extrapolated).lpNorm<Eigen::Infinity>() / (tolerance * size);
+    };
+
+    return std::max(relative_error(u, u_start, false), relative_error(v, v_start, true));
+}
+
 /**
  * Returns true if numerical instability is detected in the solution vector(s)
  */
@@ -56,13 +472,22 @@ void CPUSolver::clear_values() {
     u.setZero();
     v.resize(fem_ctx->num_unknowns());
     v.setZero();
+    history.clear();
 }
 
 /**
  * Advance time by one time step based on the selected equation in the associated FEMContext
  */
 void CPUSolver::advance_time() {
-    Eigen::ConjugateGradient<Eigen::SparseMatrix<float>, Eigen::Lower|Eigen::Upper> cg;
+    ScopedTimer timer("CPUSolver::advance_time");
+    iterations = 0;
+    substeps = 0;
+    direct_solver_failed = false;
+    simulated_time_step = fem_ctx->parameters[fem_ctx->equation]->time_step;
+    bool is_explicit = time_integrator == TimeIntegrator::Forward_Euler || time_integrator == TimeIntegrator::Runge_Kutta_4;
+    bool is_spectral = time_integrator == TimeIntegrator::Spectral && !fem_ctx->matrix_free;
+    if (is_explicit || (is_spectral && (fem_ctx->equation == Equation::Heat || fem_ctx->equation == Equation::Wave)))
+        history.clear();
 
     switch (fem_ctx->equation) {
         /**
@@ -72,13 +497,51 @@ void CPUSolver::advance_time() {
         case Equation::Heat: {
             auto params = std::static_pointer_cast<HeatParameters>(fem_ctx->parameters[Equation::Heat]);
 
-            u = get_surface_value_vector();
+            Eigen::VectorXf surface_values = get_surface_value_vector();
+            validate_history(u, surface_values);
+            u = surface_values;
+
+            if (is_spectral) {
+                // Each mode decays as exp(-conductivity * lambda * t). The part of u outside the basis lies in higher modes,
+                // which decay at least as fast as the highest mode in the basis, so it is scaled by that mode's decay
+                ModalBasis& basis = get_modal_basis();
+                Eigen::VectorXf coefficients = basis.eigenvectors.transpose() * (fem_ctx->mass_matrix * u);
+                Eigen::VectorXf remainder = u - basis.eigenvectors * coefficients;
 
-            Eigen::SparseMatrix<float> A = (fem_ctx->mass_matrix / params->time_step) + (params->conductivity * fem_ctx->stiffness_matrix);
-            Eigen::VectorXf b = (fem_ctx->mass_matrix / params->time_step) * u;
+                Eigen::VectorXf decay = (-params->conductivity * params->time_step * basis.eigenvalues.cwiseMax(0.0f)).array().exp();
+                u = basis.eigenvectors * decay.cwiseProduct(coefficients) + decay[basis.size() - 1] * remainder;
 
-            cg.compute(A);
-            u = cg.solve(b);
+                map_vector_to_surface(u);
+                break;
+            }
+
+            if (is_explicit) {
+                // M du/dt = -conductivity * K u
+                OperatorCoefficients A = {0.0f, params->conductivity, 0.0f};
+                explicit_step(params->time_step, fem_ctx->explicit_spectral_bound(A), false, [&](const Eigen::VectorXf& u, const Eigen::VectorXf& v, Eigen::VectorXf& du, Eigen::VectorXf& dv) {
+                    du = -multiply(A, u).cwiseQuotient(fem_ctx->lumped_mass);
+                });
+                map_vector_to_surface(u);
+                break;
+            }
+
+            implicit_step(*params, [&](float h) {
+                if (time_integrator == TimeIntegrator::Crank_Nicolson) {
+                    // M (u1 - u0) / h = -conductivity * K (u0 + u1) / 2
+                    CachedOperator& op = get_operator(SystemMatrix::Heat, {1.0f / h, params->conductivity / 2.0f, 0.0f});
+                    Eigen::VectorXf b = multiply({1.0f / h, -params->conductivity / 2.0f, 0.0f}, u);
+                    u = solve(op, b, u);
+                } else if (time_integrator == TimeIntegrator::BDF2 && !history.empty()) {
+                    std::array<float, 3> alpha = bdf2_coefficients(h / history[0].time_step);
+                    CachedOperator& op = get_operator(SystemMatrix::Heat, {alpha[0] / h, params->conductivity, 0.0f});
+                    Eigen::VectorXf b = -multiply({1.0f / h, 0.0f, 0.0f}, alpha[1] * u + alpha[2] * history[0].u);
+                    u = solve(op, b, u);
+                } else {
+                    CachedOperator& op = get_operator(SystemMatrix::Heat, {1.0f / h, params->conductivity, 0.0f});
+                    Eigen::VectorXf b = multiply({1.0f / h, 0.0f, 0.0f}, u);
+                    u = solve(op, b, u);
+                }
+            });
 
             map_vector_to_surface(u);
         } break;
@@ -90,13 +553,36 @@ void CPUSolver::advance_time() {
         case Equation::Advection_Diffusion: {
             auto params = std::static_pointer_cast<AdvectionDiffusionParameters>(fem_ctx->parameters[Equation::Advection_Diffusion]);
 
-            u = get_surface_value_vector();
+            Eigen::VectorXf surface_values = get_surface_value_vector();
+            validate_history(u, surface_values);
+            u = surface_values;
 
-            Eigen::SparseMatrix<float> A = (fem_ctx->mass_matrix / params->time_step) + (params->c * fem_ctx->stiffness_matrix) - fem_ctx->advection_matrix;
-            Eigen::VectorXf b = (fem_ctx->mass_matrix / params->time_step) * u;
+            if (is_explicit) {
+                // M du/dt = -(c * K - (advection matrix)) u
+                OperatorCoefficients A = {0.0f, params->c, 1.0f};
+                explicit_step(params->time_step, fem_ctx->explicit_spectral_bound(A), false, [&](const Eigen::VectorXf& u, const Eigen::VectorXf& v, Eigen::VectorXf& du, Eigen::VectorXf& dv) {
+                    du = -multiply(A, u).cwiseQuotient(fem_ctx->lumped_mass);
+                });
+                map_vector_to_surface(u);
+                break;
+            }
 
-            cg.compute(A);
-            u = cg.solve(b);
+            implicit_step(*params, [&](float h) {
+                if (time_integrator == TimeIntegrator::Crank_Nicolson) {
+                    CachedOperator& op = get_operator(SystemMatrix::Advection_Diffusion, {1.0f / h, params->c / 2.0f, 0.5f});
+                    Eigen::VectorXf b = multiply({1.0f / h, -params->c / 2.0f, -0.5f}, u);
+                    u = solve(op, b, u);
+                } else if (time_integrator == TimeIntegrator::BDF2 && !history.empty()) {
+                    std::array<float, 3> alpha = bdf2_coefficients(h / history[0].time_step);
+                    CachedOperator& op = get_operator(SystemMatrix::Advection_Diffusion, {alpha[0] / h, params->c, 1.0f});
+                    Eigen::VectorXf b = -multiply({1.0f / h, 0.0f, 0.0f}, alpha[1] * u + alpha[2] * history[0].u);
+                    u = solve(op, b, u);
+                } else {
+                    CachedOperator& op = get_operator(SystemMatrix::Advection_Diffusion, {1.0f / h, params->c, 1.0f});
+                    Eigen::VectorXf b = multiply({1.0f / h, 0.0f, 0.0f}, u);
+                    u = solve(op, b, u);
+                }
+            });
 
             map_vector_to_surface(u);
         } break;
@@ -108,14 +594,66 @@ void CPUSolver::advance_time() {
         case Equation::Wave: {
             auto params = std::static_pointer_cast<WaveParameters>(fem_ctx->parameters[Equation::Wave]);
 
-            u = get_surface_value_vector();
+            Eigen::VectorXf surface_values = get_surface_value_vector();
+            validate_history(u, surface_values);
+            u = surface_values;
+
+            if (is_spectral) {
+                // Each mode oscillates with angular frequency omega = c * sqrt(lambda), and is rotated exactly through the time step.
+                // Only the part of u and v inside the basis is kept
+                ModalBasis& basis = get_modal_basis();
+                Eigen::ArrayXf a = basis.eigenvectors.transpose() * (fem_ctx->mass_matrix * u);
+                Eigen::ArrayXf b = basis.eigenvectors.transpose() * (fem_ctx->mass_matrix * v);
+
+                Eigen::ArrayXf omega = params->c * basis.eigenvalues.cwiseMax(0.0f).array().sqrt();
+                Eigen::ArrayXf cosine = (omega * params->time_step).cos();
+                Eigen::ArrayXf sine = (omega * params->time_step).sin();
+                Eigen::ArrayXf sine_over_omega = (omega > 0.0f).select(sine / omega, params->time_step);
 
-            Eigen::SparseMatrix<float> A_v = (fem_ctx->mass_matrix / params->time_step) + (params->c * params->c * fem_ctx->stiffness_matrix * params->time_step);
-            Eigen::VectorXf b_v = (fem_ctx->mass_matrix / params->time_step) * v - params->c * params->c * fem_ctx->stiffness_matrix * u;
+                u = basis.eigenvectors * (a * cosine + b * sine_over_omega).matrix();
+                v = basis.eigenvectors * (b * cosine - a * omega * sine).matrix();
 
-            cg.compute(A_v);
-            v = cg.solve(b_v);
-            u = u + v * params->time_step;
+                map_vector_to_surface(u);
+                break;
+            }
+
+            if (is_explicit) {
+                // Leapfrog: M dv/dt = -c^2 * K u, then du/dt = v. Stable while time_step^2 * (spectral radius) <= 4
+                OperatorCoefficients A = {0.0f, params->c * params->c, 0.0f};
+                float substep_length;
+                substeps = plan_substeps(params->time_step, 0.9f * 2.0f / std::sqrt(fem_ctx->explicit_spectral_bound(A)), substep_length);
+                for (int step = 0; step < substeps; step++) {
+                    v -= substep_length * multiply(A, u).cwiseQuotient(fem_ctx->lumped_mass);
+                    u += substep_length * v;
+                }
+                map_vector_to_surface(u);
+                break;
+            }
+
+            float c2 = params->c * params->c;
+            implicit_step(*params, [&](float h) {
+                if (time_integrator == TimeIntegrator::Crank_Nicolson) {
+                    // M (v1 - v0) / h = -c^2 * K (u0 + u1) / 2, and u1 = u0 + h * (v0 + v1) / 2, which conserves energy
+                    CachedOperator& op_v = get_operator(SystemMatrix::Wave, {1.0f / h, c2 * h / 4.0f, 0.0f});
+                    Eigen::VectorXf b_v = multiply({1.0f / h, -c2 * h / 4.0f, 0.0f}, v) - multiply({0.0f, c2, 0.0f}, u);
+                    Eigen::VectorXf v_start = v;
+                    v = solve(op_v, b_v, v);
+                    u = u + (v_start + v) * (h / 2.0f);
+                } else if (time_integrator == TimeIntegrator::BDF2 && !history.empty()) {
+                    // BDF2 on both u and v, with u1 = (h * v1 - alpha_1 * u0 - alpha_2 * u_prev) / alpha_0 substituted into the equation for v
+                    std::array<float, 3> alpha = bdf2_coefficients(h / history[0].time_step);
+                    Eigen::VectorXf u_history = alpha[1] * u + alpha[2] * history[0].u;
+                    CachedOperator& op_v = get_operator(SystemMatrix::Wave, {alpha[0] / h, c2 * h / alpha[0], 0.0f});
+                    Eigen::VectorXf b_v = -multiply({1.0f / h, 0.0f, 0.0f}, alpha[1] * v + alpha[2] * history[0].v) + multiply({0.0f, c2 / alpha[0], 0.0f}, u_history);
+                    v = solve(op_v, b_v, v);
+                    u = (h * v - u_history) / alpha[0];
+                } else {
+                    CachedOperator& op_v = get_operator(SystemMatrix::Wave, {1.0f / h, c2 * h, 0.0f});
+                    Eigen::VectorXf b_v = multiply({1.0f / h, 0.0f, 0.0f}, v) - multiply({0.0f, c2, 0.0f}, u);
+                    v = solve(op_v, b_v, v);
+                    u = u + v * h;
+                }
+            });
 
             map_vector_to_surface(u);
         } break;
@@ -127,19 +665,71 @@ void CPUSolver::advance_time() {
         case Equation::Reaction_Diffusion: {
             auto params = std::static_pointer_cast<ReactionDiffusionParameters>(fem_ctx->parameters[Equation::Reaction_Diffusion]);
 
-            v = get_surface_value_vector();
+            Eigen::VectorXf surface_values = get_surface_value_vector();
+            if (!is_explicit)
+                validate_history(v, surface_values);
+            v = surface_values;
+
+            if (is_explicit) {
+                // M du/dt = -Du * K u - u * v^2 + f * (1 - u), and M dv/dt = -Dv * K v + u * v^2 - (f + k) * v
+                // With u and v in [0, 1], the rows of the Jacobian of the reaction terms sum to at most 3 + f + k in absolute value
+                float reaction_rate = 3.0f + params->feed_rate + params->kill_rate;
+                float spectral_bound = fem_ctx->explicit_spectral_bound({0.0f, std::max(params->Du, params->Dv), 0.0f}, reaction_rate);
+                explicit_step(params->time_step, spectral_bound, true, [&](const Eigen::VectorXf& u, const Eigen::VectorXf& v, Eigen::VectorXf& du, Eigen::VectorXf& dv) {
+                    Eigen::VectorXf reaction = u.cwiseProduct(v.cwiseProduct(v));
+                    du = (-multiply({0.0f, params->Du, 0.0f}, u) - reaction + params->feed_rate * (Eigen::VectorXf::Ones(u.size()) - u)).cwiseQuotient(fem_ctx->lumped_mass);
+                    dv = (-multiply({0.0f, params->Dv, 0.0f}, v) + reaction - (params->feed_rate + params->kill_rate) * v).cwiseQuotient(fem_ctx->lumped_mass);
+                });
+                map_vector_to_surface(v);
+                break;
+            }
 
-            // Setup for a semi-implicit time stepping scheme
-            Eigen::SparseMatrix<float> A_u = fem_ctx->mass_matrix / params->time_step + params->Du * fem_ctx->stiffness_matrix;
-            Eigen::VectorXf b_u = (fem_ctx->mass_matrix / params->time_step) * u - (u.cwiseProduct(v.cwiseProduct(v))) + params->feed_rate * (Eigen::VectorXf::Ones(fem_ctx->num_unknowns()) - u);
+            // Semi-implicit time stepping, with implicit diffusion and explicit reaction terms
+            auto reaction_u = [&](const Eigen::VectorXf& u, const Eigen::VectorXf& v) -> Eigen::VectorXf {
+                return -(u.cwiseProduct(v.cwiseProduct(v))) + params->feed_rate * (Eigen::VectorXf::Ones(u.size()) - u);
+            };
+            auto reaction_v = [&](const Eigen::VectorXf& u, const Eigen::VectorXf& v) -> Eigen::VectorXf {
+                return u.cwiseProduct(v.cwiseProduct(v)) - (params->feed_rate + params->kill_rate) * v;
+            };
 
-            Eigen::SparseMatrix<float> A_v = fem_ctx->mass_matrix / params->time_step + params->Dv * fem_ctx->stiffness_matrix;
-            Eigen::VectorXf b_v = (fem_ctx->mass_matrix / params->time_step) * v + (u.cwiseProduct(v.cwiseProduct(v))) - (params->feed_rate + params->kill_rate) * v;
+            implicit_step(*params, [&](float h) {
+                Eigen::VectorXf r_u = reaction_u(u, v);
+                Eigen::VectorXf r_v = reaction_v(u, v);
 
-            cg.compute(A_u);
-            u = cg.solve(b_u);
-            cg.compute(A_v);
-            v = cg.solve(b_v);
+                if (time_integrator == TimeIntegrator::Crank_Nicolson) {
+                    // Crank-Nicolson diffusion, with the reaction terms extrapolated to the middle of the step by Adams-Bashforth
+                    if (!history.empty()) {
+                        float ratio = h / history[0].time_step;
+                        r_u = (1.0f + ratio / 2.0f) * r_u - (ratio / 2.0f) * reaction_u(history[0].u, history[0].v);
+                        r_v = (1.0f + ratio / 2.0f) * r_v - (ratio / 2.0f) * reaction_v(history[0].u, history[0].v);
+                    }
+                    CachedOperator& op_u = get_operator(SystemMatrix::Reaction_Diffusion_U, {1.0f / h, params->Du / 2.0f, 0.0f});
+                    CachedOperator& op_v = get_operator(SystemMatrix::Reaction_Diffusion_V, {1.0f / h, params->Dv / 2.0f, 0.0f});
+                    Eigen::VectorXf b_u = multiply({1.0f / h, -params->Du / 2.0f, 0.0f}, u) + r_u;
+                    Eigen::VectorXf b_v = multiply({1.0f / h, -params->Dv / 2.0f, 0.0f}, v) + r_v;
+                    u = solve(op_u, b_u, u);
+                    v = solve(op_v, b_v, v);
+                } else if (time_integrator == TimeIntegrator::BDF2 && !history.empty()) {
+                    // BDF2 diffusion, with the reaction terms extrapolated to the end of the step
+                    float ratio = h / history[0].time_step;
+                    std::array<float, 3> alpha = bdf2_coefficients(ratio);
+                    r_u = (1.0f + ratio) * r_u - ratio * reaction_u(history[0].u, history[0].v);
+                    r_v = (1.0f + ratio) * r_v - ratio * reaction_v(history[0].u, history[0].v);
+                    CachedOperator& op_u = get_operator(SystemMatrix::Reaction_Diffusion_U, {alpha[0] / h, params->Du, 0.0f});
+                    CachedOperator& op_v = get_operator(SystemMatrix::Reaction_Diffusion_V, {alpha[0] / h, params->Dv, 0.0f});
+                    Eigen::VectorXf b_u = -multiply({1.0f / h, 0.0f, 0.0f}, alpha[1] * u + alpha[2] * history[0].u) + r_u;
+                    Eigen::VectorXf b_v = -multiply({1.0f / h, 0.0f, 0.0f}, alpha[1] * v + alpha[2] * history[0].v) + r_v;
+                    u = solve(op_u, b_u, u);
+                    v = solve(op_v, b_v, v);
+                } else {
+                    CachedOperator& op_u = get_operator(SystemMatrix::Reaction_Diffusion_U, {1.0f / h, params->Du, 0.0f});
+                    CachedOperator& op_v = get_operator(SystemMatrix::Reaction_Diffusion_V, {1.0f / h, params->Dv, 0.0f});
+                    Eigen::VectorXf b_u = multiply({1.0f / h, 0.0f, 0.0f}, u) + r_u;
+                    Eigen::VectorXf b_v = multiply({1.0f / h, 0.0f, 0.0f}, v) + r_v;
+                    u = solve(op_u, b_u, u);
+                    v = solve(op_v, b_v, v);
+                }
+            });
 
             map_vector_to_surface(v);
         } break;
@@ -1,9 +1,26 @@
 #include <Eigen/Dense>
 
 #include "FEM/FEMContext.hpp"
+#include "Utils/Parallel.hpp"
+#include "Utils/Profiler.hpp"
 
 #include <iostream>
 
+/**
+ * Resizes every array in the cache to hold num_elements elements
+ */
+void ElementGeometryCache::resize(int num_elements) {
+    areas.resize(num_elements);
+    for (int d = 0; d < 3; d++)
+        normals[d].resize(num_elements);
+    for (int i = 0; i < 3; i++) {
+        velocities[i].resize(num_elements);
+        interior[i].resize(num_elements);
+        for (int d = 0; d < 3; d++)
+            gradients[i][d].resize(num_elements);
+    }
+}
+
 /**
  * Creates a FEMContext
  */
@@ -16,12 +33,14 @@ FEMContext::FEMContext() {
 
 /**
  * Initializes this FEMContext using a new surface.
- * This results in a reassembly of all of the FEM matrices.
+ * This results in a recomputation of the element geometry and a reassembly of all of the FEM matrices.
  */
 void FEMContext::init_from_surface(std::shared_ptr<Surface> surface) {
+    ScopedTimer timer("FEMContext::init_from_surface");
     if (surface->initialized) {
         this->surface = surface;
         num_elements = surface->triangles.size();
+        update_geometry_cache();
         update_boundary_conditions();
     }
 }
@@ -52,153 +71,498 @@ unsigned int FEMContext::num_max_nonzeros_per_row() {
 }
 
 /**
- * Assemble all the matrices (stiffness, mass, and advection)
+ * Returns the bandwidth of the FEM matrices, the largest distance between the indices of two unknowns that share an element
  */
-void FEMContext::assemble_matrices() {
-    Eigen::Vector3f velocity = std::static_pointer_cast<AdvectionDiffusionParameters>(parameters[Equation::Advection_Diffusion])->velocity;
-
-    assemble_stiffness_matrix();
-    assemble_mass_matrix();
-    assemble_advection_matrix(velocity);
-    this->max_row_nonzeros = compute_max_row_nonzeros();
+unsigned int FEMContext::matrix_bandwidth() {
+    return this->bandwidth;
 }
 
 /**
- * Assemble the stiffness matrix.
- * This matrix comprises integrals of ∇(phi_i) dot ∇(phi_j) over the problem domain, where phi is a linear basis function.
+ * Assemble all the matrices (stiffness, mass, and advection) from the element geometry cache.
+ * Only the values are overwritten, the sparsity pattern is left as built by build_sparsity_pattern().
+ * In matrix-free mode there are no matrices, so only the advection velocities, the lumped mass, and the row sums are updated.
+ * 
+ * The stiffness matrix comprises integrals of ∇(phi_i) dot ∇(phi_j), and the mass matrix comprises integrals of phi_i * phi_j,
+ * where phi is a linear basis function. When lump_mass is set, each row of the mass matrix is summed onto its diagonal.
  */
-void FEMContext::assemble_stiffness_matrix() {
-    std::vector<Eigen::Triplet<float>> matrix_entries;
-    for (int k = 0; k < num_elements; k++) {
-        glm::vec3 a = surface->vertices[surface->triangles[k][0]];
-        glm::vec3 b = surface->vertices[surface->triangles[k][1]];
-        glm::vec3 c = surface->vertices[surface->triangles[k][2]];
-        glm::vec3 normal = glm::normalize(glm::cross(b - a, c - a));
-        float area = 0.5f * glm::length(glm::cross(b - a, c - a));
+void FEMContext::assemble_matrices() {
+    ScopedTimer timer("FEMContext::assemble_matrices");
+    update_advection_velocities();
+    this->stiffness_mass_id++;
 
-        std::array reference_gradients = {
-            Eigen::Vector3f {-1.0, -1.0, 0.0},
-            Eigen::Vector3f {1.0, 0.0, 0.0},
-            Eigen::Vector3f {0.0, 1.0, 0.0},
-        };
+    std::vector<float> corner_stiffness_sums(3 * num_elements), corner_advection_sums(3 * num_elements);
+    if (matrix_free) {
+        parallel_for(num_elements, 4096, [&](int begin, int end) {
+            compute_corner_row_sums(begin, end, corner_stiffness_sums.data(), corner_advection_sums.data());
+        });
+        gather_row_sums(corner_stiffness_sums.data(), corner_advection_sums.data());
+        this->assembly_id++;
+        return;
+    }
 
-        Eigen::Matrix<float, 3, 3> A {
-            {b.x - a.x, c.x - a.x, normal.x},
-            {b.y - a.y, c.y - a.y, normal.y},
-            {b.z - a.z, c.z - a.z, normal.z}
-        };
-        A = A.inverse().eval();
-        A.transposeInPlace();
+    std::vector<float> stiffness_slots(9 * num_elements), mass_slots(9 * num_elements);
+    advection_slots.resize(9 * num_elements);
 
-        std::array<Eigen::Vector3f, 3> physical_gradients;
-        for (int i = 0; i < 3; i++)
-            physical_gradients[i] = A * reference_gradients[i];
+    parallel_for(num_elements, 4096, [&](int begin, int end) {
+        const float* area = geometry.areas.data();
 
         for (int i = 0; i < 3; i++) {
             for (int j = 0; j < 3; j++) {
-                if (static_cast<BoundaryCondition>(boundary_condition) == BoundaryCondition::Neumann || !surface->on_boundary[surface->triangles[k][i]] && !surface->on_boundary[surface->triangles[k][j]]) {
-                    matrix_entries.push_back(Eigen::Triplet<float>(
-                        idx_map[surface->triangles[k][i]],
-                        idx_map[surface->triangles[k][j]], 
-                        area * physical_gradients[i].dot(physical_gradients[j])
-                    ));
+                float* stiffness = &stiffness_slots[(3 * i + j) * num_elements];
+                float* mass = &mass_slots[(3 * i + j) * num_elements];
+                const float* grad_i[3] = {geometry.gradients[i][0].data(), geometry.gradients[i][1].data(), geometry.gradients[i][2].data()};
+                const float* grad_j[3] = {geometry.gradients[j][0].data(), geometry.gradients[j][1].data(), geometry.gradients[j][2].data()};
+                float mass_factor = lump_mass ? (i == j ? 1.0f / 3.0f : 0.0f) : (i == j ? 1.0f / 6.0f : 1.0f / 12.0f);
+
+                for (int k = begin; k < end; k++) {
+                    stiffness[k] = area[k] * (grad_i[0][k] * grad_j[0][k] + grad_i[1][k] * grad_j[1][k] + grad_i[2][k] * grad_j[2][k]);
+                    mass[k] = mass_factor * area[k];
                 }
             }
         }
+
+        compute_advection_slots(begin, end);
+        compute_corner_row_sums(begin, end, corner_stiffness_sums.data(), corner_advection_sums.data());
+    });
+
+    gather_slots(stiffness_matrix, stiffness_slots);
+    gather_slots(mass_matrix, mass_slots);
+    gather_slots(advection_matrix, advection_slots);
+    gather_row_sums(corner_stiffness_sums.data(), corner_advection_sums.data());
+    this->assembly_id++;
+}
+
+/**
+ * Reassemble only the advection matrix, such as after the velocity changes.
+ * The stiffness and mass matrices do not depend on the velocity, so they are left untouched, along with the lumped mass and the stiffness row sums.
+ */
+void FEMContext::assemble_advection_matrix() {
+    ScopedTimer timer("FEMContext::assemble_advection_matrix");
+    update_advection_velocities();
+
+    std::vector<float> corner_advection_sums(3 * num_elements);
+    if (matrix_free) {
+        parallel_for(num_elements, 4096, [&](int begin, int end) {
+            compute_corner_row_sums(begin, end, nullptr, corner_advection_sums.data());
+        });
+        gather_row_sums(nullptr, corner_advection_sums.data());
+        this->assembly_id++;
+        return;
     }
 
-    stiffness_matrix.resize(num_unknowns(), num_unknowns());
-    stiffness_matrix.setFromTriplets(matrix_entries.begin(), matrix_entries.end());
-    stiffness_matrix.makeCompressed();
+    advection_slots.resize(9 * num_elements);
+    parallel_for(num_elements, 4096, [&](int begin, int end) {
+        compute_advection_slots(begin, end);
+        compute_corner_row_sums(begin, end, nullptr, corner_advection_sums.data());
+    });
+
+    gather_slots(advection_matrix, advection_slots);
+    gather_row_sums(nullptr, corner_advection_sums.data());
+    this->assembly_id++;
 }
 
 /**
- * Assemble the mass matrix.
- * This matrix comprises integrals of phi_i * phi_j over the problem domain, where phi is a linear basis function.
+ * Projects the advection velocity onto the plane of every element and normalizes it
  */
-void FEMContext::assemble_mass_matrix() {
-    std::vector<Eigen::Triplet<float>> matrix_entries;
-    for (int k = 0; k < num_elements; k++) {
-        glm::vec3 a = surface->vertices[surface->triangles[k][0]];
-        glm::vec3 b = surface->vertices[surface->triangles[k][1]];
-        glm::vec3 c = surface->vertices[surface->triangles[k][2]];
-
-        float jacobian_determinant = Eigen::Vector3<float>(b.x - a.x, b.y - a.y, b.z - a.z).cross(Eigen::Vector3<float>(c.x - a.x, c.y - a.y, c.z - a.z)).norm();
-        Eigen::Matrix<float, 3, 3> local_mass_matrix {
-            {2, 1, 1},
-            {1, 2, 1},
-            {1, 1, 2}
-        };
-        local_mass_matrix = (jacobian_determinant / 24.0) * local_mass_matrix;
+void FEMContext::update_advection_velocities() {
+    Eigen::Vector3f velocity = std::static_pointer_cast<AdvectionDiffusionParameters>(parameters[Equation::Advection_Diffusion])->velocity;
+
+    parallel_for(num_elements, 4096, [&](int begin, int end) {
+        const float* normal[3] = {geometry.normals[0].data(), geometry.normals[1].data(), geometry.normals[2].data()};
+
+        for (int k = begin; k < end; k++) {
+            float normal_component = velocity.x() * normal[0][k] + velocity.y() * normal[1][k] + velocity.z() * normal[2][k];
+            float x = velocity.x() - normal_component * normal[0][k];
+            float y = velocity.y() - normal_component * normal[1][k];
+            float z = velocity.z() - normal_component * normal[2][k];
+            // A velocity normal to the element has no direction along it, so it is left at zero like Eigen's normalized()
+            float squared_length = x * x + y * y + z * z;
+            float inverse_length = squared_length > 1e-12f ? 1.0f / std::sqrt(squared_length) : 0.0f;
+
+            geometry.velocities[0][k] = x * inverse_length;
+            geometry.velocities[1][k] = y * inverse_length;
+            geometry.velocities[2][k] = z * inverse_length;
+        }
+    });
+}
+
+/**
+ * Computes the advection matrix slots of the elements in [begin, end).
+ * This matrix comprises integrals of phi_i * (velocity dot ∇(phi_j)), where phi is a linear basis function
+ * and the velocity is projected onto the plane of each element and normalized.
+ * The advection matrix never couples boundary nodes, so those slots are zeroed.
+ */
+void FEMContext::compute_advection_slots(int begin, int end) {
+    const float* area = geometry.areas.data();
+    const float* velocity[3] = {geometry.velocities[0].data(), geometry.velocities[1].data(), geometry.velocities[2].data()};
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            float* advection = &advection_slots[(3 * i + j) * num_elements];
+            const float* interior_i = geometry.interior[i].data();
+            const float* interior_j = geometry.interior[j].data();
+            const float* grad_j[3] = {geometry.gradients[j][0].data(), geometry.gradients[j][1].data(), geometry.gradients[j][2].data()};
 
+            for (int k = begin; k < end; k++) {
+                float velocity_dot_gradient = velocity[0][k] * grad_j[0][k] + velocity[1][k] * grad_j[1][k] + velocity[2][k] * grad_j[2][k];
+                advection[k] = interior_i[k] * interior_j[k] * (area[k] / 3.0f) * velocity_dot_gradient;
+            }
+        }
+    }
+}
+
+/**
+ * Computes, for every corner (3 * k + i) of the elements in [begin, end), the sum of the absolute values of its row
+ * of the element's local stiffness and advection matrices, over the columns that are unknowns.
+ * 
+ * @param stiffness_sums The stiffness sum of every corner, or nullptr to skip them when only the velocity has changed
+ * @param advection_sums The advection sum of every corner
+ */
+void FEMContext::compute_corner_row_sums(int begin, int end, float* stiffness_sums, float* advection_sums) {
+    const float* area = geometry.areas.data();
+    const float* velocity[3] = {geometry.velocities[0].data(), geometry.velocities[1].data(), geometry.velocities[2].data()};
+
+    for (int k = begin; k < end; k++) {
         for (int i = 0; i < 3; i++) {
+            float stiffness_sum = 0.0f, advection_sum = 0.0f;
             for (int j = 0; j < 3; j++) {
-                if (static_cast<BoundaryCondition>(boundary_condition) == BoundaryCondition::Neumann || !surface->on_boundary[surface->triangles[k][i]] && !surface->on_boundary[surface->triangles[k][j]]) {
-                    matrix_entries.push_back(Eigen::Triplet<float>(
-                        idx_map[surface->triangles[k][i]],
-                        idx_map[surface->triangles[k][j]], 
-                        local_mass_matrix(i, j)
-                    ));
-                }
+                if (element_unknowns[j][k] == -1) continue;
+                const std::array<std::vector<float>, 3>& grad_i = geometry.gradients[i];
+                const std::array<std::vector<float>, 3>& grad_j = geometry.gradients[j];
+                float velocity_dot_gradient = velocity[0][k] * grad_j[0][k] + velocity[1][k] * grad_j[1][k] + velocity[2][k] * grad_j[2][k];
+
+                stiffness_sum += std::abs(area[k] * (grad_i[0][k] * grad_j[0][k] + grad_i[1][k] * grad_j[1][k] + grad_i[2][k] * grad_j[2][k]));
+                advection_sum += std::abs(geometry.interior[i][k] * geometry.interior[j][k] * (area[k] / 3.0f) * velocity_dot_gradient);
             }
+            if (stiffness_sums)
+                stiffness_sums[3 * k + i] = stiffness_sum;
+            advection_sums[3 * k + i] = advection_sum;
         }
     }
+}
+
+/**
+ * Gathers the corner sums from compute_corner_row_sums() into the row sums used by explicit_spectral_bound(), in parallel over the unknowns.
+ * Along with the stiffness row sums, this computes the lumped mass of every unknown: each element adds area / 3 to the lumped mass
+ * of its corners, which is the sum of its row of the consistent mass matrix.
+ * 
+ * @param corner_stiffness_sums The stiffness sum of every corner, or nullptr to keep the lumped mass and the stiffness row sums
+ * @param corner_advection_sums The advection sum of every corner
+ */
+void FEMContext::gather_row_sums(const float* corner_stiffness_sums, const float* corner_advection_sums) {
+    int n = num_unknowns();
+    if (corner_stiffness_sums) {
+        lumped_mass.resize(n);
+        stiffness_row_sums.resize(n);
+    }
+    advection_row_sums.resize(n);
 
-    mass_matrix = Eigen::SparseMatrix<float>(num_unknowns(), num_unknowns());
-    mass_matrix.setFromTriplets(matrix_entries.begin(), matrix_entries.end());
-    mass_matrix.makeCompressed();
+    parallel_for(n, 4096, [&](int begin, int end) {
+        for (int row = begin; row < end; row++) {
+            float mass_row = 0.0f, stiffness_row = 0.0f, advection_row = 0.0f;
+            for (int idx = node_element_offsets[row]; idx < node_element_offsets[row + 1]; idx++) {
+                int corner = node_elements[idx];
+                if (corner_stiffness_sums) {
+                    mass_row += geometry.areas[corner / 3] / 3.0f;
+                    stiffness_row += corner_stiffness_sums[corner];
+                }
+                advection_row += corner_advection_sums[corner];
+            }
+            if (corner_stiffness_sums) {
+                lumped_mass[row] = mass_row;
+                stiffness_row_sums[row] = stiffness_row;
+            }
+            advection_row_sums[row] = advection_row;
+        }
+    });
 }
 
 /**
- * Assemble the advection matrix.
- * This matrix comprises integrals of phi_i * (velocity dot ∇(phi_i)) over the problem domain, where phi is a linear basis function.
+ * Returns an upper bound on the spectral radius of inverse(lumped M) * (coefficients.stiffness * K - coefficients.advection * (advection matrix)),
+ * from the Gershgorin circle theorem. Explicit time integration is stable for time steps below a constant over this bound,
+ * so it shrinks with the square of the element size. The mass coefficient is ignored.
+ * 
+ * @param coefficients The coefficients on each of the FEM matrices
+ * @param reaction_rate A bound on the sum of the absolute values of each row of the Jacobian of any reaction terms
  */
-void FEMContext::assemble_advection_matrix(Eigen::Vector3f velocity) {
-    std::vector<Eigen::Triplet<float>> matrix_entries;
-    for (int k = 0; k < num_elements; k++) {
-        glm::vec3 a = surface->vertices[surface->triangles[k][0]];
-        glm::vec3 b = surface->vertices[surface->triangles[k][1]];
-        glm::vec3 c = surface->vertices[surface->triangles[k][2]];
-        glm::vec3 normal = glm::normalize(glm::cross(b - a, c - a));
-        float jacobian_determinant = Eigen::Vector3<float>(b.x - a.x, b.y - a.y, b.z - a.z).cross(Eigen::Vector3<float>(c.x - a.x, c.y - a.y, c.z - a.z)).norm();
+float FEMContext::explicit_spectral_bound(const OperatorCoefficients& coefficients, float reaction_rate) {
+    float bound = 0.0f;
+    for (int row = 0; row < lumped_mass.size(); row++) {
+        float row_sum = std::abs(coefficients.stiffness) * stiffness_row_sums[row] + std::abs(coefficients.advection) * advection_row_sums[row] + reaction_rate;
+        bound = std::max(bound, row_sum / lumped_mass[row]);
+    }
+    return bound;
+}
 
+/**
+ * Recomputes the element geometry cache from the surface.
+ * This only needs to happen when the mesh changes.
+ */
+void FEMContext::update_geometry_cache() {
+    geometry.resize(num_elements);
+
+    parallel_for(num_elements, 4096, [&](int begin, int end) {
         std::array<Eigen::Vector3f, 3> reference_gradients = {
             Eigen::Vector3f {-1.0, -1.0, 0.0},
             Eigen::Vector3f {1.0, 0.0, 0.0},
             Eigen::Vector3f {0.0, 1.0, 0.0},
         };
 
-        Eigen::Matrix<float, 3, 3> A {
-            {b.x - a.x, c.x - a.x, normal.x},
-            {b.y - a.y, c.y - a.y, normal.y},
-            {b.z - a.z, c.z - a.z, normal.z}
-        };
-        A = A.inverse().eval();
-        A.transposeInPlace();
+        for (int k = begin; k < end; k++) {
+            glm::vec3 a = surface->vertices[surface->triangles[k][0]];
+            glm::vec3 b = surface->vertices[surface->triangles[k][1]];
+            glm::vec3 c = surface->vertices[surface->triangles[k][2]];
+            glm::vec3 normal = glm::normalize(glm::cross(b - a, c - a));
 
-        Eigen::Vector3f plane_normal = {normal.x, normal.y, normal.z};
-        Eigen::Vector3f transformed_velocity = (velocity - velocity.dot(plane_normal) / (plane_normal.norm() * plane_normal.norm()) * plane_normal).normalized();
+            Eigen::Matrix<float, 3, 3> A {
+                {b.x - a.x, c.x - a.x, normal.x},
+                {b.y - a.y, c.y - a.y, normal.y},
+                {b.z - a.z, c.z - a.z, normal.z}
+            };
+            A = A.inverse().eval();
+            A.transposeInPlace();
 
-        std::array<Eigen::Vector3f, 3> physical_gradients;
+            geometry.areas[k] = 0.5f * glm::length(glm::cross(b - a, c - a));
+            for (int d = 0; d < 3; d++)
+                geometry.normals[d][k] = normal[d];
+            for (int i = 0; i < 3; i++) {
+                Eigen::Vector3f physical_gradient = A * reference_gradients[i];
+                for (int d = 0; d < 3; d++)
+                    geometry.gradients[i][d][k] = physical_gradient[d];
+                geometry.interior[i][k] = surface->on_boundary[surface->triangles[k][i]] ? 0.0f : 1.0f;
+            }
+        }
+    });
+}
+
+/**
+ * Builds the sparsity pattern shared by the stiffness, mass, and advection matrices,
+ * along with the map from each nonzero to the element slots that contribute to it.
+ * This only needs to happen once per mesh and boundary condition.
+ * 
+ * Every element has 9 slots, one for each (i, j) pair of its nodes, numbered (3 * i + j) * num_elements + k
+ * so that each (i, j) pair is contiguous over the elements.
+ * The slots are bucketed by row and then by column, both stably, so every nonzero lists its slots in element order.
+ */
+void FEMContext::build_sparsity_pattern() {
+    int n = num_unknowns();
+    auto slot_row = [&](int slot) { return idx_map[surface->triangles[slot % num_elements][slot / num_elements / 3]]; };
+    auto slot_col = [&](int slot) { return idx_map[surface->triangles[slot % num_elements][slot / num_elements % 3]]; };
+
+    // Slots of nodes that are not unknowns (Dirichlet boundary nodes) have no row or column
+    std::vector<int> order;
+    order.reserve(9 * num_elements);
+    for (int k = 0; k < num_elements; k++) {
+        for (int ij = 0; ij < 9; ij++) {
+            int slot = ij * num_elements + k;
+            if (slot_row(slot) != -1 && slot_col(slot) != -1)
+                order.push_back(slot);
+        }
+    }
+
+    // Counting sort of the slots by row, then by column
+    auto bucket = [&](const std::vector<int>& order, auto key) {
+        std::vector<int> offsets(n + 1, 0);
+        for (int slot : order)
+            offsets[key(slot) + 1]++;
+        for (int i = 0; i < n; i++)
+            offsets[i + 1] += offsets[i];
+
+        std::vector<int> sorted(order.size());
+        for (int slot : order)
+            sorted[offsets[key(slot)]++] = slot;
+        return sorted;
+    };
+    order = bucket(order, slot_row);
+    order = bucket(order, slot_col);
+
+    std::vector<int> outer_indices(n + 1, 0);
+    std::vector<int> inner_indices;
+    nonzero_slots = order;
+    nonzero_slot_offsets.clear();
+    for (int idx = 0; idx < order.size(); idx++) {
+        int row = slot_row(order[idx]), col = slot_col(order[idx]);
+        if (idx == 0 || row != slot_row(order[idx - 1]) || col != slot_col(order[idx - 1])) {
+            inner_indices.push_back(row);
+            nonzero_slot_offsets.push_back(idx);
+            outer_indices[col + 1]++;
+        }
+    }
+    nonzero_slot_offsets.push_back(order.size());
+    for (int i = 0; i < n; i++)
+        outer_indices[i + 1] += outer_indices[i];
+
+    for (Eigen::SparseMatrix<float>* matrix : {&stiffness_matrix, &mass_matrix, &advection_matrix}) {
+        matrix->resize(n, n);
+        matrix->resizeNonZeros(inner_indices.size());
+        std::copy(outer_indices.begin(), outer_indices.end(), matrix->outerIndexPtr());
+        std::copy(inner_indices.begin(), inner_indices.end(), matrix->innerIndexPtr());
+        std::fill_n(matrix->valuePtr(), inner_indices.size(), 0.0f);
+    }
+
+    this->max_row_nonzeros = compute_max_row_nonzeros();
+}
+
+/**
+ * Builds the map from each unknown to the elements that touch its node, which replaces the sparsity pattern in matrix-free mode
+ * and gathers the lumped mass and the row sums in both modes.
+ * 
+ * Every element has 3 corners, numbered 3 * k + i. Each unknown lists its corners in element order.
+ */
+void FEMContext::build_node_adjacency() {
+    int n = num_unknowns();
+
+    for (int j = 0; j < 3; j++) {
+        element_unknowns[j].resize(num_elements);
+        for (int k = 0; k < num_elements; k++)
+            element_unknowns[j][k] = idx_map[surface->triangles[k][j]];
+    }
+
+    node_element_offsets = std::vector<int>(n + 1, 0);
+    for (int k = 0; k < num_elements; k++)
         for (int i = 0; i < 3; i++)
-            physical_gradients[i] = A * reference_gradients[i];
+            if (element_unknowns[i][k] != -1)
+                node_element_offsets[element_unknowns[i][k] + 1]++;
+    for (int row = 0; row < n; row++)
+        node_element_offsets[row + 1] += node_element_offsets[row];
+
+    std::vector<int> next = node_element_offsets;
+    node_elements.resize(node_element_offsets[n]);
+    for (int k = 0; k < num_elements; k++)
+        for (int i = 0; i < 3; i++)
+            if (element_unknowns[i][k] != -1)
+                node_elements[next[element_unknowns[i][k]]++] = 3 * k + i;
+}
+
+/**
+ * Returns entry (i, j) of element k's local matrix of
+ * coefficients.mass * M + coefficients.stiffness * K - coefficients.advection * (advection matrix)
+ */
+float FEMContext::element_entry(const OperatorCoefficients& coefficients, int k, int i, int j) {
+    const ElementGeometryCache& g = geometry;
+    float area = g.areas[k];
+    float mass_factor = lump_mass ? (i == j ? 1.0f / 3.0f : 0.0f) : (i == j ? 1.0f / 6.0f : 1.0f / 12.0f);
+    float entry = coefficients.mass * mass_factor * area;
+
+    if (coefficients.stiffness != 0.0f) {
+        float gradient_dot = g.gradients[i][0][k] * g.gradients[j][0][k] + g.gradients[i][1][k] * g.gradients[j][1][k] + g.gradients[i][2][k] * g.gradients[j][2][k];
+        entry += coefficients.stiffness * area * gradient_dot;
+    }
+    if (coefficients.advection != 0.0f) {
+        float velocity_dot_gradient = g.velocities[0][k] * g.gradients[j][0][k] + g.velocities[1][k] * g.gradients[j][1][k] + g.velocities[2][k] * g.gradients[j][2][k];
+        entry -= coefficients.advection * g.interior[i][k] * g.interior[j][k] * (area / 3.0f) * velocity_dot_gradient;
+    }
+    return entry;
+}
 
+/**
+ * Multiplies a vector of unknowns by coefficients.mass * M + coefficients.stiffness * K - coefficients.advection * (advection matrix)
+ * without forming the matrices. Only available in matrix-free mode.
+ * 
+ * The product is computed in two passes. The first applies each element's local matrix to the values at its corners,
+ * streaming over the element geometry cache. The second sums the corner products at each unknown's node.
+ * Neither pass writes to memory shared between threads.
+ * 
+ * @param coefficients The coefficients on each of the FEM matrices
+ * @param x The vector to multiply, with one value per unknown
+ */
+Eigen::VectorXf FEMContext::apply_operator(const OperatorCoefficients& coefficients, const Eigen::VectorXf& x) {
+    ScopedTimer timer("FEMContext::apply_operator");
+    std::vector<float> corner_products(3 * num_elements); // Indexed by corner, 3 * element + i
+
+    parallel_for(num_elements, 4096, [&](int begin, int end) {
+        const float* area = geometry.areas.data();
+        const float* gradients[3][3];
+        const float* velocities[3];
+        const float* interior[3];
+        const int* unknowns[3];
         for (int i = 0; i < 3; i++) {
-            for (int j = 0; j < 3; j++) {
-                if (!surface->on_boundary[surface->triangles[k][i]] && !surface->on_boundary[surface->triangles[k][j]]) {
-                    matrix_entries.push_back(Eigen::Triplet<float>(
-                        idx_map[surface->triangles[k][i]],
-                        idx_map[surface->triangles[k][j]], 
-                        (jacobian_determinant / 6.0f) * transformed_velocity.dot(physical_gradients[j])
-                    ));
+            for (int d = 0; d < 3; d++)
+                gradients[i][d] = geometry.gradients[i][d].data();
+            velocities[i] = geometry.velocities[i].data();
+            interior[i] = geometry.interior[i].data();
+            unknowns[i] = element_unknowns[i].data();
+        }
+
+        for (int k = begin; k < end; k++) {
+            float x_local[3];
+            for (int j = 0; j < 3; j++)
+                x_local[j] = unknowns[j][k] != -1 ? x[unknowns[j][k]] : 0.0f;
+
+            // K_ij * x_j = area * ∇(phi_i) dot ∇(u), where ∇(u) = sum over j of x_j * ∇(phi_j)
+            float gradient[3];
+            for (int d = 0; d < 3; d++)
+                gradient[d] = x_local[0] * gradients[0][d][k] + x_local[1] * gradients[1][d][k] + x_local[2] * gradients[2][d][k];
+
+            // M_ij * x_j = (area / 12) * (x_i + sum over j of x_j), or (area / 3) * x_i when the mass is lumped
+            float mass_sum = x_local[0] + x_local[1] + x_local[2];
+
+            // A_ij * x_j = interior_i * (area / 3) * velocity dot (sum over j of interior_j * x_j * ∇(phi_j))
+            float advection = 0.0f;
+            if (coefficients.advection != 0.0f) {
+                for (int d = 0; d < 3; d++) {
+                    float interior_gradient = interior[0][k] * x_local[0] * gradients[0][d][k] + interior[1][k] * x_local[1] * gradients[1][d][k] + interior[2][k] * x_local[2] * gradients[2][d][k];
+                    advection += velocities[d][k] * interior_gradient;
                 }
+                advection *= area[k] / 3.0f;
+            }
+
+            for (int i = 0; i < 3; i++) {
+                float stiffness = area[k] * (gradients[i][0][k] * gradient[0] + gradients[i][1][k] * gradient[1] + gradients[i][2][k] * gradient[2]);
+                float mass = lump_mass ? (area[k] / 3.0f) * x_local[i] : (area[k] / 12.0f) * (mass_sum + x_local[i]);
+                corner_products[3 * k + i] = coefficients.mass * mass + coefficients.stiffness * stiffness - coefficients.advection * interior[i][k] * advection;
             }
         }
-    }
+    });
+
+    Eigen::VectorXf y(num_unknowns());
+    parallel_for(num_unknowns(), 4096, [&](int begin, int end) {
+        for (int row = begin; row < end; row++) {
+            float y_row = 0.0f;
+            for (int idx = node_element_offsets[row]; idx < node_element_offsets[row + 1]; idx++)
+                y_row += corner_products[node_elements[idx]];
+            y[row] = y_row;
+        }
+    });
 
-    advection_matrix = Eigen::SparseMatrix<float>(num_unknowns(), num_unknowns());
-    advection_matrix.setFromTriplets(matrix_entries.begin(), matrix_entries.end());
-    advection_matrix.makeCompressed();
+    return y;
+}
+
+/**
+ * Returns the diagonal of coefficients.mass * M + coefficients.stiffness * K - coefficients.advection * (advection matrix)
+ * without forming the matrices. Only available in matrix-free mode.
+ */
+Eigen::VectorXf FEMContext::operator_diagonal(const OperatorCoefficients& coefficients) {
+    Eigen::VectorXf diagonal(num_unknowns());
+
+    parallel_for(num_unknowns(), 4096, [&](int begin, int end) {
+        for (int row = begin; row < end; row++) {
+            float diagonal_row = 0.0f;
+            for (int idx = node_element_offsets[row]; idx < node_element_offsets[row + 1]; idx++)
+                diagonal_row += element_entry(coefficients, node_elements[idx] / 3, node_elements[idx] % 3, node_elements[idx] % 3);
+            diagonal[row] = diagonal_row;
+        }
+    });
+
+    return diagonal;
+}
+
+/**
+ * Overwrites the values of a matrix in place by summing the element slots of every nonzero
+ * 
+ * @param matrix A matrix with the pattern built by build_sparsity_pattern()
+ * @param slot_values The value of every element slot
+ */
+void FEMContext::gather_slots(Eigen::SparseMatrix<float>& matrix, const std::vector<float>& slot_values) {
+    float* values = matrix.valuePtr();
+    parallel_for(matrix.nonZeros(), 16384, [&](int begin, int end) {
+        for (int nz = begin; nz < end; nz++) {
+            float value = 0.0f;
+            for (int idx = nonzero_slot_offsets[nz]; idx < nonzero_slot_offsets[nz + 1]; idx++)
+                value += slot_values[nonzero_slots[idx]];
+            values[nz] = value;
+        }
+    });
 }
 
 /**
@@ -219,7 +583,9 @@ int FEMContext::compute_max_row_nonzeros() {
 }
 
 /**
- * Update the index map to reflect the surface's boundary conditions
+ * Update the index map to reflect the surface's boundary conditions.
+ * The sparsity pattern (or the node adjacency in matrix-free mode) depends on which nodes are unknown,
+ * so it is rebuilt before the matrices are reassembled.
  */
 void FEMContext::update_boundary_conditions() {
     int idx = 0;
@@ -236,5 +602,312 @@ void FEMContext::update_boundary_conditions() {
         }
     }
 
+    if (static_cast<NodeOrdering>(node_ordering) == NodeOrdering::Reverse_Cuthill_McKee)
+        reorder_unknowns();
+
+    node_map = std::vector<int>(num_unknowns());
+    for (int i = 0; i < surface->vertices.size(); i++)
+        if (idx_map[i] != -1)
+            node_map[idx_map[i]] = i;
+
+    this->bandwidth = 0;
+    for (Triangle& triangle : surface->triangles)
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                if (idx_map[triangle[i]] != -1 && idx_map[triangle[j]] != -1)
+                    this->bandwidth = std::max(this->bandwidth, static_cast<unsigned int>(std::abs(idx_map[triangle[i]] - idx_map[triangle[j]])));
+
+    build_node_adjacency();
+    if (matrix_free) {
+        // Nothing reads the assembled matrices in matrix-free mode, so they are released
+        stiffness_matrix = Eigen::SparseMatrix<float>();
+        mass_matrix = Eigen::SparseMatrix<float>();
+        advection_matrix = Eigen::SparseMatrix<float>();
+        nonzero_slot_offsets = std::vector<int>();
+        nonzero_slots = std::vector<int>();
+        advection_slots = std::vector<float>();
+        this->max_row_nonzeros = 0;
+        prolongations.clear();
+    } else {
+        build_sparsity_pattern();
+        build_prolongations();
+    }
     assemble_matrices();
+}
+
+/**
+ * Returns the barycentric weights of linear interpolation from a coarse mesh onto a set of points, in the XZ plane,
+ * as triplets of (point, coarse vertex, weight). Each point is located in the coarse triangle that contains it,
+ * found through a uniform grid of buckets over the coarse triangles, searching the point's own cell and then the
+ * cells around it. Points that fall outside of every triangle, such as new vertices on curved parts of the boundary
+ * or next to holes, use the nearest triangle with clamped weights, so that every point is interpolated.
+ */
+static std::vector<Eigen::Triplet<float>> interpolation_weights(const std::vector<glm::vec3>& points, const SurfaceLevel& coarse) {
+    glm::vec2 min_corner(std::numeric_limits<float>::max()), max_corner(std::numeric_limits<float>::lowest());
+    for (const glm::vec3& vertex : coarse.vertices) {
+        min_corner = glm::min(min_corner, glm::vec2(vertex.x, vertex.z));
+        max_corner = glm::max(max_corner, glm::vec2(vertex.x, vertex.z));
+    }
+
+    int resolution = std::max(1, static_cast<int>(std::sqrt(coarse.triangles.size() / 2)));
+    glm::vec2 cell_size = glm::max((max_corner - min_corner) / static_cast<float>(resolution), glm::vec2(1e-12f));
+    auto cell_of = [&](glm::vec2 point) {
+        glm::ivec2 cell = glm::ivec2((point - min_corner) / cell_size);
+        return glm::clamp(cell, glm::ivec2(0), glm::ivec2(resolution - 1));
+    };
+
+    // Bucket the triangles by the cells that their bounding boxes overlap
+    std::vector<int> bucket_offsets(resolution * resolution + 1, 0), buckets;
+    for (int pass = 0; pass < 2; pass++) {
+        std::vector<int> fill(bucket_offsets.begin(), bucket_offsets.end() - 1);
+        if (pass == 1) buckets.resize(bucket_offsets.back());
+
+        for (int t = 0; t < coarse.triangles.size(); t++) {
+            Triangle triangle = coarse.triangles[t];
+            glm::vec2 corners[3];
+            for (int i = 0; i < 3; i++)
+                corners[i] = glm::vec2(coarse.vertices[triangle[i]].x, coarse.vertices[triangle[i]].z);
+            glm::ivec2 low = cell_of(glm::min(corners[0], glm::min(corners[1], corners[2])));
+            glm::ivec2 high = cell_of(glm::max(corners[0], glm::max(corners[1], corners[2])));
+
+            for (int y = low.y; y <= high.y; y++) {
+                for (int x = low.x; x <= high.x; x++) {
+                    if (pass == 0) bucket_offsets[y * resolution + x + 1]++;
+                    else buckets[fill[y * resolution + x]++] = t;
+                }
+            }
+        }
+        if (pass == 0)
+            for (int cell = 0; cell < resolution * resolution; cell++)
+                bucket_offsets[cell + 1] += bucket_offsets[cell];
+    }
+
+    // The barycentric coordinates of a point in a coarse triangle, returning false if the triangle is degenerate
+    auto barycentric_of = [&](int t, glm::vec2 point, glm::vec3& barycentric) {
+        Triangle triangle = coarse.triangles[t];
+        glm::vec2 a(coarse.vertices[triangle[0]].x, coarse.vertices[triangle[0]].z);
+        glm::vec2 b(coarse.vertices[triangle[1]].x, coarse.vertices[triangle[1]].z);
+        glm::vec2 c(coarse.vertices[triangle[2]].x, coarse.vertices[triangle[2]].z);
+
+        float area = (b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y);
+        if (area == 0.0f) return false;
+        float weight_b = ((point.x - a.x) * (c.y - a.y) - (c.x - a.x) * (point.y - a.y)) / area;
+        float weight_c = ((b.x - a.x) * (point.y - a.y) - (point.x - a.x) * (b.y - a.y)) / area;
+        barycentric = glm::vec3(1.0f - weight_b - weight_c, weight_b, weight_c);
+        return true;
+    };
+
+    // The distance from a point to a coarse triangle, which is 0 inside of it
+    auto distance_to = [&](int t, glm::vec2 point) {
+        glm::vec3 barycentric;
+        if (barycentric_of(t, point, barycentric) && std::min(barycentric.x, std::min(barycentric.y, barycentric.z)) >= 0.0f)
+            return 0.0f;
+        Triangle triangle = coarse.triangles[t];
+        float distance = std::numeric_limits<float>::max();
+        for (int i = 0; i < 3; i++) {
+            glm::vec2 a(coarse.vertices[triangle[i]].x, coarse.vertices[triangle[i]].z);
+            glm::vec2 b(coarse.vertices[triangle[(i + 1) % 3]].x, coarse.vertices[triangle[(i + 1) % 3]].z);
+            float length_squared = glm::dot(b - a, b - a);
+            float s = length_squared > 0.0f ? std::clamp(glm::dot(point - a, b - a) / length_squared, 0.0f, 1.0f) : 0.0f;
+            distance = std::min(distance, glm::distance(point, a + s * (b - a)));
+        }
+        return distance;
+    };
+
+    // Points within this of a triangle in barycentric terms count as inside of it, to absorb rounding on shared edges
+    const float INSIDE_TOLERANCE = 1e-5f;
+
+    std::vector<Eigen::Triplet<float>> weights;
+    weights.reserve(points.size() * 3);
+    for (int p = 0; p < points.size(); p++) {
+        glm::vec2 point(points[p].x, points[p].z);
+        glm::ivec2 cell = cell_of(point);
+
+        int best_triangle = -1;
+        float best_min_weight = std::numeric_limits<float>::lowest();
+        glm::vec3 best_weights;
+        auto search_cells = [&](glm::ivec2 low, glm::ivec2 high) {
+            for (int y = low.y; y <= high.y; y++) {
+                for (int x = low.x; x <= high.x; x++) {
+                    for (int idx = bucket_offsets[y * resolution + x]; idx < bucket_offsets[y * resolution + x + 1]; idx++) {
+                        glm::vec3 barycentric;
+                        if (!barycentric_of(buckets[idx], point, barycentric)) continue;
+
+                        float min_weight = std::min(barycentric.x, std::min(barycentric.y, barycentric.z));
+                        if (min_weight > best_min_weight) {
+                            best_min_weight = min_weight;
+                            best_triangle = buckets[idx];
+                            best_weights = barycentric;
+                        }
+                    }
+                }
+            }
+        };
+
+        search_cells(cell, cell);
+        if (best_min_weight < -INSIDE_TOLERANCE)
+            search_cells(glm::max(cell - glm::ivec2(1), glm::ivec2(0)), glm::min(cell + glm::ivec2(1), glm::ivec2(resolution - 1)));
+
+        // Outside of every nearby triangle, so search rings of cells outwards for the nearest triangle. Triangles that are
+        // only in cells past ring r are at least r cells away, so the search stops once the nearest one found is closer
+        if (best_min_weight < -INSIDE_TOLERANCE) {
+            float nearest_distance = std::numeric_limits<float>::max();
+            int nearest_triangle = -1;
+            float ring_width = std::min(cell_size.x, cell_size.y);
+            for (int r = 0; r < resolution && nearest_distance > (r - 1) * ring_width; r++) {
+                for (int y = std::max(cell.y - r, 0); y <= std::min(cell.y + r, resolution - 1); y++) {
+                    for (int x = std::max(cell.x - r, 0); x <= std::min(cell.x + r, resolution - 1); x++) {
+                        if (std::max(std::abs(x - cell.x), std::abs(y - cell.y)) != r) continue;
+                        for (int idx = bucket_offsets[y * resolution + x]; idx < bucket_offsets[y * resolution + x + 1]; idx++) {
+                            float distance = distance_to(buckets[idx], point);
+                            if (distance < nearest_distance) {
+                                nearest_distance = distance;
+                                nearest_triangle = buckets[idx];
+                            }
+                        }
+                    }
+                }
+            }
+            if (nearest_triangle != -1 && barycentric_of(nearest_triangle, point, best_weights))
+                best_triangle = nearest_triangle;
+        }
+        if (best_triangle == -1) continue;
+
+        best_weights = glm::max(best_weights, glm::vec3(0.0f));
+        best_weights /= best_weights.x + best_weights.y + best_weights.z;
+        Triangle triangle = coarse.triangles[best_triangle];
+        for (int i = 0; i < 3; i++)
+            if (best_weights[i] > 0.0f)
+                weights.emplace_back(p, triangle[i], best_weights[i]);
+    }
+
+    return weights;
+}
+
+/**
+ * Builds the prolongation from the unknowns of each coarse level of the surface onto those of the next finer level,
+ * by linear interpolation. Under Dirichlet boundary conditions, boundary nodes are not unknowns on any level,
+ * so their columns are dropped since their values are fixed to 0. Surfaces without coarse levels get no prolongations.
+ */
+void FEMContext::build_prolongations() {
+    prolongations.clear();
+
+    // The index map of a coarse level, which keeps the vertex order since no sparsity pattern is built from it
+    auto level_idx_map = [&](const SurfaceLevel& level) {
+        std::vector<int> map(level.vertices.size(), -1);
+        int idx = 0;
+        for (int i = 0; i < level.vertices.size(); i++)
+            if (static_cast<BoundaryCondition>(boundary_condition) == BoundaryCondition::Neumann || !level.on_boundary[i])
+                map[i] = idx++;
+        return std::make_pair(map, idx);
+    };
+
+    std::vector<int> fine_map = idx_map;
+    int fine_unknowns = num_unknowns();
+    const std::vector<glm::vec3>* fine_vertices = &surface->vertices;
+
+    for (int level = surface->coarse_levels.size() - 1; level >= 0; level--) {
+        const SurfaceLevel& coarse = surface->coarse_levels[level];
+        auto [coarse_map, coarse_unknowns] = level_idx_map(coarse);
+
+        std::vector<Eigen::Triplet<float>> triplets;
+        for (const Eigen::Triplet<float>& weight : interpolation_weights(*fine_vertices, coarse))
+            if (fine_map[weight.row()] != -1 && coarse_map[weight.col()] != -1)
+                triplets.emplace_back(fine_map[weight.row()], coarse_map[weight.col()], weight.value());
+
+        Eigen::SparseMatrix<float> prolongation(fine_unknowns, coarse_unknowns);
+        prolongation.setFromTriplets(triplets.begin(), triplets.end());
+        prolongations.push_back(std::move(prolongation));
+
+        fine_map = std::move(coarse_map);
+        fine_unknowns = coarse_unknowns;
+        fine_vertices = &coarse.vertices;
+    }
+}
+
+/**
+ * Renumbers the unknowns in idx_map with the Reverse Cuthill-McKee ordering, which keeps unknowns that share an element
+ * close together. This shrinks the bandwidth of the FEM matrices, so matrix-vector products and factorizations touch
+ * memory that is already in cache, regardless of the order of the vertices in the mesh file.
+ * 
+ * Each connected component is numbered by a breadth first search from a pseudo-peripheral node,
+ * visiting the neighbors of each node in order of increasing degree. The resulting order is then reversed.
+ */
+void FEMContext::reorder_unknowns() {
+    int n = num_unknowns();
+
+    // Build the adjacency lists of the unknowns from the edges of the elements
+    std::vector<std::vector<int>> neighbors(n);
+    for (Triangle& triangle : surface->triangles) {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                int row = idx_map[triangle[i]], col = idx_map[triangle[j]];
+                if (i != j && row != -1 && col != -1)
+                    neighbors[row].push_back(col);
+            }
+        }
+    }
+    for (std::vector<int>& list : neighbors) {
+        std::sort(list.begin(), list.end());
+        list.erase(std::unique(list.begin(), list.end()), list.end());
+    }
+    for (std::vector<int>& list : neighbors)
+        std::sort(list.begin(), list.end(), [&](int a, int b) { return neighbors[a].size() < neighbors[b].size(); });
+
+    std::vector<int> order;
+    order.reserve(n);
+    std::vector<bool> numbered(n, false);
+    std::vector<int> level(n, -1);
+
+    // Breadth first search over the unnumbered nodes from root, returning the visited nodes in the order they were visited
+    auto breadth_first_search = [&](int root) {
+        std::vector<int> visited = {root};
+        level[root] = 0;
+        for (int idx = 0; idx < visited.size(); idx++) {
+            for (int neighbor : neighbors[visited[idx]]) {
+                if (!numbered[neighbor] && level[neighbor] == -1) {
+                    level[neighbor] = level[visited[idx]] + 1;
+                    visited.push_back(neighbor);
+                }
+            }
+        }
+        return visited;
+    };
+
+    for (int start = 0; start < n; start++) {
+        if (numbered[start])
+            continue;
+
+        // Find a pseudo-peripheral node by repeatedly moving to the lowest degree node on the last level
+        int root = start;
+        int eccentricity = -1;
+        for (int attempt = 0; attempt < 8; attempt++) {
+            std::vector<int> visited = breadth_first_search(root);
+            int last_level = level[visited.back()];
+            int candidate = visited.back();
+            for (int node : visited)
+                if (level[node] == last_level && neighbors[node].size() < neighbors[candidate].size())
+                    candidate = node;
+            for (int node : visited)
+                level[node] = -1;
+
+            if (last_level <= eccentricity)
+                break;
+            eccentricity = last_level;
+            root = candidate;
+        }
+
+        for (int node : breadth_first_search(root)) {
+            numbered[node] = true;
+            level[node] = -1;
+            order.push_back(node);
+        }
+    }
+
+    std::vector<int> new_index(n);
+    for (int i = 0; i < n; i++)
+        new_index[order[i]] = n - 1 - i;
+    for (int& idx : idx_map)
+        if (idx != -1)
+            idx = new_index[idx];
 }
\ No newline at end of file
@@ -1,6 +1,11 @@
 #include "FEM/GPUSolver.hpp"
+#include "Utils/Parallel.hpp"
+#include "Utils/Profiler.hpp"
 
+#include <algorithm>
+#include <cstddef>
 #include <iostream>
+#include <numeric>
 
 #define r_0_norm residual_norm_map[0]
 #define r_i_norm residual_norm_map[1]
@@ -26,14 +31,34 @@ GPUSolver::~GPUSolver() {
     glDeleteBuffers(1, &this->stiffness_matrix);
     glDeleteBuffers(1, &this->mass_matrix);
     glDeleteBuffers(1, &this->advection_matrix);
+    glDeleteBuffers(1, &this->matrix_layout);
 
     glDeleteBuffers(1, &this->u);
     glDeleteBuffers(1, &this->v);
+
+    glDeleteBuffers(1, &this->shadow_residuals);
+    glDeleteBuffers(1, &this->search_direction_products);
+    glDeleteBuffers(1, &this->intermediate_residuals);
+    glDeleteBuffers(1, &this->intermediate_residual_products);
+    glDeleteBuffers(1, &this->bicgstab_state);
+
+    glDeleteBuffers(1, &this->element_data);
+    glDeleteBuffers(1, &this->element_unknowns);
+    glDeleteBuffers(1, &this->node_element_offsets);
+    glDeleteBuffers(1, &this->node_elements);
+    glDeleteBuffers(2, this->system_matrices);
+
+    discard_readbacks();
+    glDeleteBuffers(1, &this->readback);
 }
 
 void GPUSolver::init() {
+    discard_readbacks();
     init_buffers();
-    load_matrices();
+    if (fem_ctx->matrix_free)
+        load_element_data();
+    else
+        load_matrices();
     load_state();
     bind_buffers();
 }
@@ -47,13 +72,18 @@ void GPUSolver::brush(int brush_idx, float brush_strength) {
     cgm_helper_compute_shader->set_float("brush_strength", brush_strength);
 
     cgm_helper_compute_shader->set_int("stage", 0);
-    cgm_helper_compute_shader->dispatch_compute(fem_ctx->num_nodes() / 1024 + 1, 1, 1, GL_SHADER_STORAGE_BARRIER_BIT);
+    timed_dispatch(cgm_helper_compute_shader, "Brush", fem_ctx->num_nodes() / 1024 + 1, GL_SHADER_STORAGE_BARRIER_BIT);
 }
 
 /**
  * Returns true if numerical instability is detected in the solution vector(s)
  */
 bool GPUSolver::has_numerical_instability() {
+    if (sync_free) {
+        poll_readbacks();
+        return last_residual_norm > 1e4;
+    }
+
     glFinish();
     return r_i_norm > 1e4;
 }
@@ -63,16 +93,26 @@ bool GPUSolver::has_numerical_instability() {
  * and sets all of the values to zero
  */
 void GPUSolver::clear_values() {
+    discard_readbacks();
     cgm_helper_compute_shader->bind();
     cgm_helper_compute_shader->set_int("stage", 4);
-    cgm_helper_compute_shader->dispatch_compute(fem_ctx->num_nodes() / 1024 + 1, 1, 1, GL_SHADER_STORAGE_BARRIER_BIT);
+    timed_dispatch(cgm_helper_compute_shader, "Clear values", fem_ctx->num_nodes() / 1024 + 1, GL_SHADER_STORAGE_BARRIER_BIT);
 }
 
 /**
  * Advance time by one time step based on the selected equation in the associated FEMContext
  */
 void GPUSolver::advance_time() {
+    ScopedTimer timer("GPUSolver::advance_time");
+    gpu_timer.collect();
+    int last_iterations = iterations;
+    iterations = 0;
     bind_buffers();
+    set_operator_uniforms();
+
+    // Reset the iteration count that the CG shader keeps for the readback
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->state);
+    glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32I, 10 * sizeof(float), sizeof(int), GL_RED_INTEGER, GL_INT, nullptr);
 
     switch (fem_ctx->equation) {
         case Equation::Heat: {
@@ -88,6 +128,7 @@ void GPUSolver::advance_time() {
             cgm_compute_shader->set_float("time_step", params->time_step);
             cgm_compute_shader->set_float("c", params->conductivity);
 
+            use_system_matrix(0, 1.0f / params->time_step, params->conductivity, 0.0f);
             cgm_setup();
             cgm();
             cgm_cleanup();
@@ -101,13 +142,13 @@ void GPUSolver::advance_time() {
             cgm_helper_compute_shader->set_float("time_step", params->time_step);
             cgm_helper_compute_shader->set_float("c", params->c);
             
-            cgm_compute_shader->bind();
-            cgm_compute_shader->set_int("equation", 1); 
-            cgm_compute_shader->set_float("time_step", params->time_step);
-            cgm_compute_shader->set_float("c", params->c);
+            bicgstab_compute_shader->bind();
+            bicgstab_compute_shader->set_float("time_step", params->time_step);
+            bicgstab_compute_shader->set_float("c", params->c);
 
+            use_system_matrix(0, 1.0f / params->time_step, params->c, 1.0f);
             cgm_setup();
-            cgm();
+            bicgstab();
             cgm_cleanup();
         } break;
 
@@ -124,13 +165,14 @@ void GPUSolver::advance_time() {
             cgm_compute_shader->set_float("time_step", params->time_step);
             cgm_compute_shader->set_float("c", params->c);
 
+            use_system_matrix(0, 1.0f / params->time_step, params->c * params->c * params->time_step, 0.0f);
             cgm_setup();
             cgm();
 
             // Wave Equation Exclusive Step
             cgm_helper_compute_shader->bind();
             cgm_helper_compute_shader->set_int("stage", 2);
-            cgm_helper_compute_shader->dispatch_compute(fem_ctx->num_unknowns() / 1024 + 1, 1, 1, GL_SHADER_STORAGE_BARRIER_BIT);
+            timed_dispatch(cgm_helper_compute_shader, "Wave equation update", fem_ctx->num_unknowns() / 1024 + 1, GL_SHADER_STORAGE_BARRIER_BIT);
 
             cgm_cleanup();
         } break;
@@ -154,21 +196,42 @@ void GPUSolver::advance_time() {
             cgm_compute_shader->set_float("feed_rate", params->feed_rate);
             cgm_compute_shader->set_float("kill_rate", params->kill_rate);
 
+            use_system_matrix(0, 1.0f / params->time_step, params->Du, 0.0f);
             cgm_setup();
             cgm();
 
             cgm_helper_compute_shader->bind(); cgm_helper_compute_shader->set_int("equation", 4);
             cgm_compute_shader->bind(); cgm_compute_shader->set_int("equation", 4);
+            use_system_matrix(1, 1.0f / params->time_step, params->Dv, 0.0f);
             
             // Initialize vectors (# invocations = N)
             cgm_helper_compute_shader->bind();
             cgm_helper_compute_shader->set_int("stage", 1);
-            cgm_helper_compute_shader->dispatch_compute(fem_ctx->num_unknowns() / 1024 + 1, 1, 1, GL_SHADER_STORAGE_BARRIER_BIT);
+            timed_dispatch(cgm_helper_compute_shader, "CG setup: initialize vectors", fem_ctx->num_unknowns() / 1024 + 1, GL_SHADER_STORAGE_BARRIER_BIT);
 
             cgm();
             cgm_cleanup();
         } break;
     }
+
+    if (sync_free) {
+        // iterations is updated by poll_readbacks() once the GPU has finished this time step
+        iterations = last_iterations;
+        queue_readback();
+    }
+
+    gpu_timer.collect();
+}
+
+/**
+ * Dispatches a compute shader, timing it on the GPU if the profiler is recording
+ *
+ * @param name The name to record the dispatch under
+ */
+void GPUSolver::timed_dispatch(std::shared_ptr<ComputeShader> shader, const char* name, int num_groups, int barriers) {
+    gpu_timer.begin(name);
+    shader->dispatch_compute(num_groups, 1, 1, barriers);
+    gpu_timer.end();
 }
 
 /**
@@ -185,14 +248,27 @@ void GPUSolver::init_buffers() {
     glGenBuffers(1, &this->stiffness_matrix);
     glGenBuffers(1, &this->mass_matrix);
     glGenBuffers(1, &this->advection_matrix);
+    glGenBuffers(1, &this->matrix_layout);
 
     glGenBuffers(1, &this->u);
     glGenBuffers(1, &this->v);
 
-    std::vector<float> zeros = std::vector<float>(fem_ctx->num_unknowns() + 7, 0.0f);
+    glGenBuffers(1, &this->shadow_residuals);
+    glGenBuffers(1, &this->search_direction_products);
+    glGenBuffers(1, &this->intermediate_residuals);
+    glGenBuffers(1, &this->intermediate_residual_products);
+    glGenBuffers(1, &this->bicgstab_state);
+
+    glGenBuffers(1, &this->element_data);
+    glGenBuffers(1, &this->element_unknowns);
+    glGenBuffers(1, &this->node_element_offsets);
+    glGenBuffers(1, &this->node_elements);
+    glGenBuffers(2, this->system_matrices);
+
+    std::vector<float> zeros = std::vector<float>(fem_ctx->num_unknowns() + 12, 0.0f);
 
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->state);
-    glBufferStorage(GL_SHADER_STORAGE_BUFFER, (fem_ctx->num_unknowns() + 7) * sizeof(float), zeros.data(), GL_DYNAMIC_STORAGE_BIT | GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    glBufferStorage(GL_SHADER_STORAGE_BUFFER, (fem_ctx->num_unknowns() + 12) * sizeof(float), zeros.data(), GL_DYNAMIC_STORAGE_BIT | GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
     residual_norm_map = static_cast<float*>(glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, 8 * sizeof(float), GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT));
 
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->known);
@@ -212,6 +288,21 @@ void GPUSolver::init_buffers() {
 
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->v);
     glBufferData(GL_SHADER_STORAGE_BUFFER, fem_ctx->num_unknowns() * sizeof(float), zeros.data(), GL_STATIC_DRAW);
+
+    for (unsigned int buffer : {shadow_residuals, search_direction_products, intermediate_residuals, intermediate_residual_products}) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, fem_ctx->num_unknowns() * sizeof(float), zeros.data(), GL_STATIC_DRAW);
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->bicgstab_state);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 6 * sizeof(float), zeros.data(), GL_STATIC_DRAW);
+
+    if (!this->readback) {
+        glGenBuffers(1, &this->readback);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, this->readback);
+        glBufferStorage(GL_COPY_WRITE_BUFFER, NUM_READBACKS * sizeof(Readback), nullptr, GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+        readback_map = static_cast<Readback*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, NUM_READBACKS * sizeof(Readback), GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT));
+    }
 }
 
 /**
@@ -229,8 +320,22 @@ void GPUSolver::bind_buffers() {
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::MassMatrix), this->mass_matrix);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::AdvectionMatrix), this->advection_matrix);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::MatrixIndices), this->matrix_indices);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::MatrixLayout), this->matrix_layout);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::VectorU), this->u);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::VectorV), this->v);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::ShadowResiduals), this->shadow_residuals);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::SearchDirectionProducts), this->search_direction_products);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::IntermediateResiduals), this->intermediate_residuals);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::IntermediateResidualProducts), this->intermediate_residual_products);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::BiCGSTABState), this->bicgstab_state);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::ElementData), this->element_data);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::ElementUnknowns), this->element_unknowns);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::NodeElementOffsets), this->node_element_offsets);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::NodeElements), this->node_elements);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::SystemMatrix), this->system_matrices[current_system_matrix]);
 }
 
 /**
@@ -248,67 +353,248 @@ void GPUSolver::load_state() {
 }
 
 /**
- * Load the matrices from the associated FEMContext into their respective SSBOs 
+ * Load the matrices from the associated FEMContext into their respective SSBOs, in matrix_format.
+ * Automatic picks ELL while padding every row to the longest one wastes little, then SELL-C-sigma,
+ * whose slices only pad rows to the longest of SELL_SLICE_HEIGHT rows of similar length, and CSR
+ * when even the sorted slices are mostly padding.
+ *
+ * The entries are written straight from the compressed storage of the matrices into the mapped SSBOs,
+ * in parallel and in the order that they are stored in.
  */
 void GPUSolver::load_matrices() {
-    unsigned int N = fem_ctx->num_unknowns();
-    unsigned int M = fem_ctx->num_max_nonzeros_per_row();
-
-    std::vector<int> indices_buffer = std::vector<int>(N * M, -1);
-    std::vector<float> stiffness_buffer = std::vector<float>(N * M, 0.0f);
-    std::vector<float> mass_buffer = std::vector<float>(N * M, 0.0f);
-    std::vector<float> advection_buffer = std::vector<float>(N * M, 0.0f);
-
-    Eigen::SparseMatrix<float, Eigen::RowMajor> A = fem_ctx->stiffness_matrix;
-
-    for (int i = 0; i < A.outerSize(); i++) {
-        int j = 0; 
-        for (Eigen::SparseMatrix<float, Eigen::RowMajor>::InnerIterator it(A, i); it; ++it, j++) {
-            unsigned int row = i;
-            unsigned int col = it.index();
-            unsigned int buffer_idx = M * i + j;
-
-            indices_buffer[buffer_idx] = col;
-            stiffness_buffer[buffer_idx] = fem_ctx->stiffness_matrix.coeff(row, col);
-            mass_buffer[buffer_idx] = fem_ctx->mass_matrix.coeff(row, col);
-            advection_buffer[buffer_idx] = fem_ctx->advection_matrix.coeff(row, col);
+    ScopedTimer timer("GPUSolver::load_matrices");
+    int N = fem_ctx->num_unknowns();
+    int M = fem_ctx->num_max_nonzeros_per_row();
+
+    // The matrices share one column-major sparsity pattern, which is symmetric, so column i also lists the columns of row i
+    const int* row_offsets = fem_ctx->stiffness_matrix.outerIndexPtr();
+    const int* columns = fem_ctx->stiffness_matrix.innerIndexPtr();
+    std::size_t nonzeros = fem_ctx->stiffness_matrix.nonZeros();
+    auto row_length = [&](int row) { return row_offsets[row + 1] - row_offsets[row]; };
+
+    // Reading the pattern by rows, entry k of row i is (i, columns[k]), whose value is stored at transposed[k]
+    std::vector<int> transposed = std::vector<int>(nonzeros);
+    std::vector<int> next_entry = std::vector<int>(row_offsets, row_offsets + N);
+    for (int col = 0; col < N; col++)
+        for (int k = row_offsets[col]; k < row_offsets[col + 1]; k++)
+            transposed[next_entry[columns[k]]++] = k;
+
+    // SELL-C-sigma sorts the rows within every window of SELL_SORT_WINDOW rows from longest to shortest,
+    // then pads each slice of SELL_SLICE_HEIGHT consecutive sorted rows to the length of its longest row
+    std::vector<int> row_order(N);
+    std::iota(row_order.begin(), row_order.end(), 0);
+    for (int window = 0; window < N; window += SELL_SORT_WINDOW) {
+        std::stable_sort(row_order.begin() + window, row_order.begin() + std::min(window + SELL_SORT_WINDOW, N), [&](int a, int b) {
+            return row_length(a) > row_length(b);
+        });
+    }
+    int num_slices = (N + SELL_SLICE_HEIGHT - 1) / SELL_SLICE_HEIGHT;
+    std::vector<int> slice_offsets = {0};
+    for (int slice = 0; slice < num_slices; slice++) {
+        int slice_length = 0;
+        for (int position = slice * SELL_SLICE_HEIGHT; position < std::min((slice + 1) * SELL_SLICE_HEIGHT, N); position++)
+            slice_length = std::max(slice_length, row_length(row_order[position]));
+        slice_offsets.push_back(slice_offsets.back() + SELL_SLICE_HEIGHT * slice_length);
+    }
+
+    std::size_t ell_size = static_cast<std::size_t>(N) * M;
+    std::size_t sell_size = slice_offsets.back();
+
+    active_matrix_format = matrix_format;
+    if (matrix_format == MatrixFormat::Automatic) {
+        if (ell_size <= nonzeros * 1.1)
+            active_matrix_format = MatrixFormat::ELL;
+        else if (sell_size <= nonzeros * 1.5)
+            active_matrix_format = MatrixFormat::SELL;
+        else
+            active_matrix_format = MatrixFormat::CSR;
+    }
+
+    std::vector<int> layout_buffer = {0}; // matrix_layout in the shaders, which ELL does not use
+    std::size_t size = ell_size;
+    if (active_matrix_format == MatrixFormat::SELL) {
+        layout_buffer = slice_offsets;
+        layout_buffer.insert(layout_buffer.end(), row_order.begin(), row_order.end());
+        size = sell_size;
+    } else if (active_matrix_format == MatrixFormat::CSR) {
+        layout_buffer.assign(row_offsets, row_offsets + N + 1);
+        size = nonzeros;
+    }
+    matrix_padding = size > 0 ? 1.0f - static_cast<float>(nonzeros) / size : 0.0f;
+
+    auto map_buffer = [&](unsigned int buffer, std::size_t bytes) -> void* {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, bytes, nullptr, GL_STATIC_DRAW);
+        return bytes > 0 ? glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT) : nullptr;
+    };
+    int* indices = static_cast<int*>(map_buffer(matrix_indices, size * sizeof(int)));
+    float* stiffness = static_cast<float*>(map_buffer(stiffness_matrix, size * sizeof(float)));
+    float* mass = static_cast<float*>(map_buffer(mass_matrix, size * sizeof(float)));
+    float* advection = static_cast<float*>(map_buffer(advection_matrix, size * sizeof(float)));
+
+    // Stores entry k of the pattern at position in the SSBOs, or padding if k is -1
+    const float* stiffness_values = fem_ctx->stiffness_matrix.valuePtr();
+    const float* mass_values = fem_ctx->mass_matrix.valuePtr();
+    const float* advection_values = fem_ctx->advection_matrix.valuePtr();
+    auto store = [&](std::size_t position, int k) {
+        indices[position] = k != -1 ? columns[k] : -1;
+        stiffness[position] = k != -1 ? stiffness_values[transposed[k]] : 0.0f;
+        mass[position] = k != -1 ? mass_values[transposed[k]] : 0.0f;
+        advection[position] = k != -1 ? advection_values[transposed[k]] : 0.0f;
+    };
+
+    if (active_matrix_format == MatrixFormat::SELL) {
+        parallel_for(num_slices, 128, [&](int begin, int end) {
+            for (int slice = begin; slice < end; slice++) {
+                int slice_length = (slice_offsets[slice + 1] - slice_offsets[slice]) / SELL_SLICE_HEIGHT;
+                for (int j = 0; j < slice_length; j++) {
+                    for (int lane = 0; lane < SELL_SLICE_HEIGHT; lane++) {
+                        int position = slice * SELL_SLICE_HEIGHT + lane;
+                        bool stored = position < N && j < row_length(row_order[position]);
+                        store(slice_offsets[slice] + j * SELL_SLICE_HEIGHT + lane, stored ? row_offsets[row_order[position]] + j : -1);
+                    }
+                }
+            }
+        });
+    } else {
+        bool csr = active_matrix_format == MatrixFormat::CSR;
+        parallel_for(N, 4096, [&](int begin, int end) {
+            for (int row = begin; row < end; row++) {
+                std::size_t row_start = csr ? row_offsets[row] : static_cast<std::size_t>(row) * M;
+                for (int j = 0; j < (csr ? row_length(row) : M); j++)
+                    store(row_start + j, j < row_length(row) ? row_offsets[row] + j : -1);
+            }
+        });
+    }
+
+    if (size > 0) {
+        for (unsigned int buffer : {matrix_indices, stiffness_matrix, mass_matrix, advection_matrix}) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+            glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
         }
     }
 
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, matrix_indices);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, N * M * sizeof(int), indices_buffer.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, matrix_layout);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, layout_buffer.size() * sizeof(int), layout_buffer.data(), GL_STATIC_DRAW);
 
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, stiffness_matrix);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, N * M * sizeof(float), stiffness_buffer.data(), GL_STATIC_DRAW);
+    for (int slot = 0; slot < 2; slot++) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, system_matrices[slot]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, size * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+        system_matrix_valid[slot] = false;
+    }
+}
+
+/**
+ * Binds a system matrix of the form mass_coefficient * M + stiffness_coefficient * K - advection_coefficient * A
+ * for the helper, CGM and BiCGSTAB shaders, so that each of their matrix-vector products reads one value per nonzero.
+ * The matrix is only combined again, on the GPU, when the coefficients differ from the last time the slot was used.
+ *
+ * @param slot Which of the two system matrices to use
+ */
+void GPUSolver::use_system_matrix(int slot, float mass_coefficient, float stiffness_coefficient, float advection_coefficient) {
+    if (fem_ctx->matrix_free)
+        return;
+
+    current_system_matrix = slot;
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, static_cast<unsigned int>(BindingPoint::SystemMatrix), system_matrices[slot]);
 
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, mass_matrix);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, N * M * sizeof(float), mass_buffer.data(), GL_STATIC_DRAW);
+    std::array<float, 3> coefficients = {mass_coefficient, stiffness_coefficient, advection_coefficient};
+    if (system_matrix_valid[slot] && system_matrix_coefficients[slot] == coefficients)
+        return;
 
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, advection_matrix);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, N * M * sizeof(float), advection_buffer.data(), GL_STATIC_DRAW);
+    cgm_helper_compute_shader->bind();
+    cgm_helper_compute_shader->set_float("mass_coefficient", mass_coefficient);
+    cgm_helper_compute_shader->set_float("stiffness_coefficient", stiffness_coefficient);
+    cgm_helper_compute_shader->set_float("advection_coefficient", advection_coefficient);
+    cgm_helper_compute_shader->set_int("stage", 5);
+    timed_dispatch(cgm_helper_compute_shader, "Combine system matrix", fem_ctx->num_unknowns() / 1024 + 1, GL_SHADER_STORAGE_BARRIER_BIT);
+
+    system_matrix_coefficients[slot] = coefficients;
+    system_matrix_valid[slot] = true;
+}
+
+/**
+ * Load the per-element data that the compute shaders use in matrix-free mode into their respective SSBOs.
+ * The element data buffer holds 16 arrays of num_elements floats each: the areas, the 9 components of the
+ * basis function gradients (basis function major), the 3 components of the normals, and the 3 interior flags.
+ */
+void GPUSolver::load_element_data() {
+    const ElementGeometryCache& geometry = fem_ctx->geometry;
+
+    std::vector<float> element_data_buffer;
+    element_data_buffer.reserve(16 * fem_ctx->num_elements);
+    element_data_buffer.insert(element_data_buffer.end(), geometry.areas.begin(), geometry.areas.end());
+    for (int i = 0; i < 3; i++)
+        for (int d = 0; d < 3; d++)
+            element_data_buffer.insert(element_data_buffer.end(), geometry.gradients[i][d].begin(), geometry.gradients[i][d].end());
+    for (int d = 0; d < 3; d++)
+        element_data_buffer.insert(element_data_buffer.end(), geometry.normals[d].begin(), geometry.normals[d].end());
+    for (int i = 0; i < 3; i++)
+        element_data_buffer.insert(element_data_buffer.end(), geometry.interior[i].begin(), geometry.interior[i].end());
+
+    std::vector<int> element_unknowns_buffer;
+    element_unknowns_buffer.reserve(3 * fem_ctx->num_elements);
+    for (int j = 0; j < 3; j++)
+        element_unknowns_buffer.insert(element_unknowns_buffer.end(), fem_ctx->element_unknowns[j].begin(), fem_ctx->element_unknowns[j].end());
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, element_data);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, element_data_buffer.size() * sizeof(float), element_data_buffer.data(), GL_STATIC_DRAW);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, element_unknowns);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, element_unknowns_buffer.size() * sizeof(int), element_unknowns_buffer.data(), GL_STATIC_DRAW);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, node_element_offsets);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, fem_ctx->node_element_offsets.size() * sizeof(int), fem_ctx->node_element_offsets.data(), GL_STATIC_DRAW);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, node_elements);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, fem_ctx->node_elements.size() * sizeof(int), fem_ctx->node_elements.data(), GL_STATIC_DRAW);
+}
+
+/**
+ * Set the uniforms that the compute shaders use to apply the FEM operators: the format of the matrices,
+ * or in matrix-free mode, the per-element parameters. The velocity is projected onto each element
+ * in the shaders, so changing it needs no new upload.
+ */
+void GPUSolver::set_operator_uniforms() {
+    Eigen::Vector3f velocity = std::static_pointer_cast<AdvectionDiffusionParameters>(fem_ctx->parameters[Equation::Advection_Diffusion])->velocity;
+
+    for (std::shared_ptr<ComputeShader> shader : {cgm_compute_shader, cgm_helper_compute_shader, bicgstab_compute_shader}) {
+        shader->bind();
+        shader->set_bool("matrix_free", fem_ctx->matrix_free);
+        shader->set_int("matrix_format", static_cast<int>(fem_ctx->matrix_free ? MatrixFormat::ELL : active_matrix_format));
+        shader->set_int("slice_height", SELL_SLICE_HEIGHT);
+        shader->set_int("num_elements", fem_ctx->num_elements);
+        shader->set_vec3("velocity", glm::vec3(velocity.x(), velocity.y(), velocity.z()));
+        shader->set_bool("lumped_mass", fem_ctx->lump_mass);
+    }
 }
 
 /**
  * Calculate a dot product between two SSBOs containing floating point values
- * depending on the selected stage of the GPU CGM procedure. The result of the
+ * depending on the selected stage of the GPU CGM or BiCGSTAB procedure. The result of the
  * dot product is stored in the first index of the result array in the state SSBO.
+ * Some stages also compute one of the vectors in the same pass, such as A * d in stage 1 of CGM.
+ * 
+ * @param shader The compute shader (cgm or bicgstab) that implements the stage
+ * @param stage The stage of the compute shader that calculates the dot product
  */
-void GPUSolver::dot_product(int stage) {
+void GPUSolver::dot_product(std::shared_ptr<ComputeShader> shader, int stage) {
     bind_buffers();
     int work_group_size = 1024;
-    int current_size = fem_ctx->num_unknowns();
-    cgm_compute_shader->bind();
-    cgm_compute_shader->set_int("stage", stage);
-    cgm_compute_shader->set_bool("first_pass", true);
-
-    while (current_size > 1) {
-        // This math is to ensure that there are enough work groups
-        int num_work_groups = (current_size + (work_group_size - 1)) / work_group_size;
-        cgm_compute_shader->dispatch_compute(num_work_groups, 1, 1, GL_SHADER_STORAGE_BARRIER_BIT | GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+    int num_work_groups = (fem_ctx->num_unknowns() + (work_group_size - 1)) / work_group_size;
+    shader->bind();
+    shader->set_int("stage", stage);
+
+    // The profiler names of each stage, so that no string is built on every dispatch
+    static constexpr const char* STAGE_NAMES[] = {
+        "Dot product (stage 0)", "Dot product (stage 1)", "Dot product (stage 2)", "Dot product (stage 3)",
+        "Dot product (stage 4)", "Dot product (stage 5)", "Dot product (stage 6)", "Dot product (stage 7)",
+        "Dot product (stage 8)", "Dot product (stage 9)", "Dot product (stage 10)",
+    };
+    const char* name = stage >= 0 && stage < std::size(STAGE_NAMES) ? STAGE_NAMES[stage] : "Dot product";
 
-        cgm_compute_shader->set_bool("first_pass", false);
-        current_size = num_work_groups;
-    }
+    // The last work group to finish combines the sums of the others, so the whole reduction is one dispatch
+    timed_dispatch(shader, name, std::max(num_work_groups, 1), GL_SHADER_STORAGE_BARRIER_BIT | GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
 }
 
 void GPUSolver::cgm_setup() {
@@ -316,53 +602,200 @@ void GPUSolver::cgm_setup() {
 
     // Map surface to solution vector and process brush (# invocations = total_nodes)
     cgm_helper_compute_shader->set_int("stage", 0);
-    cgm_helper_compute_shader->dispatch_compute(fem_ctx->num_nodes() / 1024 + 1, 1, 1, GL_SHADER_STORAGE_BARRIER_BIT);
+    timed_dispatch(cgm_helper_compute_shader, "CG setup: map surface to unknowns", fem_ctx->num_nodes() / 1024 + 1, GL_SHADER_STORAGE_BARRIER_BIT);
 
     // Initialize vectors (# invocations = N)
     cgm_helper_compute_shader->set_int("stage", 1);
-    cgm_helper_compute_shader->dispatch_compute(fem_ctx->num_unknowns() / 1024 + 1, 1, 1, GL_SHADER_STORAGE_BARRIER_BIT);
+    timed_dispatch(cgm_helper_compute_shader, "CG setup: initialize vectors", fem_ctx->num_unknowns() / 1024 + 1, GL_SHADER_STORAGE_BARRIER_BIT);
 }
 
+/**
+ * Solve the system with the conjugate gradient method, starting from the residual computed by cgm_setup().
+ * The scalars of each iteration stay on the GPU. In sync-free mode all max_iterations iterations are dispatched
+ * without waiting for the GPU, and the shader skips the ones after convergence. Otherwise the residual is read back
+ * after every iteration to stop as soon as the method converges.
+ */
 void GPUSolver::cgm() {
+    float epsilon = 1e-10;
     cgm_compute_shader->bind();
+    cgm_compute_shader->set_float("epsilon", epsilon);
 
     // Stage 0: Calculate dot(r_i, r_i), Store in r_i_norm (Only occurs on the first iteration of CGM)
-    dot_product(0);
+    dot_product(cgm_compute_shader, 0);
+
+    if (sync_free) {
+        for (int iteration = 0; iteration < max_iterations; iteration++)
+            cgm_iteration();
+        return;
+    }
 
     glFinish();
 
     int iteration = 0;
-    float epsilon = 1e-10;
 
     while (r_i_norm > epsilon && iteration < max_iterations) {
-        // Stage 1: Calculate dot(d_i, A * d_i), Store in d_iA_norm
-        dot_product(1);
+        cgm_iteration();
         glFinish();
 
-        // Stage 2: Update u and r
-        cgm_compute_shader->set_int("stage", 2);
-        cgm_compute_shader->dispatch_compute(fem_ctx->num_unknowns() / 1024 + 1, 1, 1, GL_SHADER_STORAGE_BARRIER_BIT);
-        glFinish();
+        iteration++;
+        
+        if (r_i_norm <= epsilon * r_0_norm)
+            break;
+    }
 
-        // Stage 3: Calculate dot(r_(i+1), r_(i+1))
-        dot_product(3);
-        glFinish();
+    iterations += iteration;
+}
+
+/**
+ * One iteration of the conjugate gradient method in three dispatches. The sparse matrix-vector product is done once,
+ * and each dot product is computed in the same pass that produces its vector.
+ */
+void GPUSolver::cgm_iteration() {
+    // Stage 1: Store A * d_i, and calculate dot(d_i, A * d_i), Store in d_iA_norm and alpha
+    dot_product(cgm_compute_shader, 1);
+
+    // Stage 2: Update u and r, and calculate dot(r_(i+1), r_(i+1)), Store the Gram-Schmidt constant in beta
+    dot_product(cgm_compute_shader, 2);
+
+    // Stage 3: Use the Gram-Schmidt constant to find the next search direction
+    cgm_compute_shader->set_int("stage", 3);
+    timed_dispatch(cgm_compute_shader, "CG stage 3: update search direction", fem_ctx->num_unknowns() / 1024 + 1, GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+/**
+ * Solve the nonsymmetric Advection-Diffusion system with BiCGSTAB, starting from the residual computed by cgm_setup().
+ * Like cgm(), sync-free mode dispatches all max_iterations iterations and lets the shader skip the ones after convergence,
+ * and otherwise the residual is read back after every iteration.
+ */
+void GPUSolver::bicgstab() {
+    float epsilon = 1e-10;
+    bicgstab_compute_shader->bind();
+    bicgstab_compute_shader->set_float("epsilon", epsilon);
+
+    // Stage 0: Initialize the shadow residual and the search direction, and calculate dot(r_0, r_0), Store in r_i_norm
+    dot_product(bicgstab_compute_shader, 0);
+
+    if (sync_free) {
+        for (int iteration = 0; iteration < max_iterations; iteration++)
+            bicgstab_iteration();
+        return;
+    }
 
-        // Stage 4: Use the Gram-Schmidt constant to find the next search direction
-        cgm_compute_shader->set_int("stage", 4);
-        cgm_compute_shader->dispatch_compute(fem_ctx->num_unknowns() / 1024 + 1, 1, 1, GL_SHADER_STORAGE_BARRIER_BIT);
+    glFinish();
+
+    int iteration = 0;
+
+    while (r_i_norm > epsilon && iteration < max_iterations) {
+        bicgstab_iteration();
         glFinish();
 
         iteration++;
-        
+
         if (r_i_norm <= epsilon * r_0_norm)
             break;
     }
+
+    iterations += iteration;
+}
+
+/**
+ * One iteration of BiCGSTAB, which performs two sparse matrix-vector products
+ */
+void GPUSolver::bicgstab_iteration() {
+    int num_work_groups = fem_ctx->num_unknowns() / 1024 + 1;
+
+    // Stage 1: Calculate rho = dot(r_hat, r_i)
+    dot_product(bicgstab_compute_shader, 1);
+
+    // Stage 2-3: Update the search direction p and compute v = A * p
+    bicgstab_compute_shader->set_int("stage", 2);
+    timed_dispatch(bicgstab_compute_shader, "BiCGSTAB stage 2: update search direction", num_work_groups, GL_SHADER_STORAGE_BARRIER_BIT);
+    bicgstab_compute_shader->set_int("stage", 3);
+    timed_dispatch(bicgstab_compute_shader, "BiCGSTAB stage 3: v = A * p", num_work_groups, GL_SHADER_STORAGE_BARRIER_BIT);
+
+    // Stage 4: Calculate dot(r_hat, v)
+    dot_product(bicgstab_compute_shader, 4);
+
+    // Stage 5-6: Compute s = r - alpha * v and t = A * s
+    bicgstab_compute_shader->set_int("stage", 5);
+    timed_dispatch(bicgstab_compute_shader, "BiCGSTAB stage 5: s = r - alpha * v", num_work_groups, GL_SHADER_STORAGE_BARRIER_BIT);
+    bicgstab_compute_shader->set_int("stage", 6);
+    timed_dispatch(bicgstab_compute_shader, "BiCGSTAB stage 6: t = A * s", num_work_groups, GL_SHADER_STORAGE_BARRIER_BIT);
+
+    // Stage 7-8: Calculate dot(t, s) and dot(t, t)
+    dot_product(bicgstab_compute_shader, 7);
+    dot_product(bicgstab_compute_shader, 8);
+
+    // Stage 9: Update u and r
+    bicgstab_compute_shader->set_int("stage", 9);
+    timed_dispatch(bicgstab_compute_shader, "BiCGSTAB stage 9: update u and r", num_work_groups, GL_SHADER_STORAGE_BARRIER_BIT);
+
+    // Stage 10: Calculate dot(r_(i+1), r_(i+1)) and check for convergence
+    dot_product(bicgstab_compute_shader, 10);
 }
 
 void GPUSolver::cgm_cleanup() {
     // Map solution vector to surface (# invocations = total_nodes)
     cgm_helper_compute_shader->bind();
     cgm_helper_compute_shader->set_int("stage", 3);
-    cgm_helper_compute_shader->dispatch_compute(fem_ctx->num_nodes() / 1024 + 1, 1, 1, GL_SHADER_STORAGE_BARRIER_BIT);
+    timed_dispatch(cgm_helper_compute_shader, "CG cleanup: map unknowns to surface", fem_ctx->num_nodes() / 1024 + 1, GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+/**
+ * Has the GPU copy the residual norm and iteration count of this time step into the next readback slot, behind a fence.
+ * Waits for the slot's previous time step if it is still in flight.
+ */
+void GPUSolver::queue_readback() {
+    int slot = next_readback;
+    if (readback_fences[slot])
+        finish_readback(slot);
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_COPY_READ_BUFFER, this->state);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, this->readback);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 1 * sizeof(float), slot * sizeof(Readback) + offsetof(Readback, residual_norm), sizeof(float));
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 10 * sizeof(float), slot * sizeof(Readback) + offsetof(Readback, iteration_count), sizeof(int));
+
+    readback_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    next_readback = (slot + 1) % NUM_READBACKS;
+}
+
+/**
+ * Reads every readback whose time step the GPU has finished, oldest first, without waiting
+ */
+void GPUSolver::poll_readbacks() {
+    for (int i = 0; i < NUM_READBACKS; i++) {
+        int slot = (next_readback + i) % NUM_READBACKS;
+        if (!readback_fences[slot])
+            continue;
+
+        GLenum status = glClientWaitSync(readback_fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+        finish_readback(slot);
+    }
+}
+
+/**
+ * Waits for a readback and stores its values in last_residual_norm and iterations
+ */
+void GPUSolver::finish_readback(int slot) {
+    while (glClientWaitSync(readback_fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+    glDeleteSync(readback_fences[slot]);
+    readback_fences[slot] = nullptr;
+
+    last_residual_norm = readback_map[slot].residual_norm;
+    iterations = readback_map[slot].iteration_count;
+}
+
+/**
+ * Drops the readbacks that are in flight, for when the values they would report no longer apply
+ */
+void GPUSolver::discard_readbacks() {
+    for (GLsync& fence : readback_fences) {
+        if (fence)
+            glDeleteSync(fence);
+        fence = nullptr;
+    }
+    last_residual_norm = 0.0f;
 }
\ No newline at end of file
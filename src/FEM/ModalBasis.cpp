@@ -0,0 +1,162 @@
+#include "FEM/ModalBasis.hpp"
+#include "Utils/Profiler.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <random>
+
+/**
+ * Computes the num_modes smallest eigenpairs with the shift-invert Lanczos method.
+ * Lanczos runs on inverse(K - shift * M) * M, which is symmetric in the M inner product and whose largest eigenvalues
+ * 1 / (lambda - shift) belong to the smallest lambda. The shift is slightly negative so that K - shift * M is positive
+ * definite even when K is singular, as it is on closed meshes and with Neumann boundary conditions.
+ * The Lanczos vectors are fully reorthogonalized, and everything is computed in double precision.
+ *
+ * A single Lanczos run finds only one eigenvector of each repeated eigenvalue, and those are common on symmetric meshes.
+ * So every Ritz pair whose residual is below TOLERANCE is locked, and Lanczos restarts from a new vector that is
+ * M-orthogonal to the locked eigenvectors, until a run finds nothing below the num_modes-th smallest locked eigenvalue.
+ * converged is false if that does not happen within MAX_RESTARTS runs, in which case the unconverged Ritz pairs of the
+ * last run fill in the missing modes.
+ *
+ * @param K The stiffness matrix, with both triangles stored
+ * @param M The mass matrix, with both triangles stored
+ * @param num_modes The number of eigenpairs to compute, which is reduced if there are fewer unknowns
+ */
+void ModalBasis::compute(const Eigen::SparseMatrix<float>& K, const Eigen::SparseMatrix<float>& M, int num_modes) {
+    ScopedTimer timer("ModalBasis::compute");
+    int n = K.rows();
+    num_modes = std::min(num_modes, n);
+
+    Eigen::SparseMatrix<double> K_d = K.cast<double>();
+    Eigen::SparseMatrix<double> M_d = M.cast<double>();
+    double K_norm = K_d.norm();
+    double M_norm = M_d.norm();
+
+    // Shift by a small fraction of the scale of the largest eigenvalues
+    double scale = 0.0;
+    for (int i = 0; i < n; i++)
+        scale = std::max(scale, K_d.coeff(i, i) / M_d.coeff(i, i));
+    double shift = -1e-5 * scale;
+
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> factorization(K_d - shift * M_d);
+
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<double> distribution(-1.0, 1.0);
+    auto random_vector = [&]() {
+        Eigen::VectorXd vector(n);
+        for (int i = 0; i < n; i++)
+            vector[i] = distribution(rng);
+        return vector;
+    };
+
+    // The relative residual ||K phi - lambda M phi|| / ((||K|| + |lambda| ||M||) ||phi||), which stays meaningful
+    // for the eigenvalue 0, whose K phi is only rounding error
+    auto residual = [&](double lambda, const Eigen::VectorXd& phi) {
+        return (K_d * phi - lambda * (M_d * phi)).norm() / ((K_norm + std::abs(lambda) * M_norm) * phi.norm());
+    };
+
+    std::vector<std::pair<double, Eigen::VectorXd>> locked; // Converged eigenpairs
+    std::vector<std::pair<double, Eigen::VectorXd>> unconverged; // The Ritz pairs of the last run that were not locked
+    Eigen::MatrixXd L(n, 0); // The locked eigenvectors, one per column
+
+    converged = false;
+    for (int restart = 0; restart < MAX_RESTARTS && !converged; restart++) {
+        int num_steps = std::min(n - static_cast<int>(L.cols()), 2 * num_modes + 20);
+        if (num_steps <= 0) {
+            converged = true;
+            break;
+        }
+
+        // Nothing below the num_modes-th smallest locked eigenvalue is left to find once this run's smallest Ritz value is above it
+        std::vector<double> locked_values;
+        for (auto& [value, vector] : locked)
+            locked_values.push_back(value);
+        std::sort(locked_values.begin(), locked_values.end());
+        double threshold = locked_values.size() >= num_modes ? locked_values[num_modes - 1] : std::numeric_limits<double>::infinity();
+
+        Eigen::MatrixXd Q(n, num_steps);
+        Eigen::VectorXd alpha = Eigen::VectorXd::Zero(num_steps);
+        Eigen::VectorXd beta = Eigen::VectorXd::Zero(num_steps);
+
+        // Removes the components of w along the locked eigenvectors and the first count Lanczos vectors, twice for numerical stability
+        auto reorthogonalize = [&](Eigen::VectorXd& w, int count) {
+            for (int pass = 0; pass < 2; pass++) {
+                Eigen::VectorXd Mw = M_d * w;
+                w -= L * (L.transpose() * Mw) + Q.leftCols(count) * (Q.leftCols(count).transpose() * Mw);
+            }
+        };
+
+        Eigen::VectorXd q = random_vector();
+        reorthogonalize(q, 0);
+        Q.col(0) = q / std::sqrt(q.dot(M_d * q));
+
+        for (int j = 0; j < num_steps; j++) {
+            Eigen::VectorXd w = factorization.solve(M_d * Q.col(j));
+            alpha[j] = Q.col(j).dot(M_d * w);
+            if (j + 1 == num_steps)
+                break;
+            reorthogonalize(w, j + 1);
+
+            double w_norm = std::sqrt(std::max(w.dot(M_d * w), 0.0));
+            if (w_norm < 1e-10 * std::abs(alpha[j])) {
+                // The Lanczos vectors span an invariant subspace, so continue from a new direction
+                w = random_vector();
+                reorthogonalize(w, j + 1);
+                w_norm = std::sqrt(w.dot(M_d * w));
+                beta[j] = 0.0;
+            } else {
+                beta[j] = w_norm;
+            }
+            Q.col(j + 1) = w / w_norm;
+        }
+
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> tridiagonal_solver;
+        tridiagonal_solver.computeFromTridiagonal(alpha, beta.head(num_steps - 1));
+
+        // The largest Ritz values of the shift-inverted operator are the smallest eigenvalues, and come last
+        unconverged.clear();
+        double smallest = std::numeric_limits<double>::infinity();
+        int num_locked = 0;
+        for (int ritz = num_steps - 1; ritz >= 0; ritz--) {
+            double lambda = shift + 1.0 / tridiagonal_solver.eigenvalues()[ritz];
+            Eigen::VectorXd phi = Q * tridiagonal_solver.eigenvectors().col(ritz);
+            smallest = std::min(smallest, lambda);
+
+            if (residual(lambda, phi) <= TOLERANCE) {
+                locked.push_back({lambda, phi});
+                num_locked++;
+            } else {
+                unconverged.push_back({lambda, phi});
+            }
+        }
+        L.conservativeResize(n, locked.size());
+        for (int i = 0; i < num_locked; i++)
+            L.col(locked.size() - num_locked + i) = locked[locked.size() - num_locked + i].second;
+
+        converged = locked.size() >= num_modes && smallest >= threshold - 1e-9 * scale;
+    }
+
+    // Fill in with the unconverged Ritz pairs if too few converged, then keep the num_modes smallest
+    std::vector<std::pair<double, Eigen::VectorXd>> pairs = locked;
+    pairs.insert(pairs.end(), unconverged.begin(), unconverged.end());
+    std::sort(pairs.begin(), pairs.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    if (locked.size() < num_modes)
+        converged = false;
+
+    num_modes = std::min(num_modes, static_cast<int>(pairs.size()));
+    eigenvalues.resize(num_modes);
+    eigenvectors.resize(n, num_modes);
+    max_residual = 0.0f;
+    for (int mode = 0; mode < num_modes; mode++) {
+        eigenvalues[mode] = static_cast<float>(pairs[mode].first);
+        eigenvectors.col(mode) = pairs[mode].second.cast<float>();
+        max_residual = std::max(max_residual, static_cast<float>(residual(pairs[mode].first, pairs[mode].second)));
+    }
+}
+
+/**
+ * Returns the number of modes in the basis
+ */
+int ModalBasis::size() const {
+    return eigenvalues.size();
+}
\ No newline at end of file
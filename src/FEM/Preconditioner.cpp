@@ -0,0 +1,237 @@
+#include "FEM/Preconditioner.hpp"
+
+#include <cmath>
+
+/**
+ * Groups the unknowns of a symmetric matrix into aggregates of strongly connected unknowns, in three passes.
+ * First, every unknown whose strong neighbors are all unaggregated forms an aggregate with them.
+ * Then, each remaining unknown joins the aggregate of its most strongly connected neighbor from the first pass.
+ * Finally, anything left forms new aggregates with its remaining strong neighbors.
+ *
+ * @param A The matrix to aggregate, with both triangles stored
+ * @param strength_threshold An off-diagonal entry a_ij is a strong connection if |a_ij| >= strength_threshold * sqrt(|a_ii * a_jj|)
+ * @param num_aggregates Set to the number of aggregates
+ * @return The aggregate of every unknown
+ */
+std::vector<int> Multigrid::aggregate(const Eigen::SparseMatrix<float>& A, float strength_threshold, int& num_aggregates) {
+    int n = A.rows();
+    Eigen::VectorXf diagonal = A.diagonal();
+    auto is_strong = [&](int i, int j, float a_ij) {
+        return i != j && std::abs(a_ij) >= strength_threshold * std::sqrt(std::abs(diagonal[i] * diagonal[j]));
+    };
+
+    std::vector<int> aggregates(n, -1);
+    num_aggregates = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (aggregates[i] != -1) continue;
+
+        bool neighbors_free = true;
+        for (Eigen::SparseMatrix<float>::InnerIterator it(A, i); it; ++it)
+            if (is_strong(i, it.row(), it.value()) && aggregates[it.row()] != -1)
+                neighbors_free = false;
+        if (!neighbors_free) continue;
+
+        aggregates[i] = num_aggregates;
+        for (Eigen::SparseMatrix<float>::InnerIterator it(A, i); it; ++it)
+            if (is_strong(i, it.row(), it.value()))
+                aggregates[it.row()] = num_aggregates;
+        num_aggregates++;
+    }
+
+    std::vector<int> first_pass = aggregates;
+    for (int i = 0; i < n; i++) {
+        if (aggregates[i] != -1) continue;
+
+        float strongest = 0.0f;
+        for (Eigen::SparseMatrix<float>::InnerIterator it(A, i); it; ++it) {
+            if (is_strong(i, it.row(), it.value()) && first_pass[it.row()] != -1 && std::abs(it.value()) > strongest) {
+                strongest = std::abs(it.value());
+                aggregates[i] = first_pass[it.row()];
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (aggregates[i] != -1) continue;
+
+        aggregates[i] = num_aggregates;
+        for (Eigen::SparseMatrix<float>::InnerIterator it(A, i); it; ++it)
+            if (is_strong(i, it.row(), it.value()) && aggregates[it.row()] == -1)
+                aggregates[it.row()] = num_aggregates;
+        num_aggregates++;
+    }
+
+    return aggregates;
+}
+
+/**
+ * Sets the Jacobi smoother of a level, with the damping factor 4 / (3 * rho) where rho is a
+ * Gershgorin bound on the spectral radius of inverse(D) * A
+ */
+void Multigrid::set_smoother(MultigridLevel& level) {
+    level.inverse_diagonal = level.A.diagonal().cwiseInverse();
+
+    float spectral_bound = 0.0f;
+    for (int j = 0; j < level.A.cols(); j++) {
+        float column_sum = 0.0f;
+        for (Eigen::SparseMatrix<float>::InnerIterator it(level.A, j); it; ++it)
+            column_sum += std::abs(it.value());
+        spectral_bound = std::max(spectral_bound, column_sum * level.inverse_diagonal[j]);
+    }
+    level.smoother_weight = 4.0f / (3.0f * spectral_bound);
+}
+
+/**
+ * Adds a level below the current coarsest one, with the Galerkin product of the prolongation P from it
+ */
+void Multigrid::add_coarse_level(const Eigen::SparseMatrix<float>& P) {
+    MultigridLevel& level = levels.back();
+    level.P = P;
+    level.R = P.transpose();
+
+    Eigen::SparseMatrix<float> coarse_A = level.R * (level.A * level.P);
+    levels.push_back({coarse_A});
+}
+
+/**
+ * Builds an algebraic multigrid hierarchy for a symmetric positive definite matrix by smoothed aggregation.
+ * The prolongation smoother uses the same damping factor as the Jacobi smoother.
+ *
+ * @param A The matrix to precondition, with both triangles stored
+ */
+void Multigrid::build_algebraic(const Eigen::SparseMatrix<float>& A) {
+    levels.clear();
+    levels.push_back({A});
+
+    while (levels.size() < max_levels && levels.back().A.rows() > coarsest_size) {
+        MultigridLevel& level = levels.back();
+        int n = level.A.rows();
+        set_smoother(level);
+
+        int num_aggregates;
+        std::vector<int> aggregates = aggregate(level.A, strength_threshold, num_aggregates);
+        if (num_aggregates == n)
+            break;
+
+        // The piecewise constant prolongation, smoothed by one damped Jacobi step
+        Eigen::SparseMatrix<float> tentative(n, num_aggregates);
+        std::vector<Eigen::Triplet<float>> triplets;
+        triplets.reserve(n);
+        for (int i = 0; i < n; i++)
+            triplets.emplace_back(i, aggregates[i], 1.0f);
+        tentative.setFromTriplets(triplets.begin(), triplets.end());
+
+        Eigen::SparseMatrix<float> jacobi_step = level.inverse_diagonal.asDiagonal() * (level.A * tentative);
+        add_coarse_level(tentative - level.smoother_weight * jacobi_step);
+    }
+
+    coarsest_solver.compute(levels.back().A);
+}
+
+/**
+ * Builds a geometric multigrid hierarchy for a symmetric positive definite matrix from the prolongations between a
+ * sequence of nested meshes. Levels stop being added once the coarsest has at most coarsest_size unknowns.
+ *
+ * @param A The matrix to precondition, with both triangles stored
+ * @param prolongations The prolongation onto each level from the next coarser one, finest first
+ */
+void Multigrid::build_geometric(const Eigen::SparseMatrix<float>& A, const std::vector<Eigen::SparseMatrix<float>>& prolongations) {
+    levels.clear();
+    levels.push_back({A});
+
+    for (const Eigen::SparseMatrix<float>& P : prolongations) {
+        if (levels.back().A.rows() <= coarsest_size)
+            break;
+        set_smoother(levels.back());
+        add_coarse_level(P);
+    }
+
+    coarsest_solver.compute(levels.back().A);
+}
+
+/**
+ * Applies one V-cycle to b, starting from zero
+ */
+Eigen::VectorXf Multigrid::apply(const Eigen::VectorXf& b) const {
+    Eigen::VectorXf x;
+    v_cycle(0, b, x);
+    return x;
+}
+
+/**
+ * Returns the number of levels in the hierarchy, including the finest and the coarsest
+ */
+int Multigrid::num_levels() const {
+    return levels.size();
+}
+
+/**
+ * Approximately solves A x = b on a level, with Jacobi smoothing around a correction from the next coarser level
+ */
+void Multigrid::v_cycle(int level, const Eigen::VectorXf& b, Eigen::VectorXf& x) const {
+    if (level == levels.size() - 1) {
+        x = coarsest_solver.solve(b);
+        return;
+    }
+
+    const MultigridLevel& current = levels[level];
+    x = current.smoother_weight * current.inverse_diagonal.cwiseProduct(b);
+    for (int step = 1; step < smoothing_steps; step++)
+        x += current.smoother_weight * current.inverse_diagonal.cwiseProduct(b - current.A * x);
+
+    Eigen::VectorXf coarse_x;
+    v_cycle(level + 1, current.R * (b - current.A * x), coarse_x);
+    x += current.P * coarse_x;
+
+    for (int step = 0; step < smoothing_steps; step++)
+        x += current.smoother_weight * current.inverse_diagonal.cwiseProduct(b - current.A * x);
+}
+
+/**
+ * Builds the selected preconditioner for a matrix
+ */
+void Preconditioner::build(const Eigen::SparseMatrix<float>& A) {
+    status = Eigen::Success;
+
+    switch (type) {
+        case PreconditionerType::Jacobi: {
+            inverse_diagonal = A.diagonal();
+            for (int i = 0; i < inverse_diagonal.size(); i++)
+                inverse_diagonal[i] = inverse_diagonal[i] != 0.0f ? 1.0f / inverse_diagonal[i] : 1.0f;
+        } break;
+        case PreconditionerType::Incomplete_Cholesky: {
+            incomplete_cholesky.compute(A);
+            status = incomplete_cholesky.info();
+        } break;
+        case PreconditionerType::Algebraic_Multigrid: {
+            multigrid.build_algebraic(A);
+        } break;
+        case PreconditionerType::Geometric_Multigrid: {
+            if (prolongations != nullptr && !prolongations->empty())
+                multigrid.build_geometric(A, *prolongations);
+            else
+                multigrid.build_algebraic(A);
+        } break;
+    }
+}
+
+/**
+ * Applies the inverse of the preconditioner to a vector
+ */
+Eigen::VectorXf Preconditioner::solve(const Eigen::VectorXf& b) const {
+    switch (type) {
+        case PreconditionerType::Incomplete_Cholesky:
+            return incomplete_cholesky.solve(b);
+        case PreconditionerType::Algebraic_Multigrid:
+        case PreconditionerType::Geometric_Multigrid:
+            return multigrid.apply(b);
+        case PreconditionerType::Jacobi:
+        default:
+            return inverse_diagonal.cwiseProduct(b);
+    }
+}
+
+Eigen::ComputationInfo Preconditioner::info() const {
+    return status;
+}
\ No newline at end of file
@@ -0,0 +1,154 @@
+#include "FEM/SimulationThread.hpp"
+#include "Utils/Profiler.hpp"
+
+/**
+ * Starts a paused worker thread for a solver
+ */
+SimulationThread::SimulationThread(std::shared_ptr<Solver> solver) {
+    this->solver = solver;
+    worker = std::thread(&SimulationThread::run, this);
+}
+
+/**
+ * Stops the worker thread after its current time step
+ */
+SimulationThread::~SimulationThread() {
+    {
+        std::lock_guard<std::mutex> guard(state_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    worker.join();
+}
+
+/**
+ * Locks the simulation state, which is required before reading or changing the solver, its FEMContext, or the values on the surface.
+ * The worker does not start another time step while any thread is waiting here.
+ */
+std::unique_lock<std::mutex> SimulationThread::lock() {
+    waiting++;
+    std::unique_lock<std::mutex> guard(state_mutex);
+    waiting--;
+    return guard;
+}
+
+/**
+ * Starts or pauses the worker. The simulation state must be locked.
+ * Pausing discards values that have not been taken yet, since the surface's own values are current while paused.
+ */
+void SimulationThread::set_running(bool running) {
+    if (this->running == running)
+        return;
+
+    this->running = running;
+    if (!running) {
+        measured_rate = 0.0f;
+        std::lock_guard<std::mutex> guard(values_mutex);
+        fresh_values = false;
+    }
+    wake.notify_all();
+}
+
+/**
+ * Returns whether the worker is taking time steps. The simulation state must be locked.
+ */
+bool SimulationThread::is_running() {
+    return running;
+}
+
+/**
+ * Swaps the values from the latest time step into a vector, if there have been any since the last call
+ *
+ * @param values Receives the values, and gives its storage back to be reused
+ * @return Whether new values were swapped in
+ */
+bool SimulationThread::take_values(std::vector<float>& values) {
+    std::lock_guard<std::mutex> guard(values_mutex);
+    if (!fresh_values)
+        return false;
+
+    values.swap(shared_values);
+    fresh_values = false;
+    return true;
+}
+
+/**
+ * Returns true once after the worker has paused itself because of numerical instability. The simulation state must be locked.
+ */
+bool SimulationThread::take_instability() {
+    bool was_unstable = unstable;
+    unstable = false;
+    return was_unstable;
+}
+
+/**
+ * Returns the number of time steps taken over about the last second
+ */
+float SimulationThread::measured_steps_per_second() {
+    return measured_rate;
+}
+
+/**
+ * The worker's loop. Each time step is taken with the simulation state locked, then the lock is released
+ * while waiting for the next step to be due.
+ */
+void SimulationThread::run() {
+    Profiler::get().name_current_thread("Simulation");
+    using clock = std::chrono::steady_clock;
+    clock::time_point next_step = clock::now();
+    clock::time_point rate_start = clock::now();
+    int rate_steps = 0;
+    float rate = 0.0f;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(state_mutex);
+            wake.wait(guard, [this] { return stopping || running; });
+            if (stopping)
+                break;
+
+            if (!solver->fem_ctx->surface) {
+                running = false;
+                continue;
+            }
+
+            // Give way to the main thread, which will have the lock once this one is released
+            if (waiting > 0) {
+                guard.unlock();
+                std::this_thread::yield();
+                continue;
+            }
+
+            rate = steps_per_second;
+            solver->advance_time();
+            if (solver->has_numerical_instability()) {
+                unstable = true;
+                running = false;
+                continue;
+            }
+
+            std::lock_guard<std::mutex> values_guard(values_mutex);
+            shared_values = solver->fem_ctx->surface->values;
+            fresh_values = true;
+        }
+
+        rate_steps++;
+        clock::time_point now = clock::now();
+        if (now - rate_start >= std::chrono::seconds(1)) {
+            measured_rate = rate_steps / std::chrono::duration<float>(now - rate_start).count();
+            rate_start = now;
+            rate_steps = 0;
+        }
+
+        if (rate > 0.0f) {
+            // Keep to the target rate, but do not try to catch up after falling more than a quarter second behind
+            next_step += std::chrono::duration_cast<clock::duration>(std::chrono::duration<float>(1.0f / rate));
+            if (next_step < now - std::chrono::milliseconds(250))
+                next_step = now;
+            std::this_thread::sleep_until(next_step);
+        } else {
+            next_step = now;
+            std::this_thread::yield();
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,306 @@
+#include "FEM/CPUSolver.hpp"
+#include "Utils/Surface.hpp"
+#include "Utils/Profiler.hpp"
+
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Runs a simulation with the CPUSolver from the command line, with no window or OpenGL context.
+ * Intended for parameter sweeps on machines without a display, and for CI.
+ *
+ * Example:
+ *   fea_headless --mesh assets/fem_meshes/icosphere.obj --equation heat --set conductivity=0.1 --bump 0,1,0,0.3,1 --steps 500 --output out/heat --output-every 50
+ */
+
+const char* USAGE =
+    "Usage: fea_headless --mesh <file.obj|file.poly> [options]\n"
+    "\n"
+    "Mesh\n"
+    "  --mesh <path>               A .obj surface, or a .poly PSLG that is triangulated on the XZ plane\n"
+    "  --area <value>              The maximum triangle area when triangulating a .poly file (default 0.001)\n"
+    "\n"
+    "Simulation\n"
+    "  --equation <name>           heat, wave, advection-diffusion or reaction-diffusion (default heat)\n"
+    "  --steps <count>             The number of time steps to take (default 100)\n"
+    "  --set <name>=<value>        Set an equation parameter: time_step, conductivity, c, velocity_x, velocity_y, velocity_z,\n"
+    "                              Du, Dv, feed_rate or kill_rate. May be repeated\n"
+    "  --bump <x,y,z,radius,value> Set the initial value of every vertex within radius of a point. May be repeated\n"
+    "\n"
+    "Solver\n"
+    "  --boundary <name>           dirichlet or neumann (default dirichlet)\n"
+    "  --node-ordering <name>      vertex, or rcm to renumber the unknowns with Reverse Cuthill-McKee (default vertex)\n"
+    "  --integrator <name>         implicit, forward-euler, rk4, spectral, crank-nicolson or bdf2 (default implicit)\n"
+    "  --linear-solver <name>      iterative or direct (default iterative)\n"
+    "  --preconditioner <name>     jacobi, ichol, amg or gmg (default jacobi)\n"
+    "  --matrix-free               Apply the FEM operators element by element instead of assembling matrices\n"
+    "  --lumped-mass               Use the lumped mass matrix\n"
+    "  --adaptive <tolerance>      Adapt the time step so the estimated error of each step stays near tolerance\n"
+    "\n"
+    "Output\n"
+    "  --output <prefix>           Write the values after the last step to <prefix>_<step>.csv, as rows of x,y,z,value\n"
+    "  --output-every <count>      Also write the values every count steps, starting with the initial values\n"
+    "  --trace <file.json>         Record the time spent in assembly and each solver phase, and write it as a Chrome trace\n";
+
+/**
+ * Returns the index of a name in a list of names, or throws if it is not in the list
+ */
+int parse_choice(const std::string& option, const std::string& name, const std::vector<std::string>& choices) {
+    for (int i = 0; i < choices.size(); i++)
+        if (choices[i] == name)
+            return i;
+
+    std::string message = std::format("Unknown value '{}' for {}. Expected one of:", name, option);
+    for (const std::string& choice : choices)
+        message += " " + choice;
+    throw std::runtime_error(message);
+}
+
+/**
+ * Parses a number, or throws if the whole string is not one
+ */
+float parse_number(const std::string& option, const std::string& text) {
+    try {
+        size_t length;
+        float value = std::stof(text, &length);
+        if (length == text.size())
+            return value;
+    } catch (std::exception&) {}
+    throw std::runtime_error(std::format("Expected a number for {}, got '{}'.", option, text));
+}
+
+/**
+ * Sets an equation parameter by name, or throws if the selected equation does not have it
+ */
+void set_parameter(FEMContext& fem_ctx, const std::string& name, float value) {
+    std::shared_ptr<EquationParameters> params = fem_ctx.parameters[fem_ctx.equation];
+    if (name == "time_step") {
+        params->time_step = value;
+        return;
+    }
+
+    switch (fem_ctx.equation) {
+        case Equation::Heat: {
+            auto heat = std::static_pointer_cast<HeatParameters>(params);
+            if (name == "conductivity") { heat->conductivity = value; return; }
+            break;
+        }
+        case Equation::Wave: {
+            auto wave = std::static_pointer_cast<WaveParameters>(params);
+            if (name == "c") { wave->c = value; return; }
+            break;
+        }
+        case Equation::Advection_Diffusion: {
+            auto advection_diffusion = std::static_pointer_cast<AdvectionDiffusionParameters>(params);
+            if (name == "c") { advection_diffusion->c = value; return; }
+            if (name == "velocity_x") { advection_diffusion->velocity.x() = value; return; }
+            if (name == "velocity_y") { advection_diffusion->velocity.y() = value; return; }
+            if (name == "velocity_z") { advection_diffusion->velocity.z() = value; return; }
+            break;
+        }
+        case Equation::Reaction_Diffusion: {
+            auto reaction_diffusion = std::static_pointer_cast<ReactionDiffusionParameters>(params);
+            if (name == "Du") { reaction_diffusion->Du = value; return; }
+            if (name == "Dv") { reaction_diffusion->Dv = value; return; }
+            if (name == "feed_rate") { reaction_diffusion->feed_rate = value; return; }
+            if (name == "kill_rate") { reaction_diffusion->kill_rate = value; return; }
+            break;
+        }
+    }
+    throw std::runtime_error(std::format("The selected equation has no parameter named '{}'.", name));
+}
+
+/**
+ * Writes the position and value of every vertex of the surface to a .csv file
+ */
+void write_values(const Surface& surface, const std::string& file_path) {
+    std::ofstream file(file_path);
+    if (!file)
+        throw std::runtime_error(std::format("Could not open {} for writing.", file_path));
+
+    file << "x,y,z,value\n";
+    for (int i = 0; i < surface.vertices.size(); i++) {
+        const glm::vec3& vertex = surface.vertices[i];
+        file << std::format("{},{},{},{}\n", vertex.x, vertex.y, vertex.z, surface.values[i]);
+    }
+}
+
+int run(int argc, char** argv) {
+    std::string mesh_path, output_prefix, trace_path;
+    float triangle_area = 0.001f;
+    int num_steps = 100;
+    int output_every = 0;
+    std::vector<std::pair<std::string, float>> parameter_values;
+    std::vector<std::array<float, 5>> bumps;
+
+    auto fem_ctx = std::make_shared<FEMContext>();
+    auto solver = std::make_shared<CPUSolver>(fem_ctx);
+    fem_ctx->equation = Equation::Heat;
+
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--help" || option == "-h") {
+            std::cout << USAGE;
+            return 0;
+        }
+
+        if (option == "--matrix-free") {
+            fem_ctx->matrix_free = true;
+            continue;
+        } else if (option == "--lumped-mass") {
+            fem_ctx->lump_mass = true;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+            throw std::runtime_error(std::format("Expected a value after {}. Use --help for the list of options.", option));
+        std::string value = argv[++i];
+
+        if (option == "--mesh") {
+            mesh_path = value;
+        } else if (option == "--area") {
+            triangle_area = parse_number(option, value);
+        } else if (option == "--equation") {
+            fem_ctx->equation = static_cast<Equation>(parse_choice(option, value, {"heat", "wave", "advection-diffusion", "reaction-diffusion"}));
+        } else if (option == "--steps") {
+            num_steps = static_cast<int>(parse_number(option, value));
+        } else if (option == "--set") {
+            size_t equals = value.find('=');
+            if (equals == std::string::npos)
+                throw std::runtime_error(std::format("Expected name=value for --set, got '{}'.", value));
+            parameter_values.push_back({value.substr(0, equals), parse_number(option, value.substr(equals + 1))});
+        } else if (option == "--bump") {
+            std::array<float, 5> bump;
+            std::istringstream fields(value);
+            std::string field;
+            int count = 0;
+            while (std::getline(fields, field, ',')) {
+                if (count == 5)
+                    break;
+                bump[count++] = parse_number(option, field);
+            }
+            if (count != 5 || std::getline(fields, field, ','))
+                throw std::runtime_error(std::format("Expected x,y,z,radius,value for --bump, got '{}'.", value));
+            bumps.push_back(bump);
+        } else if (option == "--boundary") {
+            fem_ctx->boundary_condition = static_cast<BoundaryCondition>(parse_choice(option, value, {"dirichlet", "neumann"}));
+        } else if (option == "--node-ordering") {
+            fem_ctx->node_ordering = static_cast<NodeOrdering>(parse_choice(option, value, {"vertex", "rcm"}));
+        } else if (option == "--integrator") {
+            solver->time_integrator = static_cast<TimeIntegrator>(parse_choice(option, value, {"implicit", "forward-euler", "rk4", "spectral", "crank-nicolson", "bdf2"}));
+        } else if (option == "--linear-solver") {
+            solver->linear_solver = static_cast<LinearSolver>(parse_choice(option, value, {"iterative", "direct"}));
+        } else if (option == "--preconditioner") {
+            solver->preconditioner = static_cast<PreconditionerType>(parse_choice(option, value, {"jacobi", "ichol", "amg", "gmg"}));
+        } else if (option == "--adaptive") {
+            solver->adaptive_time_step = true;
+            solver->tolerance = parse_number(option, value);
+        } else if (option == "--output") {
+            output_prefix = value;
+        } else if (option == "--output-every") {
+            output_every = static_cast<int>(parse_number(option, value));
+        } else if (option == "--trace") {
+            trace_path = value;
+        } else {
+            throw std::runtime_error(std::format("Unknown option {}. Use --help for the list of options.", option));
+        }
+    }
+
+    if (mesh_path.empty())
+        throw std::runtime_error("A mesh is required. Use --help for the list of options.");
+    for (auto& [name, value] : parameter_values)
+        set_parameter(*fem_ctx, name, value);
+
+    Profiler::get().name_current_thread("Main");
+    Profiler::get().set_enabled(!trace_path.empty());
+
+    auto surface = std::make_shared<Surface>();
+    std::string extension = std::filesystem::path(mesh_path).extension().string();
+    surface->build_hierarchy = solver->preconditioner == PreconditionerType::Geometric_Multigrid;
+    if (extension == ".poly")
+        surface->init_from_poly(mesh_path.c_str(), triangle_area);
+    else
+        surface->init_from_obj(mesh_path.c_str());
+
+    for (const std::array<float, 5>& bump : bumps) {
+        glm::vec3 center(bump[0], bump[1], bump[2]);
+        for (int i = 0; i < surface->vertices.size(); i++)
+            if (glm::distance(surface->vertices[i], center) <= bump[3])
+                surface->values[i] = bump[4];
+    }
+
+    auto load_start = std::chrono::steady_clock::now();
+    fem_ctx->init_from_surface(surface);
+    solver->clear_values();
+    float setup_seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - load_start).count();
+
+    std::cout << std::format("Mesh: {} ({} vertices, {} triangles, {} unknowns)\n", mesh_path, surface->vertices.size(), surface->triangles.size(), fem_ctx->num_unknowns());
+    std::cout << std::format("Assembly: {:.3f} s\n", setup_seconds);
+
+    auto write_step = [&](int step) {
+        if (output_prefix.empty())
+            return;
+        std::filesystem::path path(std::format("{}_{:06}.csv", output_prefix, step));
+        if (path.has_parent_path())
+            std::filesystem::create_directories(path.parent_path());
+        write_values(*surface, path.string());
+    };
+
+    if (output_every > 0)
+        write_step(0);
+
+    float simulated_time = 0.0f;
+    long long total_iterations = 0;
+    auto solve_start = std::chrono::steady_clock::now();
+    int step = 0;
+    while (step < num_steps) {
+        solver->advance_time();
+        step++;
+        simulated_time += solver->simulated_time_step;
+        total_iterations += solver->iterations;
+
+        if (solver->has_numerical_instability()) {
+            std::cerr << std::format("Numerical instability detected at step {}.\n", step);
+            write_step(step);
+            return 1;
+        }
+        if (output_every > 0 && step % output_every == 0)
+            write_step(step);
+    }
+    float solve_seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - solve_start).count();
+
+    if (output_every <= 0 || step % output_every != 0)
+        write_step(step);
+    if (!trace_path.empty())
+        Profiler::get().write_chrome_trace(trace_path.c_str());
+
+    float min_value = std::numeric_limits<float>::max(), max_value = std::numeric_limits<float>::lowest();
+    double sum = 0.0;
+    for (float value : surface->values) {
+        min_value = std::min(min_value, value);
+        max_value = std::max(max_value, value);
+        sum += value;
+    }
+
+    std::cout << std::format("Steps: {} ({:.4f} s of simulated time)\n", step, simulated_time);
+    std::cout << std::format("Solve: {:.3f} s ({:.3f} ms per step, {:.1f} solver iterations per step)\n", solve_seconds, 1000.0f * solve_seconds / std::max(step, 1), static_cast<double>(total_iterations) / std::max(step, 1));
+    std::cout << std::format("Values: min {}, max {}, mean {}\n", min_value, max_value, surface->values.empty() ? 0.0 : sum / surface->values.size());
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    try {
+        return run(argc, argv);
+    } catch (std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}
\ No newline at end of file
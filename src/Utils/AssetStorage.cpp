@@ -133,6 +133,7 @@ void AssetStorage::load_shaders() {
 
     shaders.add("cgm", std::make_shared<ComputeShader>("shaders/FEM/cgm.glsl"));
     shaders.add("cgm_helper", std::make_shared<ComputeShader>("shaders/FEM/cgm_helper.glsl"));
+    shaders.add("bicgstab", std::make_shared<ComputeShader>("shaders/FEM/bicgstab.glsl"));
     shaders.add("smooth_normals", std::make_shared<ComputeShader>("shaders/FEM/smooth_normals.glsl"));
 }
 
@@ -1,4 +1,5 @@
 #include "Utils/BVH.hpp"
+#include "Utils/Profiler.hpp"
 
 #include <algorithm>
 #include <limits>
@@ -22,6 +23,7 @@ BVH::BVH(std::shared_ptr<Surface> surface, int max_depth) :
  * @param direction The direction of the ray.
  */
 RayTriangleIntersection BVH::ray_triangle_intersection(glm::vec3 origin, glm::vec3 direction) {
+    ScopedTimer timer("BVH::ray_triangle_intersection");
     std::vector<RayTriangleIntersection> intersections;
     ray_triangle_intersection(origin, direction, root, intersections);
 
@@ -0,0 +1,72 @@
+#include <glad/glad.h>
+
+#include "Utils/GPUTimer.hpp"
+#include "Utils/Profiler.hpp"
+
+#include <algorithm>
+
+GPUTimer::~GPUTimer() {
+    for (PendingQuery& pending_query : pending)
+        free_queries.push_back(pending_query.query);
+    if (!free_queries.empty())
+        glDeleteQueries(free_queries.size(), free_queries.data());
+}
+
+/**
+ * Starts timing the GPU commands that follow
+ *
+ * @param name The name to record the interval under
+ */
+void GPUTimer::begin(const char* name) {
+    Profiler& profiler = Profiler::get();
+    if (!profiler.is_enabled() || timing)
+        return;
+
+    if (free_queries.empty()) {
+        free_queries.resize(16);
+        glGenQueries(free_queries.size(), free_queries.data());
+    }
+    unsigned int query = free_queries.back();
+    free_queries.pop_back();
+
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    pending.push_back({query, name, profiler.now()});
+    timing = true;
+}
+
+/**
+ * Stops timing the interval started by begin()
+ */
+void GPUTimer::end() {
+    if (!timing)
+        return;
+    glEndQuery(GL_TIME_ELAPSED);
+    timing = false;
+}
+
+/**
+ * Records every interval whose result is available.
+ * The GPU runs commands in order, so each interval is placed on the GPU track at its submission time or at the end
+ * of the previous interval, whichever is later.
+ */
+void GPUTimer::collect() {
+    Profiler& profiler = Profiler::get();
+    while (!pending.empty() && !(timing && pending.size() == 1)) {
+        PendingQuery& front = pending.front();
+        GLint available = 0;
+        glGetQueryObjectiv(front.query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break;
+
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(front.query, GL_QUERY_RESULT, &nanoseconds);
+        double start = std::max(front.submitted, gpu_time);
+        double duration = nanoseconds / 1000.0;
+        if (profiler.is_enabled())
+            profiler.record(front.name, Profiler::GPU_TRACK, start, duration);
+        gpu_time = start + duration;
+
+        free_queries.push_back(front.query);
+        pending.pop_front();
+    }
+}
\ No newline at end of file
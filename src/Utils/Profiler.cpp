@@ -0,0 +1,153 @@
+#include "Utils/Profiler.hpp"
+
+#include <algorithm>
+#include <format>
+#include <fstream>
+#include <stdexcept>
+
+/**
+ * Returns the profiler shared by the whole program
+ */
+Profiler& Profiler::get() {
+    static Profiler profiler;
+    return profiler;
+}
+
+/**
+ * Starts or stops recording. Intervals that are in progress when recording starts are not recorded.
+ */
+void Profiler::set_enabled(bool enabled) {
+    this->enabled = enabled;
+}
+
+bool Profiler::is_enabled() const {
+    return enabled.load(std::memory_order_relaxed);
+}
+
+/**
+ * Returns the current time in microseconds since the profiler was created
+ */
+double Profiler::now() const {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+/**
+ * Returns the trace track of the calling thread, assigning one the first time a thread asks
+ */
+int Profiler::current_track() {
+    thread_local int track = -1;
+    if (track == -1) {
+        std::lock_guard<std::mutex> guard(mutex);
+        track = next_track++;
+        track_names[track] = std::format("Thread {}", track);
+    }
+    return track;
+}
+
+/**
+ * Names the calling thread's track in the trace
+ */
+void Profiler::name_current_thread(const std::string& name) {
+    int track = current_track();
+    std::lock_guard<std::mutex> guard(mutex);
+    track_names[track] = name;
+}
+
+/**
+ * Records a timed interval
+ *
+ * @param name The name of the interval. Intervals with the same name are summarized together
+ * @param track The thread's track, from current_track(), or GPU_TRACK
+ * @param start The start of the interval, from now()
+ * @param duration The length of the interval in microseconds
+ */
+void Profiler::record(const std::string& name, int track, double start, double duration) {
+    std::lock_guard<std::mutex> guard(mutex);
+    events.push_back({name, track, start, duration});
+    if (events.size() > MAX_EVENTS)
+        events.pop_front();
+
+    RollingSamples& rolling = samples[name];
+    int slot = rolling.count % SAMPLES_PER_SUMMARY;
+    rolling.track = track;
+    rolling.durations[slot] = static_cast<float>(duration / 1000.0);
+    rolling.starts[slot] = start;
+    rolling.count++;
+}
+
+/**
+ * Returns statistics over the most recent intervals of every name that has been recorded, sorted by name
+ */
+std::vector<ProfileSummary> Profiler::summaries() {
+    std::lock_guard<std::mutex> guard(mutex);
+    std::vector<ProfileSummary> out;
+    for (auto& [name, rolling] : samples) {
+        int count = std::min(rolling.count, SAMPLES_PER_SUMMARY);
+        int last = (rolling.count - 1) % SAMPLES_PER_SUMMARY;
+        int oldest = rolling.count > SAMPLES_PER_SUMMARY ? rolling.count % SAMPLES_PER_SUMMARY : 0;
+
+        ProfileSummary summary = {name, rolling.track, rolling.durations[last], 0.0f, 0.0f, 0.0f};
+        for (int i = 0; i < count; i++) {
+            summary.mean += rolling.durations[i] / count;
+            summary.max = std::max(summary.max, rolling.durations[i]);
+        }
+
+        double span = rolling.starts[last] - rolling.starts[oldest];
+        if (count > 1 && span > 0.0)
+            summary.calls_per_second = static_cast<float>((count - 1) / (span / 1e6));
+        out.push_back(summary);
+    }
+    return out;
+}
+
+/**
+ * Writes the recorded intervals as a Chrome trace_event JSON file
+ */
+void Profiler::write_chrome_trace(const char* file_path) {
+    std::ofstream file(file_path);
+    if (!file)
+        throw std::runtime_error(std::format("Could not open {} for writing.", file_path));
+
+    auto escape = [](const std::string& text) {
+        std::string escaped;
+        for (char c : text) {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+            escaped += c;
+        }
+        return escaped;
+    };
+
+    std::lock_guard<std::mutex> guard(mutex);
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    file << std::format("{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": {}, \"args\": {{\"name\": \"GPU\"}}}}", GPU_TRACK);
+    for (auto& [track, name] : track_names)
+        file << std::format(",\n{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": {}, \"args\": {{\"name\": \"{}\"}}}}", track, escape(name));
+    for (const ProfileEvent& event : events) {
+        file << std::format(",\n{{\"name\": \"{}\", \"cat\": \"{}\", \"ph\": \"X\", \"pid\": 1, \"tid\": {}, \"ts\": {:.3f}, \"dur\": {:.3f}}}",
+            escape(event.name), event.track == GPU_TRACK ? "gpu" : "cpu", event.track, event.start, event.duration);
+    }
+    file << "\n]}\n";
+}
+
+/**
+ * Discards every recorded interval
+ */
+void Profiler::clear() {
+    std::lock_guard<std::mutex> guard(mutex);
+    events.clear();
+    samples.clear();
+}
+
+ScopedTimer::ScopedTimer(const char* name) : name(name) {
+    Profiler& profiler = Profiler::get();
+    if (profiler.is_enabled())
+        start = profiler.now();
+}
+
+ScopedTimer::~ScopedTimer() {
+    if (start < 0.0)
+        return;
+    Profiler& profiler = Profiler::get();
+    profiler.record(name, profiler.current_track(), start, profiler.now() - start);
+}
\ No newline at end of file
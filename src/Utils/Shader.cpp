@@ -111,18 +111,35 @@ unsigned int Shader::compile_geometry_shader(const std::string& geometry_source_
 }
 
 /**
- * Create a compute shader given the path to a source file.
+ * Reads a shader source file, replacing each line of the form #include "file" with the contents of that file,
+ * which is found relative to the directory of the including file.
  * 
- * @param compute_source_path File path to the Compute Shader
+ * @param source_path File path to the shader source
  */
-ComputeShader::ComputeShader(const std::string& compute_source_path) {
+std::string read_shader_source(const std::string& source_path) {
     std::string line, text;
-    std::ifstream file(compute_source_path);
+    std::ifstream file(source_path);
+    std::string directory = source_path.substr(0, source_path.find_last_of('/') + 1);
+
+    while(std::getline(file, line)) {
+        if (line.rfind("#include \"", 0) == 0) {
+            std::size_t begin = line.find('"') + 1;
+            text += read_shader_source(directory + line.substr(begin, line.find('"', begin) - begin));
+        } else {
+            text += line + "\n";
+        }
+    }
+    return text;
+}
 
+/**
+ * Create a compute shader given the path to a source file. The source may #include other files.
+ * 
+ * @param compute_source_path File path to the Compute Shader
+ */
+ComputeShader::ComputeShader(const std::string& compute_source_path) {
     // Read compute shader from file
-    while(std::getline(file, line))
-        text += line + "\n";
-    file.close();
+    std::string text = read_shader_source(compute_source_path);
     const char* source = text.c_str();
 
     // Compile compute shader and check for errors
@@ -1,4 +1,3 @@
-#include <glad/glad.h>
 #include <triangle/triangle.h>
 #include <glm/gtc/matrix_transform.hpp>
 #include <tinyobjloader/tiny_obj_loader.h>
@@ -7,8 +6,10 @@
 
 #include "Utils/Surface.hpp"
 
+#include <algorithm>
 #include <unordered_map>
 #include <fstream>
+#include <sstream>
 #include <format>
 #include <filesystem>
 #include <iostream>
@@ -17,35 +18,139 @@
 #define TRI_LIBRARY
 
 /**
- * Initialize this surface with a PSLG via triangulation.
- * This will automatically cause the PSLG to become open.
+ * Initialize this surface by triangulating a PSLG on the XZ plane.
  * 
- * @param pslg The PSLG to initialize this surface with.
+ * @param points The vertices of the PSLG. Only their x and z coordinates are used.
+ * @param indices Every pair of indices defines a segment between two points.
+ * @param holes A point inside each closed region that should be left empty.
+ * @param triangle_area The maximum area of each triangle.
  */
-void Surface::init_from_PSLG(PSLG& pslg) {
-    if (pslg.closed()) {
-        clear();
-        std::vector<double> in_vertices(pslg.vertices.size() * 2, 0.0);
-        for (int i = 0; i < in_vertices.size(); i += 2) {
-            in_vertices[i] = pslg.vertices[i/2].x;
-            in_vertices[i+1] = pslg.vertices[i/2].z;
+void Surface::init_from_segments(const std::vector<glm::vec3>& points, const std::vector<unsigned int>& indices, const std::vector<glm::vec3>& holes, float triangle_area) {
+    clear();
+    std::vector<double> in_vertices(points.size() * 2, 0.0);
+    for (int i = 0; i < in_vertices.size(); i += 2) {
+        in_vertices[i] = points[i/2].x;
+        in_vertices[i+1] = points[i/2].z;
+    }
+    std::vector<int> in_segments(indices.begin(), indices.end());
+    std::vector<double> in_holes(holes.size() * 2, 0.0);
+    for (int i = 0; i < in_holes.size(); i += 2) {
+        in_holes[i] = holes[i/2].x;
+        in_holes[i+1] = holes[i/2].z;
+    }
+
+    // With a hierarchy, triangulate coarsely first, then refine one level at a time so that geometric multigrid has coarser meshes to work with.
+    // Each level has about 4 times as many triangles as the last, and the coarsest has on the order of a few hundred.
+    // Without one, the PSLG is triangulated in a single pass at the final triangle area
+    int num_levels = 0;
+    if (build_hierarchy) {
+        glm::vec3 min_corner = points[0], max_corner = points[0];
+        for (const glm::vec3& point : points) {
+            min_corner = glm::min(min_corner, point);
+            max_corner = glm::max(max_corner, point);
         }
-        std::vector<double> in_holes(pslg.holes.size() * 2, 0.0); // TODO: initialization when support for holes is added
-        for (int i = 0; i < in_holes.size(); i += 2) {
-            in_holes[i] = pslg.holes[i/2].x;
-            in_holes[i+1] = pslg.holes[i/2].z;
+        float bounding_area = (max_corner.x - min_corner.x) * (max_corner.z - min_corner.z);
+        num_levels = std::clamp(static_cast<int>(std::log(bounding_area / triangle_area / 512.0f) / std::log(4.0f)), 0, max_coarse_levels);
+    }
+
+    perform_triangulation(in_vertices.data(), points.size(), in_segments.data(), in_segments.size() / 2, in_holes.data(), holes.size(), triangle_area * std::pow(4.0f, num_levels));
+    if (triangles.size() == 0)
+        throw std::runtime_error("Invalid PSLG. Make sure that at least one triangle can be created.");
+
+    for (int level = num_levels - 1; level >= 0; level--) {
+        coarse_levels.push_back({vertices, triangles, on_boundary});
+        refine_triangulation(in_holes.data(), holes.size(), triangle_area * std::pow(4.0f, level));
+    }
+
+    normals = std::vector<glm::vec3>(vertices.size(), glm::vec3(0.0f, 1.0f, 0.0f)); // Normals to the XZ always point in the +Y direction.
+    values = std::vector<float>(vertices.size(), 0.0f);
+    closed = false;
+    initialized = true;
+}
+
+/**
+ * Initialize this surface by triangulating a PSLG from a .poly file, in the format used by Triangle:
+ * https://www.cs.cmu.edu/~quake/triangle.poly.html
+ * The PSLG's x and y coordinates are placed on the XZ plane.
+ * 
+ * @param file_path The path to the .poly file.
+ * @param triangle_area The maximum area of each triangle.
+ */
+void Surface::init_from_poly(const char* file_path, float triangle_area) {
+    std::ifstream file(file_path);
+    if (!file)
+        throw std::runtime_error("A valid file was not provided.");
+
+    // Reads the next line that is not blank or a comment, returning false at the end of the file
+    std::istringstream line;
+    auto read_line = [&]() {
+        std::string text;
+        while (std::getline(file, text)) {
+            text = text.substr(0, text.find('#'));
+            if (text.find_first_not_of(" \t\r") != std::string::npos) {
+                line = std::istringstream(text);
+                return true;
+            }
         }
+        return false;
+    };
+    auto next_line = [&]() -> std::istringstream& {
+        if (!read_line())
+            throw std::runtime_error(std::format("File {} ended before the PSLG was complete.", file_path));
+        return line;
+    };
+
+    int num_points = 0;
+    next_line() >> num_points;
+    if (num_points <= 0)
+        throw std::runtime_error(std::format("File {} has no vertices. Vertices in a separate .node file are not supported.", file_path));
+
+    // Triangle allows numbering from either 0 or 1, as long as it is consistent
+    std::vector<glm::vec3> points(num_points);
+    int first_index = 0;
+    for (int i = 0; i < num_points; i++) {
+        int index;
+        double x, y;
+        if (!(next_line() >> index >> x >> y))
+            throw std::runtime_error(std::format("File {} has an invalid vertex.", file_path));
+        if (i == 0)
+            first_index = index;
+        if (index - first_index < 0 || index - first_index >= num_points)
+            throw std::runtime_error(std::format("File {} has an invalid vertex number {}.", file_path, index));
+        points[index - first_index] = glm::vec3(x, 0.0, y);
+    }
 
-        perform_triangulation(in_vertices.data(), pslg.vertices.size(), reinterpret_cast<int*>(pslg.indices.data()), pslg.indices.size() / 2, in_holes.data(), pslg.holes.size(), pslg.triangle_area);
-        if (triangles.size() == 0)
-            throw std::runtime_error("Invalid PSLG. Make sure that at least one triangle can be created.");
+    int num_segments = 0;
+    next_line() >> num_segments;
+    std::vector<unsigned int> indices;
+    for (int i = 0; i < num_segments; i++) {
+        int index, a, b;
+        if (!(next_line() >> index >> a >> b))
+            throw std::runtime_error(std::format("File {} has an invalid segment.", file_path));
+        a -= first_index;
+        b -= first_index;
+        if (a < 0 || a >= num_points || b < 0 || b >= num_points)
+            throw std::runtime_error(std::format("File {} has a segment with an invalid vertex.", file_path));
+        indices.push_back(a);
+        indices.push_back(b);
+    }
 
-        normals = std::vector<glm::vec3>(vertices.size(), glm::vec3(0.0f, 1.0f, 0.0f)); // Normals to the XZ always point in the +Y direction.
-        values = std::vector<float>(vertices.size(), 0.0f);
-        closed = false;
-        initialized = true;
-        load_buffers();
+    // The list of holes is optional
+    std::vector<glm::vec3> holes;
+    int num_holes = 0;
+    if (read_line())
+        line >> num_holes;
+    for (int i = 0; i < num_holes; i++) {
+        int index;
+        double x, y;
+        if (!(next_line() >> index >> x >> y))
+            throw std::runtime_error(std::format("File {} has an invalid hole.", file_path));
+        holes.push_back(glm::vec3(x, 0.0, y));
     }
+
+    if (indices.empty())
+        throw std::runtime_error(std::format("File {} has no segments.", file_path));
+    init_from_segments(points, indices, holes, triangle_area);
 }
 
 /**
@@ -129,7 +234,6 @@ void Surface::init_from_obj(const char* file_path) {
     values = std::vector<float>(vertices.size(), 0.0f);
     closed = num_boundary_points == 0;
     initialized = true;
-    load_buffers(); 
 }
 
 /**
@@ -284,62 +388,6 @@ void Surface::export_to_ply(const char* file_path, float vertex_extrusion, float
     of.close();
 }
 
-void Surface::calculate_normals(float vertex_extrusion) {
-    if (initialized) {
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vertex_buffer);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, normal_buffer);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, value_buffer);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, element_buffer);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, calculated_normals_buffer);
-
-        int work_group_size = 1024;
-        float zero = 0.0f;
-
-        smooth_normals_compute_shader->bind();
-        smooth_normals_compute_shader->set_float("vertex_extrusion", vertex_extrusion);
-        smooth_normals_compute_shader->set_int("num_vertices", vertices.size());
-        smooth_normals_compute_shader->set_int("num_triangles", triangles.size());
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, calculated_normals_buffer);
-        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32F, GL_RED, GL_FLOAT, &zero);
-        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-        smooth_normals_compute_shader->dispatch_compute((triangles.size() + (work_group_size - 1)) / work_group_size, 1, 1, GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
-    }
-}
-
-/**
- * Renders this surface to the screen.
- */
-void Surface::draw(bool wireframe, float pixel_discard_threshold, glm::vec3 camera_position) {
-    if (initialized) {
-        // Draw Colored Surface
-        fem_mesh_shader->bind();
-        fem_mesh_shader->set_mat4x4("model", glm::mat4(1.0f));
-        fem_mesh_shader->set_vec3("view_pos", camera_position);
-        fem_mesh_shader->set_int("mesh_type", static_cast<int>(MeshType::Open));
-        color_map->set_uniforms(*fem_mesh_shader);
-        glBindVertexArray(vertex_array);
-        glDrawElements(GL_TRIANGLES, triangles.size() * 3, GL_UNSIGNED_INT, 0);
-
-        if (pixel_discard_threshold != 0.0f) {
-            fem_mesh_shader->set_int("mesh_type", static_cast<int>(mesh_type));
-            glBindVertexArray(vertex_array);
-            glDrawElements(GL_TRIANGLES, triangles.size() * 3, GL_UNSIGNED_INT, 0);
-        }
-
-        // Draw Wireframe
-        if (wireframe) {
-            wireframe_shader->bind();
-            wireframe_shader->set_mat4x4("model", glm::mat4(1.0f));
-            wireframe_shader->set_vec3("object_color", EDGE_COLOR);
-            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-            glDepthFunc(GL_LEQUAL);
-            glDrawElements(GL_TRIANGLES, triangles.size() * 3, GL_UNSIGNED_INT, 0);
-            glDepthFunc(GL_LESS);
-            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-        }
-    }
-}
-
 /**
  * Resets this surface by clearing all the data associated with it.
  */
@@ -348,8 +396,9 @@ void Surface::clear() {
     triangles.clear();
     on_boundary.clear();
     values.clear();
+    coarse_levels.clear();
+    segments.clear();
     initialized = false;
-    load_buffers();
 }
 
 /**
@@ -359,65 +408,6 @@ void Surface::clear_values() {
     values = std::vector<float>(vertices.size(), 0.0f);
 }
 
-/**
- * Load all OpenGL buffers (including the value buffer) with their respective data.
- */
-void Surface::load_buffers() {
-    glGenVertexArrays(1, &vertex_array);
-    glBindVertexArray(vertex_array);
-
-    glGenBuffers(1, &vertex_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), vertices.data(), GL_STATIC_DRAW);
-
-    glGenBuffers(1, &normal_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, normal_buffer);
-    glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(glm::vec3), normals.data(), GL_STATIC_DRAW);
-
-    glGenBuffers(1, &value_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, value_buffer);
-    glBufferData(GL_ARRAY_BUFFER, values.size() * sizeof(float), values.data(), GL_STATIC_DRAW);
-
-    glGenBuffers(1, &calculated_normals_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, calculated_normals_buffer);
-    glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(glm::vec3), NULL, GL_DYNAMIC_COPY);
-
-    glGenBuffers(1, &element_buffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, element_buffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, triangles.size() * sizeof(Triangle), triangles.data(), GL_STATIC_DRAW);
-
-    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
-    glEnableVertexAttribArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, normal_buffer);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
-    glEnableVertexAttribArray(1);
-    glBindBuffer(GL_ARRAY_BUFFER, value_buffer);
-    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*)0);
-    glEnableVertexAttribArray(2);
-    glBindBuffer(GL_ARRAY_BUFFER, calculated_normals_buffer); 
-    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
-    glEnableVertexAttribArray(3);
-}
-
-/**
- * Load just the OpenGL buffers associated with the nodal values.
- */
-void Surface::load_value_buffer() {
-    glBindVertexArray(vertex_array);
-    glBindBuffer(GL_ARRAY_BUFFER, value_buffer);
-    glBufferData(GL_ARRAY_BUFFER, values.size() * sizeof(float), values.data(), GL_STATIC_DRAW);
-}
-
-/**
- * Transfers data from the value buffer on the GPU to value array on this Surface object
- */
-void Surface::read_value_buffer() {
-    glBindVertexArray(vertex_array);
-    glBindBuffer(GL_ARRAY_BUFFER, value_buffer);
-    glGetBufferSubData(GL_ARRAY_BUFFER, 0, values.size() * sizeof(float), values.data());
-}
-
 /**
  * Triangulate a PSLG defined by buffers of data.
  * 
@@ -450,9 +440,63 @@ void Surface::perform_triangulation(double* vertices, int num_vertices, int* seg
     tri_out.segmentlist = nullptr;
     tri_out.segmentmarkerlist = nullptr;
     
-    char* args = (char*)(std::format("Qeqpza{}", triangle_area).c_str());
-    triangulate(args, &tri_in, &tri_out, nullptr);
+    std::string args = std::format("Qeqpza{}", triangle_area);
+    triangulate(args.data(), &tri_in, &tri_out, nullptr);
+    load_triangulation(tri_out);
+}
+
+/**
+ * Refines the current triangulation of this surface with Triangle, keeping all of its vertices and boundary segments.
+ * 
+ * @param holes Points inside each of the holes of the PSLG
+ * @param num_holes The number of holes
+ * @param triangle_area The maximum area of the refined triangles
+ */
+void Surface::refine_triangulation(double* holes, int num_holes, float triangle_area) {
+    std::vector<double> in_vertices(vertices.size() * 2);
+    std::vector<int> in_markers(vertices.size());
+    for (int i = 0; i < vertices.size(); i++) {
+        in_vertices[i*2] = vertices[i].x;
+        in_vertices[i*2+1] = vertices[i].z;
+        in_markers[i] = on_boundary[i];
+    }
+    std::vector<int> in_triangles(triangles.size() * 3);
+    for (int i = 0; i < triangles.size(); i++)
+        for (int j = 0; j < 3; j++)
+            in_triangles[i*3+j] = triangles[i][2 - j];
+
+    triangulateio tri_in = {};
+    tri_in.pointlist = in_vertices.data();
+    tri_in.numberofpoints = vertices.size();
+    tri_in.numberofpointattributes = 0;
+    tri_in.pointmarkerlist = in_markers.data();
+
+    tri_in.trianglelist = in_triangles.data();
+    tri_in.numberoftriangles = triangles.size();
+    tri_in.numberofcorners = 3;
+    tri_in.numberoftriangleattributes = 0;
+
+    tri_in.segmentlist = segments.data();
+    tri_in.numberofsegments = segments.size() / 2;
+    tri_in.segmentmarkerlist = nullptr;
 
+    tri_in.holelist = holes;
+    tri_in.numberofholes = num_holes;
+    tri_in.regionlist = nullptr;
+    tri_in.numberofregions = 0;
+
+    triangulateio tri_out = {};
+    std::string args = std::format("Qeqrpza{}", triangle_area);
+    triangulate(args.data(), &tri_in, &tri_out, nullptr);
+
+    triangles.clear();
+    load_triangulation(tri_out);
+}
+
+/**
+ * Copies the output of Triangle into this surface and frees it
+ */
+void Surface::load_triangulation(triangulateio& tri_out) {
     this->vertices = std::vector<glm::vec3>(tri_out.numberofpoints, glm::vec3(0.0));
     for (int i = 0; i < tri_out.numberofpoints; i++) {
         this->vertices[i] = glm::vec3(
@@ -476,8 +520,10 @@ void Surface::perform_triangulation(double* vertices, int num_vertices, int* seg
         if (on_boundary[i])
             num_boundary_points++;
     }
+    segments = std::vector<int>(tri_out.segmentlist, tri_out.segmentlist + tri_out.numberofsegments * 2);
 
     if (tri_out.pointlist != nullptr) free(tri_out.pointlist);
+    if (tri_out.pointmarkerlist != nullptr) free(tri_out.pointmarkerlist);
     if (tri_out.trianglelist!= nullptr) free(tri_out.trianglelist);
     if (tri_out.segmentlist != nullptr) free(tri_out.segmentlist);
     if (tri_out.segmentmarkerlist != nullptr) free(tri_out.segmentmarkerlist);
@@ -0,0 +1,147 @@
+#include <glad/glad.h>
+
+#include "Utils/Surface.hpp"
+#include "Utils/Profiler.hpp"
+
+#include <format>
+
+// The parts of Surface that need an OpenGL context or the PSLG editor. The geometry is in Surface.cpp,
+// which builds without them so that the solver can run headless.
+
+/**
+ * Initialize this surface with a PSLG via triangulation.
+ * This will automatically cause the PSLG to become open.
+ * 
+ * @param pslg The PSLG to initialize this surface with.
+ */
+void Surface::init_from_PSLG(PSLG& pslg) {
+    if (pslg.closed())
+        init_from_segments(pslg.vertices, pslg.indices, pslg.holes, pslg.triangle_area);
+}
+
+void Surface::calculate_normals(float vertex_extrusion) {
+    ScopedTimer timer("Surface::calculate_normals");
+    if (initialized) {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vertex_buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, normal_buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, value_buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, element_buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, calculated_normals_buffer);
+
+        int work_group_size = 1024;
+        float zero = 0.0f;
+
+        smooth_normals_compute_shader->bind();
+        smooth_normals_compute_shader->set_float("vertex_extrusion", vertex_extrusion);
+        smooth_normals_compute_shader->set_int("num_vertices", vertices.size());
+        smooth_normals_compute_shader->set_int("num_triangles", triangles.size());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, calculated_normals_buffer);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32F, GL_RED, GL_FLOAT, &zero);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        smooth_normals_compute_shader->dispatch_compute((triangles.size() + (work_group_size - 1)) / work_group_size, 1, 1, GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    }
+}
+
+/**
+ * Renders this surface to the screen.
+ */
+void Surface::draw(bool wireframe, float pixel_discard_threshold, glm::vec3 camera_position) {
+    ScopedTimer timer("Surface::draw");
+    if (initialized) {
+        // Draw Colored Surface
+        fem_mesh_shader->bind();
+        fem_mesh_shader->set_mat4x4("model", glm::mat4(1.0f));
+        fem_mesh_shader->set_vec3("view_pos", camera_position);
+        fem_mesh_shader->set_int("mesh_type", static_cast<int>(MeshType::Open));
+        for (int i = 0; i < color_map->coeffs.size(); i++)
+            fem_mesh_shader->set_vec3(std::format("c{}", i), color_map->coeffs[i]);
+        glBindVertexArray(vertex_array);
+        glDrawElements(GL_TRIANGLES, triangles.size() * 3, GL_UNSIGNED_INT, 0);
+
+        if (pixel_discard_threshold != 0.0f) {
+            fem_mesh_shader->set_int("mesh_type", static_cast<int>(mesh_type));
+            glBindVertexArray(vertex_array);
+            glDrawElements(GL_TRIANGLES, triangles.size() * 3, GL_UNSIGNED_INT, 0);
+        }
+
+        // Draw Wireframe
+        if (wireframe) {
+            wireframe_shader->bind();
+            wireframe_shader->set_mat4x4("model", glm::mat4(1.0f));
+            wireframe_shader->set_vec3("object_color", EDGE_COLOR);
+            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+            glDepthFunc(GL_LEQUAL);
+            glDrawElements(GL_TRIANGLES, triangles.size() * 3, GL_UNSIGNED_INT, 0);
+            glDepthFunc(GL_LESS);
+            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        }
+    }
+}
+
+/**
+ * Load all OpenGL buffers (including the value buffer) with their respective data.
+ */
+void Surface::load_buffers() {
+    glGenVertexArrays(1, &vertex_array);
+    glBindVertexArray(vertex_array);
+
+    glGenBuffers(1, &vertex_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), vertices.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &normal_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, normal_buffer);
+    glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(glm::vec3), normals.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &value_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, value_buffer);
+    glBufferData(GL_ARRAY_BUFFER, values.size() * sizeof(float), values.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &calculated_normals_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, calculated_normals_buffer);
+    glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(glm::vec3), NULL, GL_DYNAMIC_COPY);
+
+    glGenBuffers(1, &element_buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, element_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, triangles.size() * sizeof(Triangle), triangles.data(), GL_STATIC_DRAW);
+
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+    glEnableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, normal_buffer);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+    glEnableVertexAttribArray(1);
+    glBindBuffer(GL_ARRAY_BUFFER, value_buffer);
+    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*)0);
+    glEnableVertexAttribArray(2);
+    glBindBuffer(GL_ARRAY_BUFFER, calculated_normals_buffer); 
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+    glEnableVertexAttribArray(3);
+}
+
+/**
+ * Load just the OpenGL buffers associated with the nodal values.
+ */
+void Surface::load_value_buffer() {
+    load_value_buffer(values);
+}
+
+/**
+ * Load the OpenGL buffer of nodal values from a copy of the values, such as one made by a SimulationThread
+ * while it goes on changing the values on this Surface.
+ */
+void Surface::load_value_buffer(const std::vector<float>& values) {
+    ScopedTimer timer("Surface::load_value_buffer");
+    glBindVertexArray(vertex_array);
+    glBindBuffer(GL_ARRAY_BUFFER, value_buffer);
+    glBufferData(GL_ARRAY_BUFFER, values.size() * sizeof(float), values.data(), GL_STATIC_DRAW);
+}
+
+/**
+ * Transfers data from the value buffer on the GPU to value array on this Surface object
+ */
+void Surface::read_value_buffer() {
+    glBindVertexArray(vertex_array);
+    glBindBuffer(GL_ARRAY_BUFFER, value_buffer);
+    glGetBufferSubData(GL_ARRAY_BUFFER, 0, values.size() * sizeof(float), values.data());
+}
\ No newline at end of file